@@ -0,0 +1,332 @@
+/*!
+ * \file   multipart_upload.c
+ * \brief  Upload benchmark of multipart uploads against a running server. A file is
+ *         uploaded with a single PUT, or as parts over as many concurrent connections,
+ *         then completed. Each connection may be capped to a rate, as a client behind a
+ *         per-flow bottleneck is. It prints the time and aggregate rate of the upload,
+ *         and the time the server took to assemble the parts.
+ *
+ *         Usage: multipart_upload PORT FILE PATH PARTS [BYTES_PER_SECOND]
+ *         PARTS 0 uploads the file with a single PUT. The server listens on 127.0.0.1.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+
+#define AKWBS_BENCH_SEND_SIZE (256 * 1024) /*!< Bytes handed to send at once.           */
+
+#define AKWBS_BENCH_REPLY_SIZE 1024        /*!< Bytes of a reply kept.                  */
+
+#define AKWBS_BENCH_MAX_PARTS  10000       /*!< Most parts of an upload.                */
+
+#define AKWBS_BENCH_MIN(a, b) (((a) < (b)) ? (a) : (b)) /*!< Smaller of two sizes.      */
+
+
+/*!
+ * A PUT of the benchmark.
+ */
+struct akwbs_bench_put
+{
+  const char *path;             /*!< Request path, with its query.                      */
+  const char *body;             /*!< Body sent.                                         */
+  size_t length;                /*!< Bytes of the body.                                 */
+  char reply
+    [AKWBS_BENCH_REPLY_SIZE];   /*!< Start of the reply, NUL terminated.                */
+  int status;                   /*!< Status code of the reply, or AKWBS_ERROR.          */
+};
+
+
+static uint16_t port;           /*!< Port of the server.                                */
+
+static double rate;             /*!< Bytes per second of a connection, or 0.            */
+
+
+/*!
+ * Seconds on the monotonic clock.
+ *
+ * \return the time.
+ */
+static double now(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/*!
+ * Send a PUT over a new connection, at most at the rate set, and read its whole reply.
+ *
+ * \param arg param-return the PUT. Its reply and status are set.
+ *
+ * \return NULL, as a thread routine.
+ */
+static void *send_put(void *arg)
+{
+  struct akwbs_bench_put *put = (struct akwbs_bench_put *)arg;
+  struct sockaddr_in address;
+  char header[512];
+  size_t sent  = 0;
+  size_t kept  = 0;
+  ssize_t ret  = 0;
+  double start = 0;
+  double ahead = 0;
+  int length   = 0;
+  int sd       = AKWBS_ERROR;
+
+
+  put->status   = AKWBS_ERROR;
+  put->reply[0] = '\0';
+
+  memset(&address, 0, sizeof(address));
+
+  address.sin_family      = AF_INET;
+  address.sin_port        = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  sd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if ((sd == AKWBS_ERROR)
+      || (connect(sd, (struct sockaddr *)&address, sizeof(address)) == AKWBS_ERROR))
+    goto close_and_return;
+
+  length = snprintf(header,
+                    sizeof(header),
+                    "PUT %s HTTP/1.0\r\nContent-Length: %zu\r\n\r\n",
+                    put->path,
+                    put->length);
+
+  if (send(sd, header, (size_t)length, 0) != length)
+    goto close_and_return;
+
+  start = now();
+
+  while (sent < put->length)
+  {
+    ret = send(sd,
+               put->body + sent,
+               AKWBS_BENCH_MIN(put->length - sent, AKWBS_BENCH_SEND_SIZE),
+               0);
+
+    if (ret <= 0)
+      goto close_and_return;
+
+    sent += (size_t)ret;
+
+    if (rate > 0)
+    {
+      ahead = (double)sent / rate - (now() - start);
+
+      if (ahead > 0)
+        usleep((useconds_t)(ahead * 1e6));
+    }
+  }
+
+  while ((ret = recv(sd, put->reply + kept, sizeof(put->reply) - 1 - kept, 0)) > 0)
+    kept += (size_t)ret;
+
+  put->reply[kept] = '\0';
+
+  if (sscanf(put->reply, "HTTP/%*s %d", &put->status) != 1)
+    put->status = AKWBS_ERROR;
+
+close_and_return:
+  if (sd != AKWBS_ERROR)
+    close(sd);
+
+  return NULL;
+}
+
+
+/*!
+ * Upload a file as parts over concurrent connections, and complete it.
+ *
+ * \param path request path of the file.
+ * \param data bytes of the file.
+ * \param size size of the file.
+ * \param parts number of parts.
+ * \param assembly param-return seconds the completion took.
+ *
+ * \return AKWBS_SUCCESS if every request succeeded. AKWBS_ERROR otherwise.
+ */
+static int upload_parts(const char *path,
+                        const char *data,
+                        size_t size,
+                        unsigned long parts,
+                        double *assembly)
+{
+  struct akwbs_bench_put control;
+  struct akwbs_bench_put *part_puts = NULL;
+  pthread_t *threads = NULL;
+  char upload_id[64];
+  char *paths = NULL;
+  const char *field = NULL;
+  size_t part_size = (size + parts - 1) / parts;
+  size_t offset    = 0;
+  double start = 0;
+  int ret = AKWBS_SUCCESS;
+  unsigned long i;
+
+
+  part_puts    = calloc(parts, sizeof(struct akwbs_bench_put));
+  threads = calloc(parts, sizeof(pthread_t));
+  paths   = calloc(parts, PATH_MAX);
+
+  if ((part_puts == NULL) || (threads == NULL) || (paths == NULL))
+    return AKWBS_ERROR;
+
+  snprintf(paths, PATH_MAX, "%s?uploads", path);
+
+  control.path   = paths;
+  control.body   = NULL;
+  control.length = 0;
+
+  send_put(&control);
+
+  field = strstr(control.reply, "Upload-Id: ");
+
+  if ((control.status != 201) || (field == NULL)
+      || (sscanf(field, "Upload-Id: %63[0-9a-zA-Z]", upload_id) != 1))
+    return AKWBS_ERROR;
+
+  for (i = 0; i < parts; i++)
+  {
+    snprintf(paths + i * PATH_MAX,
+             PATH_MAX,
+             "%s?uploadId=%s&partNumber=%lu",
+             path,
+             upload_id,
+             i + 1);
+
+    part_puts[i].path   = paths + i * PATH_MAX;
+    offset = AKWBS_BENCH_MIN(i * part_size, size);
+
+    part_puts[i].body   = data + offset;
+    part_puts[i].length = AKWBS_BENCH_MIN(part_size, size - offset);
+
+    if (pthread_create(&threads[i], NULL, send_put, &part_puts[i]) != AKWBS_SUCCESS)
+      return AKWBS_ERROR;
+  }
+
+  for (i = 0; i < parts; i++)
+  {
+    pthread_join(threads[i], NULL);
+
+    if (part_puts[i].status != 201)
+      ret = AKWBS_ERROR;
+  }
+
+  snprintf(paths, PATH_MAX, "%s?uploadId=%s&complete", path, upload_id);
+  control.path = paths;
+
+  start = now();
+  send_put(&control);
+  *assembly = now() - start;
+
+  if (control.status != 201)
+    ret = AKWBS_ERROR;
+
+  free(paths);
+  free(threads);
+  free(part_puts);
+
+  return ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+  struct akwbs_bench_put put;
+  struct stat stat_buf;
+  unsigned long parts = 0;
+  double assembly = 0;
+  double start    = 0;
+  double seconds  = 0;
+  char *data = NULL;
+  int ret = AKWBS_ERROR;
+  int fd  = AKWBS_ERROR;
+
+
+  if ((argc != 5) && (argc != 6))
+  {
+    fprintf(stderr, "Usage: %s PORT FILE PATH PARTS [BYTES_PER_SECOND]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  port  = (uint16_t)strtoul(argv[1], NULL, 10);
+  parts = strtoul(argv[4], NULL, 10);
+  rate  = (argc == 6) ? strtod(argv[5], NULL) : 0;
+
+  fd = open(argv[2], O_RDONLY);
+
+  if ((fd == AKWBS_ERROR) || (fstat(fd, &stat_buf) == AKWBS_ERROR)
+      || (stat_buf.st_size == 0) || (parts > AKWBS_BENCH_MAX_PARTS))
+  {
+    fprintf(stderr, "Cannot upload %s.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  data = mmap(NULL,
+              (size_t)stat_buf.st_size,
+              PROT_READ,
+              MAP_PRIVATE | MAP_POPULATE,
+              fd,
+              0);
+
+  if (data == MAP_FAILED)
+    return EXIT_FAILURE;
+
+  start = now();
+
+  if (parts == 0)
+  {
+    put.path   = argv[3];
+    put.body   = data;
+    put.length = (size_t)stat_buf.st_size;
+
+    send_put(&put);
+
+    ret = (put.status == 201) ? AKWBS_SUCCESS : AKWBS_ERROR;
+  }
+  else
+    ret = upload_parts(argv[3], data, (size_t)stat_buf.st_size, parts, &assembly);
+
+  seconds = now() - start;
+
+  if (ret == AKWBS_ERROR)
+  {
+    fprintf(stderr, "The upload failed.\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%lu parts: %.3f s, %.1f MB/s, assembly %.3f s\n",
+         parts,
+         seconds,
+         (double)stat_buf.st_size / seconds / 1e6,
+         assembly);
+
+  munmap(data, (size_t)stat_buf.st_size);
+  close(fd);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,351 @@
+/*!
+ * \file   pool_contention.c
+ * \brief  Contention benchmark of the I/O working threads. The event loop is played by
+ *         the main thread: it keeps AKWBS_BENCH_IN_FLIGHT cached 4 KB reads in flight
+ *         over AKWBS_BENCH_FILES files, reading each result back from the result socket
+ *         pair and handing the next read of that connection to the pool at once. It
+ *         prints the requests served per second, and the context switches per request.
+ *         With "fifo", the reads go to a single queue under one mutex and condition
+ *         variable, served by as many threads, as the pool did before its deques: both
+ *         designs are measured with the same load.
+ *
+ *         Usage: pool_contention IO_THREADS [fifo | name=value ...]
+ *         The options are those of the server, such as latency_reserve=0.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "conf.h"
+#include "connection.h"
+#include "daemon.h"
+#include "internal.h"
+#include "io.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "resultio.h"
+
+
+#define AKWBS_BENCH_FILES       64          /*!< Files read.                            */
+
+#define AKWBS_BENCH_IN_FLIGHT  256          /*!< Reads in flight, one per connection.   */
+
+#define AKWBS_BENCH_BLOCK     4096          /*!< Bytes of a read.                       */
+
+#define AKWBS_BENCH_FILE_SIZE (1 << 20)     /*!< Bytes of a file.                       */
+
+#define AKWBS_BENCH_REQUESTS 300000         /*!< Reads served per run.                  */
+
+
+/*!
+ * Single queue of reads, served by every thread: the baseline of the deques.
+ */
+struct akwbs_bench_fifo
+{
+  pthread_mutex_t mutex;        /*!< Lock of the queue.                                 */
+  pthread_cond_t cond;          /*!< Signaled on every read queued.                     */
+  struct akwbs_request_io_msg
+    jobs[AKWBS_BENCH_IN_FLIGHT]; /*!< Ring of the reads queued, as many as in flight.   */
+  unsigned long head;           /*!< Sequence of the next read taken.                   */
+  unsigned long tail;           /*!< Sequence of the next read queued.                  */
+  int result_sd;                /*!< Where the results are sent.                        */
+};
+
+
+static struct akwbs_bench_fifo fifo; /*!< The queue, when the baseline is measured.     */
+
+static int is_fifo = AKWBS_NO;       /*!< Is the baseline measured.                     */
+
+
+/*!
+ * Create the files read, in a new temporary directory.
+ *
+ * \param directory param-return path of the directory, a mkdtemp template.
+ * \param fds param-return descriptors of the files.
+ * \param stats param-return status of the files, as the opened-file tree holds it.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR on error.
+ */
+static int create_files(char *directory, int *fds, struct akwbs_file_stat *stats)
+{
+  static char block[AKWBS_BENCH_BLOCK];
+  char path[64];
+  struct stat stat_buf;
+  int i;
+  int j;
+
+
+  if (mkdtemp(directory) == NULL)
+    return AKWBS_ERROR;
+
+  memset(block, 'x', sizeof(block));
+
+  for (i = 0; i < AKWBS_BENCH_FILES; i++)
+  {
+    snprintf(path, sizeof(path), "%s/f%d", directory, i);
+
+    fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fds[i] == AKWBS_ERROR)
+      return AKWBS_ERROR;
+
+    unlink(path);
+
+    for (j = 0; j < AKWBS_BENCH_FILE_SIZE / AKWBS_BENCH_BLOCK; j++)
+      if (write(fds[i], block, sizeof(block)) != sizeof(block))
+        return AKWBS_ERROR;
+
+    if (fstat(fds[i], &stat_buf) == AKWBS_ERROR)
+      return AKWBS_ERROR;
+
+    memset(&stats[i], 0, sizeof(struct akwbs_file_stat));
+
+    stats[i].inode_number    = stat_buf.st_ino;
+    stats[i].device          = stat_buf.st_dev;
+    stats[i].file_descriptor = fds[i];
+  }
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Routine of the threads serving the single queue: take a read, do it and send its
+ * result, as the working threads do.
+ *
+ * \param arg unused.
+ *
+ * \return never.
+ */
+static void *fifo_routine(void *arg)
+{
+  struct akwbs_request_io_msg msg;
+  struct akwbs_result_io result_msg;
+
+
+  (void)arg;
+
+  while (1)
+  {
+    pthread_mutex_lock(&fifo.mutex);
+
+    while (fifo.head == fifo.tail)
+      pthread_cond_wait(&fifo.cond, &fifo.mutex);
+
+    msg = fifo.jobs[fifo.head % AKWBS_BENCH_IN_FLIGHT];
+    fifo.head++;
+
+    pthread_mutex_unlock(&fifo.mutex);
+
+    memset(&result_msg, 0, sizeof(result_msg));
+
+    if (akwbs_do_io(msg.fd, msg.address, &msg.bytes, &msg.offset, msg.type)
+        == AKWBS_ERROR)
+      result_msg.error = errno;
+
+    result_msg.bytes_read    = msg.bytes;
+    result_msg.connection_fd = msg.sd;
+    result_msg.type          = msg.type;
+    result_msg.address       = msg.address;
+
+    akwbs_result_io_send_msg(&result_msg, fifo.result_sd);
+  }
+
+  return NULL;
+}
+
+
+/*!
+ * Start the threads serving the single queue.
+ *
+ * \param threads number of threads.
+ * \param result_sd where the results are sent.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR on error.
+ */
+static int create_fifo(unsigned long threads, int result_sd)
+{
+  pthread_t thread;
+  unsigned long i;
+
+
+  if ((pthread_mutex_init(&fifo.mutex, NULL) != AKWBS_SUCCESS)
+      || (pthread_cond_init(&fifo.cond, NULL) != AKWBS_SUCCESS))
+    return AKWBS_ERROR;
+
+  fifo.result_sd = result_sd;
+
+  for (i = 0; i < threads; i++)
+    if (pthread_create(&thread, NULL, fifo_routine, NULL) != AKWBS_SUCCESS)
+      return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Hand the next read of a connection to the pool, waiting while every deque is full.
+ *
+ * \param connection the connection.
+ * \param index index of the connection, sent back with its result.
+ */
+static void submit_read(struct akwbs_connection *connection, int index)
+{
+  struct akwbs_request_io_msg *msg = &connection->pending_io_msg;
+
+
+  msg->sd     = index;
+  msg->fd     = connection->file_descriptor;
+  msg->bytes  = AKWBS_BENCH_BLOCK;
+  msg->offset = connection->file_cur_offset;
+  msg->type   = AKWBS_IO_GET_TYPE;
+
+  connection->file_cur_offset = (connection->file_cur_offset + AKWBS_BENCH_BLOCK)
+                                % AKWBS_BENCH_FILE_SIZE;
+
+  if (is_fifo == AKWBS_YES)
+  {
+    pthread_mutex_lock(&fifo.mutex);
+
+    fifo.jobs[fifo.tail % AKWBS_BENCH_IN_FLIGHT] = *msg;
+    fifo.tail++;
+
+    pthread_cond_signal(&fifo.cond);
+    pthread_mutex_unlock(&fifo.mutex);
+
+    return;
+  }
+
+  while (akwbs_pool_submit(connection, msg) == AKWBS_ERROR)
+    sched_yield();
+}
+
+
+int main(int argc, char *argv[])
+{
+  static struct akwbs_daemon daemon_s;
+  static struct akwbs_connection connections[AKWBS_BENCH_IN_FLIGHT];
+  struct akwbs_server_conf conf;
+  struct akwbs_file_stat stats[AKWBS_BENCH_FILES];
+  struct akwbs_result_io result_msg;
+  struct timespec start;
+  struct timespec end;
+  struct rusage usage_start;
+  struct rusage usage_end;
+  char directory[] = "/tmp/akwbs-bench-XXXXXX";
+  int fds[AKWBS_BENCH_FILES];
+  long served = 0;
+  long sent   = 0;
+  long switches;
+  double seconds;
+  int i;
+
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s IO_THREADS [fifo | name=value ...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  memset(&conf, 0, sizeof(conf));
+  akwbs_conf_set_defaults(&conf);
+
+  conf.io_threads = strtoul(argv[1], NULL, 10);
+
+  for (i = 2; i < argc; i++)
+    if (strcmp(argv[i], "fifo") == 0)
+      is_fifo = AKWBS_YES;
+    else if (akwbs_conf_parse_option(&conf, argv[i]) == AKWBS_ERROR)
+      return EXIT_FAILURE;
+
+  if (create_files(directory, fds, stats) == AKWBS_ERROR)
+  {
+    perror("create_files");
+    return EXIT_FAILURE;
+  }
+
+  conf.root_path = directory;
+
+  daemon_s.io_threads      = conf.io_threads;
+  daemon_s.io_threads_max  = conf.io_threads;
+  daemon_s.latency_bytes   = conf.latency_bytes;
+  daemon_s.latency_reserve = conf.latency_reserve;
+  daemon_s.read_depth      = conf.read_depth;
+
+  if ((socketpair(AF_LOCAL, SOCK_DGRAM, 0, daemon_s.result_io_queue) == AKWBS_ERROR)
+      || (akwbs_pool_create(&daemon_s, &conf) == AKWBS_ERROR)
+      || ((is_fifo == AKWBS_YES)
+          && (create_fifo(conf.io_threads,
+                          daemon_s.result_io_queue[AKWBS_WRITE_INDEX]) == AKWBS_ERROR)))
+  {
+    fprintf(stderr, "Could not create the pool.\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < AKWBS_BENCH_IN_FLIGHT; i++)
+  {
+    if (ring_buffer_create(&connections[i].buffer,
+                           akwbs_pipeline_buffer_order(conf.read_depth)) == AKWBS_ERROR)
+      return EXIT_FAILURE;
+
+    connections[i].file_descriptor        = fds[i % AKWBS_BENCH_FILES];
+    connections[i].file_stat              = &stats[i % AKWBS_BENCH_FILES];
+    connections[i].io_type                = AKWBS_IO_GET_TYPE;
+    connections[i].daemon_ref             = &daemon_s;
+    connections[i].io_group               = akwbs_pool_assign(&daemon_s,
+                                                              &connections[i].buffer);
+    connections[i].pending_io_msg.address = connections[i].buffer.address;
+  }
+
+  getrusage(RUSAGE_SELF, &usage_start);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < AKWBS_BENCH_IN_FLIGHT; i++, sent++)
+    submit_read(&connections[i], i);
+
+  while (served < AKWBS_BENCH_REQUESTS)
+  {
+    if (akwbs_result_io_recv_msg(&result_msg, daemon_s.result_io_queue[AKWBS_READ_INDEX])
+        == AKWBS_ERROR)
+      continue;
+
+    served++;
+
+    if (sent < AKWBS_BENCH_REQUESTS)
+    {
+      submit_read(&connections[result_msg.connection_fd], result_msg.connection_fd);
+      sent++;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &usage_end);
+
+  seconds  = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  switches = (usage_end.ru_nvcsw - usage_start.ru_nvcsw)
+             + (usage_end.ru_nivcsw - usage_start.ru_nivcsw);
+
+  printf("%lu threads, %s: %.0f requests/s, %.2f context switches/request\n",
+         conf.io_threads,
+         (is_fifo == AKWBS_YES) ? "single queue" : "deques",
+         (double)served / seconds,
+         (double)switches / (double)served);
+
+  rmdir(directory);
+
+  /* The working threads wait for requests forever; they go with the process. */
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
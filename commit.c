@@ -0,0 +1,228 @@
+/*!
+ * \file   commit.c
+ * \brief  Durability of uploads. A finished upload is synced by a working thread, or
+ *         handed to the group commit thread, which syncs every upload finishing within
+ *         a small window together, so they share the device flushes and journal commits.
+ *         The data is on disk before the upload gets its name, and the name is on disk
+ *         before the 201 is sent.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "commit.h"
+#include "connection.h"
+#include "daemon.h"
+#include "pool.h"
+#include "internal.h"
+#include "requestio.h"
+#include "resultio.h"
+#include "upload.h"
+
+
+/*!
+ * Start publishing the finished upload of a connection, made durable first unless the
+ * durability is none. Its 201 is held back until a sync result arrives for it.
+ *
+ * \param connection connection whose upload is completely written.
+ *
+ * \return AKWBS_SUCCESS on success, the connection then waits for the sync result.
+ *         AKWBS_ERROR if the sync could not be queued now; it may be retried later.
+ */
+int akwbs_commit_start_sync(struct akwbs_connection *connection)
+{
+  struct akwbs_daemon *daemon_p = connection->daemon_ref;
+  struct akwbs_request_io_msg msg;
+
+
+  switch (daemon_p->durability)
+  {
+    case AKWBS_DURABILITY_NONE:
+    case AKWBS_DURABILITY_FSYNC:
+      bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+      msg.sd           = connection->client_socket;
+      msg.fd           = connection->file_descriptor;
+      msg.directory_fd = connection->upload.directory_descriptor;
+      msg.type         = AKWBS_IO_SYNC_TYPE;
+      msg.connection   = connection;
+
+      if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+        return AKWBS_ERROR;
+      break;
+    case AKWBS_DURABILITY_GROUP:
+      if (pthread_mutex_lock(&daemon_p->commit_mutex) != AKWBS_SUCCESS)
+        return AKWBS_ERROR;
+
+      if (daemon_p->commit_count == AKWBS_COMMIT_MAX_BATCH)
+      {
+        pthread_mutex_unlock(&daemon_p->commit_mutex);
+        return AKWBS_ERROR;
+      }
+
+      daemon_p->commit_queue[daemon_p->commit_count].connection = connection;
+      daemon_p->commit_queue[daemon_p->commit_count].sd         = connection->client_socket;
+      daemon_p->commit_count++;
+
+      pthread_cond_signal(&daemon_p->commit_cond);
+      pthread_mutex_unlock(&daemon_p->commit_mutex);
+      break;
+    default:
+      return AKWBS_ERROR;
+  }
+
+  connection->sync_state        = AKWBS_SYNC_IN_PROGRESS;
+  connection->is_waiting_result = AKWBS_YES;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Sync an uploaded file, give it its name, and sync the directory entry naming it. Only
+ * the name is given if the durability is none. Called by working threads and the group
+ * commit thread; the event loop leaves the connection alone until the result.
+ *
+ * \param connection connection whose upload is completely written.
+ *
+ * \return AKWBS_SUCCESS once the file is published and on disk, AKWBS_ERROR on error.
+ *
+ * \details The name is given only once the data is durable, so a crash never leaves the
+ *          name on a file whose blocks were not written.
+ */
+int akwbs_commit_sync(struct akwbs_connection *connection)
+{
+  int directory_fd = connection->upload.directory_descriptor;
+  int is_durable   = (connection->daemon_ref->durability != AKWBS_DURABILITY_NONE)
+                     ? AKWBS_YES : AKWBS_NO;
+
+
+  if ((is_durable == AKWBS_YES) && (fdatasync(connection->file_descriptor) == AKWBS_ERROR))
+    return AKWBS_ERROR;
+
+  if ((connection->upload.is_published == AKWBS_NO)
+      && (akwbs_upload_publish(connection) == AKWBS_ERROR))
+    return AKWBS_ERROR;
+
+  if ((is_durable == AKWBS_YES)
+      && (directory_fd != AKWBS_ERROR)
+      && (fsync(directory_fd) == AKWBS_ERROR))
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Clean up handler called when the group commit thread is cancelled.
+ *
+ * \param arg pointer to the daemon structure.
+ */
+static void commit_cleanup_routine(void *arg)
+{
+  struct akwbs_daemon *daemon_p = (struct akwbs_daemon *)arg;
+
+
+  pthread_mutex_unlock(&daemon_p->commit_mutex);
+}
+
+
+/*!
+ * Sync a batch of uploads and send their results.
+ *
+ * \param daemon_p pointer to the daemon structure.
+ * \param batch uploads to be synced.
+ * \param count number of uploads.
+ *
+ * \details Writeback of every file is started first, so the data of the whole batch is
+ *          queued to the device at once. The fdatasync calls that follow mostly find
+ *          their data written and their metadata carried by an earlier journal commit.
+ */
+static void commit_batch(struct akwbs_daemon *daemon_p,
+                         struct akwbs_commit_entry *batch,
+                         unsigned int count)
+{
+  struct akwbs_result_io result_msg;
+  unsigned int i;
+
+
+  for (i = 0; i < count; i++)
+    sync_file_range(batch[i].connection->file_descriptor, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+  for (i = 0; i < count; i++)
+  {
+    akwbs_result_io_init_msg(&result_msg);
+
+    result_msg.connection_fd = batch[i].sd;
+    result_msg.type          = AKWBS_IO_SYNC_TYPE;
+    result_msg.connection    = batch[i].connection;
+    result_msg.bytes_read    = (size_t)akwbs_commit_sync(batch[i].connection);
+
+    akwbs_result_io_send_msg(&result_msg, daemon_p->result_io_queue[AKWBS_WRITE_INDEX]);
+  }
+}
+
+
+/*!
+ * Main routine of the group commit thread.
+ *
+ * \param arg pointer to the daemon structure.
+ */
+void *akwbs_commit_thread_routine(void *arg)
+{
+  struct akwbs_daemon *daemon_p = NULL;
+  struct akwbs_commit_entry batch[AKWBS_COMMIT_MAX_BATCH];
+  unsigned int count = 0;
+
+
+  if (arg == NULL)
+    pthread_exit(NULL);
+
+  daemon_p = (struct akwbs_daemon *)arg;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+
+  pthread_cleanup_push(commit_cleanup_routine, daemon_p)
+
+  while (1)
+  {
+    if (pthread_mutex_lock(&daemon_p->commit_mutex) != AKWBS_SUCCESS)
+      pthread_exit(NULL);
+
+    while (daemon_p->commit_count == 0)
+      if (pthread_cond_wait(&daemon_p->commit_cond, &daemon_p->commit_mutex)
+          != AKWBS_SUCCESS)
+      {
+        pthread_mutex_unlock(&daemon_p->commit_mutex);
+        pthread_exit(NULL);
+      }
+
+    pthread_mutex_unlock(&daemon_p->commit_mutex);
+
+    /* Let the uploads finishing right after the first one join its group. */
+    if (daemon_p->commit_window_us > 0)
+      usleep(daemon_p->commit_window_us);
+
+    if (pthread_mutex_lock(&daemon_p->commit_mutex) != AKWBS_SUCCESS)
+      pthread_exit(NULL);
+
+    count = daemon_p->commit_count;
+    memcpy(batch, daemon_p->commit_queue, count * sizeof(struct akwbs_commit_entry));
+    daemon_p->commit_count = 0;
+
+    pthread_mutex_unlock(&daemon_p->commit_mutex);
+
+    commit_batch(daemon_p, batch, count);
+  }
+
+  pthread_cleanup_pop(0);
+
+  pthread_exit(NULL);
+}
@@ -0,0 +1,38 @@
+/*!
+ * \file   commit.h
+ * \brief  Durability of uploads: syncing finished uploads, alone or in groups.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_COMMIT_H_
+#define _AKWBS_MT_COMMIT_H_
+
+#include <sys/select.h>
+
+
+#define AKWBS_COMMIT_MAX_BATCH FD_SETSIZE  /*!< One entry per possible connection.      */
+
+
+struct akwbs_connection;
+struct akwbs_daemon;
+
+
+/*!
+ * An upload waiting for the next group commit.
+ */
+struct akwbs_commit_entry
+{
+  struct akwbs_connection
+    *connection;                /*!< Connection whose upload is committed.              */
+  int sd;                       /*!< Socket of the uploading connection.                */
+};
+
+
+/*
+ * Public Interface.
+ */
+int akwbs_commit_start_sync(struct akwbs_connection *connection);
+int akwbs_commit_sync(struct akwbs_connection *connection);
+void *akwbs_commit_thread_routine(void *arg);
+
+#endif /* END OF commit.h */
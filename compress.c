@@ -0,0 +1,408 @@
+/*!
+ * \file   compress.c
+ * \brief  On-the-fly gzip compression of served files. Compression runs on the working
+ *         threads and its output is kept in memory, under a size budget, so the daemon
+ *         thread only ever copies already compressed bytes.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <search.h>
+#include <sys/param.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "connection.h"
+#include "daemon.h"
+#include "pool.h"
+#include "internal.h"
+
+
+#define AKWBS_COMPRESS_READ_SIZE (64 * 1024)  /*!< Bytes read from the source at once.  */
+
+#define AKWBS_COMPRESS_LEVEL     6            /*!< zlib compression level.              */
+
+#define AKWBS_COMPRESS_GZIP_BITS (15 + 16)    /*!< zlib window bits, with gzip framing. */
+
+
+/*!
+ * Compare two compressed outputs by their keys, for the tree of outputs.
+ *
+ * \param pa first output.
+ * \param pb second output.
+ *
+ * \return less, equal or greater than zero, as in strcmp.
+ */
+static int compare_compressed(const void *pa, const void *pb)
+{
+  const struct akwbs_compressed *a = pa;
+  const struct akwbs_compressed *b = pb;
+
+
+  if (a->inode_number != b->inode_number)
+    return (a->inode_number < b->inode_number) ? -1 : 1;
+
+  if (a->device != b->device)
+    return (a->device < b->device) ? -1 : 1;
+
+  if (a->mtime != b->mtime)
+    return (a->mtime < b->mtime) ? -1 : 1;
+
+  if (a->mtime_nsec != b->mtime_nsec)
+    return (a->mtime_nsec < b->mtime_nsec) ? -1 : 1;
+
+  return (int)a->encoding - (int)b->encoding;
+}
+
+
+/*!
+ * Cost of an output against the cache budget.
+ *
+ * \param compressed the output.
+ *
+ * \return number of bytes held by the output.
+ */
+static size_t compressed_cost(struct akwbs_compressed *compressed)
+{
+  return sizeof(struct akwbs_compressed) + compressed->length;
+}
+
+
+/*!
+ * Remove an output from the cache and free it.
+ *
+ * \param daemon_p daemon holding the cache.
+ * \param compressed output, neither pending nor referenced.
+ */
+static void destroy_compressed(struct akwbs_daemon *daemon_p,
+                               struct akwbs_compressed *compressed)
+{
+  tdelete(compressed, &daemon_p->tree_compressed, compare_compressed);
+  DLL_remove(daemon_p->compressed_head, daemon_p->compressed_tail, compressed);
+
+  daemon_p->compressed_bytes -= compressed_cost(compressed);
+
+  free(compressed->data);
+  free(compressed);
+}
+
+
+/*!
+ * Free an output, for tdestroy.
+ *
+ * \param node the output.
+ */
+static void free_compressed(void *node)
+{
+  struct akwbs_compressed *compressed = node;
+
+
+  if (compressed->source_descriptor != AKWBS_ERROR)
+    close(compressed->source_descriptor);
+
+  free(compressed->data);
+  free(compressed);
+}
+
+
+/*!
+ * Evict the least recently used outputs until the cache fits in its budget. Pending
+ * and referenced outputs are never evicted.
+ *
+ * \param daemon_p daemon holding the cache.
+ */
+static void evict_compressed(struct akwbs_daemon *daemon_p)
+{
+  struct akwbs_compressed *pos  = daemon_p->compressed_tail;
+  struct akwbs_compressed *prev = NULL;
+
+
+  while ((pos != NULL) && (daemon_p->compressed_bytes > AKWBS_COMPRESS_CACHE_BUDGET))
+  {
+    prev = pos->prev;
+
+    if ((pos->state != AKWBS_COMPRESS_PENDING) && (pos->number_of_references == 0))
+      destroy_compressed(daemon_p, pos);
+
+    pos = prev;
+  }
+}
+
+
+/*!
+ * Start compressing the opened file of a connection on a working thread.
+ *
+ * \param connection connection whose file is compressible.
+ * \param key key of the output to be created.
+ */
+static void start_compression(struct akwbs_connection *connection,
+                              struct akwbs_compressed *key)
+{
+  struct akwbs_daemon *daemon_p      = connection->daemon_ref;
+  struct akwbs_compressed *compressed = NULL;
+  struct akwbs_request_io_msg msg;
+
+
+  compressed = (struct akwbs_compressed *) calloc(1, sizeof(struct akwbs_compressed));
+
+  if (compressed == NULL)
+    return;
+
+  *compressed                   = *key;
+  compressed->state             = AKWBS_COMPRESS_PENDING;
+  compressed->source_size       = connection->file_stat->size;
+  compressed->source_descriptor = fcntl(connection->file_descriptor, F_DUPFD_CLOEXEC, 0);
+
+  if (compressed->source_descriptor == AKWBS_ERROR)
+  {
+    free(compressed);
+    return;
+  }
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.sd      = AKWBS_ERROR;
+  msg.fd      = compressed->source_descriptor;
+  msg.address = compressed;
+  msg.bytes   = compressed->source_size;
+  msg.type    = AKWBS_IO_COMPRESS_TYPE;
+
+  if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+  {
+    close(compressed->source_descriptor);
+    free(compressed);
+    return;
+  }
+
+  tsearch(compressed, &daemon_p->tree_compressed, compare_compressed);
+  DLL_insert(daemon_p->compressed_head, daemon_p->compressed_tail, compressed);
+  daemon_p->compressed_bytes += compressed_cost(compressed);
+}
+
+
+/*!
+ * Choose whether the opened file of a GET connection is sent compressed. A cached
+ * output is used when ready; otherwise the file is sent as is and, the first time, its
+ * compression is started for the following requests.
+ *
+ * \param connection connection whose file has just been opened.
+ */
+void akwbs_compress_select(struct akwbs_connection *connection)
+{
+  struct akwbs_daemon *daemon_p     = connection->daemon_ref;
+  struct akwbs_file_stat *file_stat = connection->file_stat;
+  struct akwbs_compressed key;
+  void *found = NULL;
+  struct akwbs_compressed *compressed = NULL;
+
+
+  connection->compressed = NULL;
+
+  if ((connection->content_encoding != AKWBS_HTTP_ENCODING_IDENTITY)
+      || (connection->mime_type->compressible == AKWBS_NO)
+      || (file_stat->size < AKWBS_COMPRESS_MIN_SIZE)
+      || (file_stat->size > AKWBS_COMPRESS_MAX_SIZE)
+      || (akwbs_http_accepts_encoding(&connection->request, "gzip") == AKWBS_NO))
+    return;
+
+  bzero(&key, sizeof(struct akwbs_compressed));
+
+  key.device       = file_stat->device;
+  key.inode_number = file_stat->inode_number;
+  key.mtime        = file_stat->mtime;
+  key.mtime_nsec   = file_stat->mtime_nsec;
+  key.encoding     = AKWBS_HTTP_ENCODING_GZIP;
+
+  found = tfind(&key, &daemon_p->tree_compressed, compare_compressed);
+
+  if (found == NULL)
+  {
+    start_compression(connection, &key);
+    return;
+  }
+
+  compressed = * (struct akwbs_compressed **) found;
+
+  if (compressed->state != AKWBS_COMPRESS_READY)
+    return;
+
+  /* Most recently used outputs live at the head. */
+  DLL_remove(daemon_p->compressed_head, daemon_p->compressed_tail, compressed);
+  DLL_insert(daemon_p->compressed_head, daemon_p->compressed_tail, compressed);
+
+  compressed->number_of_references++;
+
+  connection->compressed        = compressed;
+  connection->file_stat         = &compressed->file_stat;
+  connection->content_encoding  = compressed->encoding;
+  connection->file_total_offset = compressed->length;
+}
+
+
+/*!
+ * Release the compressed output sent by a connection, if any.
+ *
+ * \param connection connection being closed.
+ */
+void akwbs_compress_release(struct akwbs_connection *connection)
+{
+  if (connection->compressed == NULL)
+    return;
+
+  connection->compressed->number_of_references--;
+  connection->compressed = NULL;
+
+  evict_compressed(connection->daemon_ref);
+}
+
+
+/*!
+ * Free every compressed output. Called on shutdown, once the working threads are gone.
+ *
+ * \param daemon_p daemon holding the cache.
+ */
+void akwbs_compress_destroy(struct akwbs_daemon *daemon_p)
+{
+  tdestroy(daemon_p->tree_compressed, free_compressed);
+
+  daemon_p->tree_compressed  = NULL;
+  daemon_p->compressed_head  = NULL;
+  daemon_p->compressed_tail  = NULL;
+  daemon_p->compressed_bytes = 0;
+}
+
+
+/*!
+ * Compress a whole file to memory. Called by working threads.
+ *
+ * \param msg param-return request whose address is the pending output. On return, its
+ *        bytes are the compressed length, or AKWBS_ERROR if the output is useless.
+ */
+void akwbs_compress_run(struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_compressed *compressed = msg->address;
+  unsigned char input[AKWBS_COMPRESS_READ_SIZE];
+  unsigned char *output = NULL;
+  uLong bound           = 0;
+  off_t offset          = 0;
+  ssize_t bytes         = 0;
+  int flush             = Z_NO_FLUSH;
+  int ret               = Z_OK;
+  z_stream stream;
+
+
+  msg->bytes = AKWBS_ERROR;
+
+  bzero(&stream, sizeof(z_stream));
+
+  if (deflateInit2(&stream,
+                   AKWBS_COMPRESS_LEVEL,
+                   Z_DEFLATED,
+                   AKWBS_COMPRESS_GZIP_BITS,
+                   8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    goto close_source;
+
+  bound  = deflateBound(&stream, (uLong)compressed->source_size);
+  output = (unsigned char *) malloc(bound);
+
+  if (output == NULL)
+    goto end_stream;
+
+  stream.next_out  = output;
+  stream.avail_out = (uInt)bound;
+
+  do
+  {
+    bytes = pread(compressed->source_descriptor,
+                  input,
+                  MIN(sizeof(input), (size_t)(compressed->source_size - offset)),
+                  offset);
+
+    if (bytes == AKWBS_ERROR)
+      goto end_stream;
+
+    offset += bytes;
+
+    /* The file may have changed since it was looked up: only its size is read. */
+    if ((bytes == 0) || (offset >= compressed->source_size))
+      flush = Z_FINISH;
+
+    stream.next_in  = input;
+    stream.avail_in = (uInt)bytes;
+
+    ret = deflate(&stream, flush);
+
+    if (ret == Z_STREAM_ERROR)
+      goto end_stream;
+  } while (flush != Z_FINISH);
+
+  if ((ret != Z_STREAM_END) || (offset != compressed->source_size))
+    goto end_stream;
+
+  /* Not worth it if less than one eighth is saved. */
+  if (stream.total_out > (uLong)(compressed->source_size - compressed->source_size / 8))
+    goto end_stream;
+
+  compressed->data   = (unsigned char *) realloc(output, stream.total_out);
+  compressed->length = stream.total_out;
+  output             = NULL;
+
+  if (compressed->data == NULL)
+    compressed->length = 0;
+  else
+    msg->bytes = (ssize_t)compressed->length;
+
+end_stream:
+  deflateEnd(&stream);
+  free(output);
+
+close_source:
+  close(compressed->source_descriptor);
+  compressed->source_descriptor = AKWBS_ERROR;
+}
+
+
+/*!
+ * Account a finished compression. Called by the daemon thread, with the result sent by
+ * the working thread.
+ *
+ * \param daemon_p daemon holding the cache.
+ * \param result result of the compression.
+ */
+void akwbs_compress_complete(struct akwbs_daemon *daemon_p, struct akwbs_result_io *result)
+{
+  struct akwbs_compressed *compressed = result->address;
+  struct stat stat_buf;
+
+
+  if ((ssize_t)result->bytes_read == AKWBS_ERROR)
+  {
+    compressed->state = AKWBS_COMPRESS_USELESS;
+    return;
+  }
+
+  /* The output is a file version of its own, with its own validators and headers. */
+  bzero(&stat_buf, sizeof(struct stat));
+
+  stat_buf.st_dev          = compressed->device;
+  stat_buf.st_ino          = compressed->inode_number;
+  stat_buf.st_size         = (off_t)compressed->length;
+  stat_buf.st_mtim.tv_sec  = compressed->mtime;
+  stat_buf.st_mtim.tv_nsec = compressed->mtime_nsec;
+
+  compressed->file_stat.inode_number    = compressed->inode_number;
+  compressed->file_stat.device          = compressed->device;
+  compressed->file_stat.file_descriptor = AKWBS_ERROR;
+  akwbs_update_file_stat(&compressed->file_stat, &stat_buf);
+
+  compressed->state           = AKWBS_COMPRESS_READY;
+  daemon_p->compressed_bytes += compressed->length;
+
+  evict_compressed(daemon_p);
+}
@@ -0,0 +1,84 @@
+/*!
+ * \file   compress.h
+ * \brief  On-the-fly compression of served files, and the cache of compressed outputs.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_COMPRESS_H_
+#define _AKWBS_MT_COMPRESS_H_
+
+#include <sys/types.h>
+
+#include "file_tree.h"
+#include "http.h"
+#include "requestio.h"
+#include "resultio.h"
+
+
+#define AKWBS_COMPRESS_MIN_SIZE      1024                /*!< Smaller files are sent as is.  */
+
+#define AKWBS_COMPRESS_MAX_SIZE      (16 * 1024 * 1024)  /*!< Larger files are sent as is.   */
+
+#define AKWBS_COMPRESS_CACHE_BUDGET  (64 * 1024 * 1024)  /*!< Bytes kept by the cache.       */
+
+
+struct akwbs_connection;
+struct akwbs_daemon;
+
+
+/*!
+ * States of a compressed output.
+ */
+enum akwbs_compress_state
+{
+  AKWBS_COMPRESS_PENDING = 0,   /*!< Being compressed by a working thread.              */
+
+  AKWBS_COMPRESS_READY,         /*!< Compressed, ready to be sent.                      */
+
+  AKWBS_COMPRESS_USELESS        /*!< Compression failed or did not pay off.             */
+};
+
+
+/*!
+ * Compressed output of a file version. It is created and looked up by the daemon
+ * thread only; while pending, its data belongs to the working thread compressing it.
+ */
+struct akwbs_compressed
+{
+  dev_t device;                 /*!< Device of the source file.                         */
+  ino_t inode_number;           /*!< Inode number of the source file.                   */
+  time_t mtime;                 /*!< Last modification time of the source file.         */
+  long mtime_nsec;              /*!< Nanoseconds of the last modification time.         */
+  enum akwbs_http_encoding
+    encoding;                   /*!< Content coding of the output.                      */
+
+  enum akwbs_compress_state
+    state;                      /*!< State of the output.                               */
+
+  int source_descriptor;        /*!< Private descriptor of the source, while pending.   */
+  off_t source_size;            /*!< Size of the source file.                           */
+
+  unsigned char *data;          /*!< Compressed bytes.                                  */
+  size_t length;                /*!< Number of compressed bytes.                        */
+
+  unsigned int
+    number_of_references;       /*!< Number of connections sending the output.          */
+
+  struct akwbs_file_stat
+    file_stat;                  /*!< Validators and cached headers of the output.       */
+
+  struct akwbs_compressed *prev;  /*!< Previous output, more recently used.             */
+  struct akwbs_compressed *next;  /*!< Next output, less recently used.                 */
+};
+
+
+/*
+ * Public Interface.
+ */
+void akwbs_compress_select(struct akwbs_connection *connection);
+void akwbs_compress_release(struct akwbs_connection *connection);
+void akwbs_compress_destroy(struct akwbs_daemon *daemon_p);
+void akwbs_compress_run(struct akwbs_request_io_msg *msg);
+void akwbs_compress_complete(struct akwbs_daemon *daemon_p, struct akwbs_result_io *result);
+
+#endif /* END OF compress.h */
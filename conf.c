@@ -0,0 +1,304 @@
+/*!
+ * \file   conf.c
+ * \brief  Table of the optional settings of the server, and their parsing.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "conf.h"
+#include "internal.h"
+#include "pool.h"
+
+
+/*!
+ * Kinds of values taken by the settings.
+ */
+enum akwbs_conf_kind
+{
+  AKWBS_CONF_UNSIGNED = 0,      /*!< Unsigned number, stored as an unsigned long.       */
+
+  AKWBS_CONF_CHOICE,            /*!< One of a list of names, stored as its index.       */
+
+  AKWBS_CONF_CPU_LIST,          /*!< List of CPUs, such as "0-3,8", stored as is.       */
+
+  AKWBS_CONF_PATH,              /*!< Path of a file, stored as is.                      */
+
+  AKWBS_CONF_DEVICE_LIST        /*!< List of paths and threads, such as "/mnt/a:4",
+                                 *   stored as is.
+                                 */
+};
+
+
+/*!
+ * An optional setting.
+ */
+struct akwbs_conf_option
+{
+  const char *name;             /*!< Name of the setting, before the '='.               */
+  enum akwbs_conf_kind kind;    /*!< Kind of value.                                     */
+  size_t offset;                /*!< Offset of the value in the server configuration.   */
+  const char *const *choices;   /*!< Accepted names, NULL terminated, for choices.      */
+  const char *help;             /*!< One line description.                              */
+};
+
+
+/*!
+ * Names of the durability modes, in the order of enum akwbs_durability.
+ */
+static const char *const durability_names[] = { "none", "fsync", "group", NULL };
+
+
+/*!
+ * Names of a setting turned off or on, in the order of AKWBS_NO and AKWBS_YES.
+ */
+static const char *const switch_names[] = { "no", "yes", NULL };
+
+
+/*!
+ * Every optional setting.
+ */
+static const struct akwbs_conf_option options[] =
+{
+  { "durability",
+    AKWBS_CONF_CHOICE,
+    offsetof(struct akwbs_server_conf, durability),
+    durability_names,
+    "none|fsync|group, when an upload is on disk before its 201" },
+
+  { "commit_window_us",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, commit_window_us),
+    NULL,
+    "microseconds gathering uploads into one group commit" },
+
+  { "writeback_window",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, writeback_window),
+    NULL,
+    "bytes of an upload flushed and dropped from cache at once, 0 to disable" },
+
+  { "dirty_budget",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, dirty_budget),
+    NULL,
+    "dirty bytes of uploads allowed per disk, 0 for no limit" },
+
+  { "max_upload_size",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, max_upload_size),
+    NULL,
+    "largest upload body accepted, in bytes, 0 for no limit" },
+
+  { "io_threads",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, io_threads),
+    NULL,
+    "number of I/O working threads, at least 1" },
+
+  { "io_threads_max",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, io_threads_max),
+    NULL,
+    "most I/O working threads the pool grows to, 0 for a fixed pool" },
+
+  { "io_cpus",
+    AKWBS_CONF_CPU_LIST,
+    offsetof(struct akwbs_server_conf, io_cpus),
+    NULL,
+    "CPUs the I/O threads are pinned to, such as 0-3,8" },
+
+  { "loop_cpus",
+    AKWBS_CONF_CPU_LIST,
+    offsetof(struct akwbs_server_conf, loop_cpus),
+    NULL,
+    "CPUs the event loop is pinned to" },
+
+  { "metrics_file",
+    AKWBS_CONF_PATH,
+    offsetof(struct akwbs_server_conf, metrics_file),
+    NULL,
+    "file the I/O pool metrics are written to, every 100 ms" },
+
+  { "latency_bytes",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, latency_bytes),
+    NULL,
+    "transfers with at most these bytes left are served ahead of bulk ones" },
+
+  { "latency_reserve",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, latency_reserve),
+    NULL,
+    "percent of the I/O threads kept for small transfers, 0 to 100" },
+
+  { "read_depth",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, read_depth),
+    NULL,
+    "reads of a download in flight at once, 1 to 16" },
+
+  { "inline_io",
+    AKWBS_CONF_CHOICE,
+    offsetof(struct akwbs_server_conf, inline_io),
+    switch_names,
+    "no|yes, cached reads and writes done by the event loop, without a thread" },
+
+  { "direct_io_size",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, direct_io_size),
+    NULL,
+    "files this large are read with O_DIRECT, bypassing the cache, 0 for none" },
+
+  { "direct_io_paths",
+    AKWBS_CONF_PATH,
+    offsetof(struct akwbs_server_conf, direct_io_paths),
+    NULL,
+    "files under these paths, such as /video,/backup, are read with O_DIRECT" },
+
+  { "readahead_max",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, readahead_max),
+    NULL,
+    "largest readahead of a download, sized from its send rate, 0 to disable" },
+
+  { "drop_behind_size",
+    AKWBS_CONF_UNSIGNED,
+    offsetof(struct akwbs_server_conf, drop_behind_size),
+    NULL,
+    "files this large with a single reader leave the cache once sent, 0 never" },
+
+  { "device_threads",
+    AKWBS_CONF_DEVICE_LIST,
+    offsetof(struct akwbs_server_conf, device_threads),
+    NULL,
+    "I/O threads of the devices holding some paths, such as /mnt/hdd:2,/mnt/ssd:16" }
+};
+
+
+/*!
+ * Set every optional setting to its default value.
+ *
+ * \param conf server configuration.
+ */
+void akwbs_conf_set_defaults(struct akwbs_server_conf *conf)
+{
+  conf->durability       = AKWBS_DURABILITY_NONE;
+  conf->commit_window_us = 2000;
+  conf->writeback_window = 8 * 1024 * 1024;
+  conf->dirty_budget     = 0;
+  conf->max_upload_size  = 0;
+  conf->io_threads       = 10;
+  conf->io_threads_max   = 0;
+  conf->io_cpus          = NULL;
+  conf->loop_cpus        = NULL;
+  conf->metrics_file     = NULL;
+  conf->latency_bytes    = 256 * 1024;
+  conf->latency_reserve  = 25;
+  conf->read_depth       = 1;
+  conf->inline_io        = AKWBS_YES;
+  conf->direct_io_size   = 0;
+  conf->direct_io_paths  = NULL;
+  conf->readahead_max    = 4 * 1024 * 1024;
+  conf->drop_behind_size = 0;
+  conf->device_threads   = NULL;
+}
+
+
+/*!
+ * Parse a name=value argument into the server configuration.
+ *
+ * \param conf param-return server configuration.
+ * \param option the argument.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on unknown setting or invalid value.
+ */
+int akwbs_conf_parse_option(struct akwbs_server_conf *conf, const char *option)
+{
+  const char *equal = strchr(option, '=');
+  const char *value = NULL;
+  char *end         = NULL;
+  unsigned long number = 0;
+  size_t i;
+  int j;
+
+
+  if (equal == NULL)
+    return AKWBS_ERROR;
+
+  value = equal + 1;
+
+  for (i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+  {
+    if ((strlen(options[i].name) != (size_t)(equal - option))
+        || (strncmp(options[i].name, option, equal - option) != 0))
+      continue;
+
+    switch (options[i].kind)
+    {
+      case AKWBS_CONF_UNSIGNED:
+        errno  = 0;
+        number = strtoul(value, &end, 10);
+
+        if ((*value == '\0') || (*value == '-') || (*end != '\0') || (errno != 0))
+          return AKWBS_ERROR;
+
+        *(unsigned long *)((char *)conf + options[i].offset) = number;
+        return AKWBS_SUCCESS;
+      case AKWBS_CONF_CHOICE:
+        for (j = 0; options[i].choices[j] != NULL; j++)
+          if (strcmp(options[i].choices[j], value) == 0)
+          {
+            *(int *)((char *)conf + options[i].offset) = j;
+            return AKWBS_SUCCESS;
+          }
+        return AKWBS_ERROR;
+      case AKWBS_CONF_CPU_LIST:
+        if (akwbs_pool_check_cpus(value) == AKWBS_ERROR)
+          return AKWBS_ERROR;
+
+        *(const char **)((char *)conf + options[i].offset) = value;
+        return AKWBS_SUCCESS;
+      case AKWBS_CONF_PATH:
+        if (*value == '\0')
+          return AKWBS_ERROR;
+
+        *(const char **)((char *)conf + options[i].offset) = value;
+        return AKWBS_SUCCESS;
+      case AKWBS_CONF_DEVICE_LIST:
+        if (akwbs_pool_check_devices(value) == AKWBS_ERROR)
+          return AKWBS_ERROR;
+
+        *(const char **)((char *)conf + options[i].offset) = value;
+        return AKWBS_SUCCESS;
+      default:
+        return AKWBS_ERROR;
+    }
+  }
+
+  return AKWBS_ERROR;
+}
+
+
+/*!
+ * Print how to run the server, with every optional setting.
+ *
+ * \param program_name name of the executable.
+ */
+void akwbs_conf_print_usage(const char *program_name)
+{
+  size_t i;
+
+
+  fprintf(stderr,
+          "Usage: %s root_path port speed_limit_bytes_second [name=value ...]\n",
+          program_name);
+
+  for (i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+    fprintf(stderr, "  %-24s %s\n", options[i].name, options[i].help);
+}
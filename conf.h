@@ -0,0 +1,20 @@
+/*!
+ * \file   conf.h
+ * \brief  Optional settings of the server, given as name=value arguments.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_CONF_H_
+#define _AKWBS_MT_CONF_H_
+
+#include "internal.h"
+
+
+/*
+ * Public Interface.
+ */
+void akwbs_conf_set_defaults(struct akwbs_server_conf *conf);
+int akwbs_conf_parse_option(struct akwbs_server_conf *conf, const char *option);
+void akwbs_conf_print_usage(const char *program_name);
+
+#endif /* END OF conf.h */
@@ -18,17 +18,22 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/time.h>
-#include <libgen.h>
 #include <fcntl.h>
 #include <search.h>
+#include <sys/uio.h>
 
 #include "ringbuffer.h"
 #include "connection.h"
 #include "daemon.h"
+#include "pool.h"
 #include "internal.h"
 #include "io.h"
 #include "http.h"
 #include "file_tree.h"
+#include "compress.h"
+#include "commit.h"
+#include "writeback.h"
+#include "upload.h"
 
 
 /*!
@@ -115,7 +120,8 @@ static int get_timeout(struct akwbs_connection *connection)
  * \param socket_descriptor socket descriptor to get data from.
  *
  * \return AKWBS_SUCCESS on success receiving data from the given socket.
- *         AKWBS_ERROR on error while trying to get data from the given socket.
+ *         AKWBS_ERROR on error while trying to get data from the given socket, or if
+ *         the client closed its side.
  */
 static int recv_data_from_socket(struct akwbs_connection *connection)
 {
@@ -133,7 +139,7 @@ static int recv_data_from_socket(struct akwbs_connection *connection)
 
   bytes_read    = recv(connection->client_socket, write_address, free_space, 0);
 
-  if (bytes_read == AKWBS_ERROR)
+  if ((bytes_read == AKWBS_ERROR) || (bytes_read == 0))
     return AKWBS_ERROR;
 
   gettimeofday(&connection->last_activity, NULL);
@@ -145,64 +151,135 @@ static int recv_data_from_socket(struct akwbs_connection *connection)
 
 
 /*!
- * Send data to a socket and update the buffer accounting.
+ * Send data to a socket and update the buffer accounting. The pending pieces of the
+ * response head go first, in the same vectored send as the bytes in the buffer. A head
+ * is held back while the first bytes of its body are being read, so both leave together.
  *
+ * \param connection connection whose data must be sent.
+ *
+ * \return AKWBS_SUCCESS on success sending data, or if the send rate does not allow it.
+ *         AKWBS_ERROR on error while sending data.
  */
 static int send_data_to_socket(struct akwbs_connection *connection)
 {
+  struct iovec iov[AKWBS_RESPONSE_MAX_IOV + 1];
+  struct iovec *head      = NULL;
+  int     iov_count       = 0;
+  unsigned int i          = 0;
   ssize_t bytes_sent      = 0;
   size_t  bytes_to_send   = 0;
-  void    *read_address   = NULL;
+  size_t  head_bytes      = 0;
+  size_t  buffer_bytes    = 0;
   int     ret             = 0;
 
 
-  bytes_to_send = ring_buffer_count_bytes(&connection->buffer);
+  for (i = connection->response_iov_sent; i < connection->response_iov_count; i++)
+    head_bytes += connection->response_iov[i].iov_len;
+
+  buffer_bytes  = ring_buffer_count_bytes(&connection->buffer);
+  bytes_to_send = head_bytes + buffer_bytes;
 
   if (bytes_to_send == 0)
     return AKWBS_SUCCESS;
 
+  if ((buffer_bytes == 0) && (connection->is_waiting_result == AKWBS_YES))
+    return AKWBS_SUCCESS;
+
   ret = manage_send_rate(connection, &bytes_to_send);
 
   if (ret == -2)
     return AKWBS_SUCCESS;
 
-  read_address = ring_buffer_read_address(&connection->buffer);
+  for (i = connection->response_iov_sent;
+       (i < connection->response_iov_count) && (bytes_to_send > 0);
+       i++)
+  {
+    iov[iov_count].iov_base = connection->response_iov[i].iov_base;
+    iov[iov_count].iov_len  = MIN(connection->response_iov[i].iov_len, bytes_to_send);
+    bytes_to_send          -= iov[iov_count].iov_len;
+    iov_count++;
+  }
+
+  if ((buffer_bytes > 0) && (bytes_to_send > 0))
+  {
+    iov[iov_count].iov_base = ring_buffer_read_address(&connection->buffer);
+    iov[iov_count].iov_len  = MIN(buffer_bytes, bytes_to_send);
+    iov_count++;
+  }
 
-  bytes_sent = send(connection->client_socket, read_address, bytes_to_send, 0);
+  bytes_sent = writev(connection->client_socket, iov, iov_count);
 
   if (bytes_sent == AKWBS_ERROR)
     return AKWBS_ERROR;
 
   connection->bytes_sent_last_io += bytes_sent;
 
+  /* Consume the head pieces that were sent, trimming the one sent partially. */
+  while ((bytes_sent > 0) && (connection->response_iov_sent < connection->response_iov_count))
+  {
+    head = &connection->response_iov[connection->response_iov_sent];
+
+    if ((size_t)bytes_sent < head->iov_len)
+    {
+      head->iov_base  = (char *)head->iov_base + bytes_sent;
+      head->iov_len  -= bytes_sent;
+      return AKWBS_SUCCESS;
+    }
+
+    bytes_sent -= head->iov_len;
+    connection->response_iov_sent++;
+  }
+
   ring_buffer_read_advance(&connection->buffer, bytes_sent);
 
   return AKWBS_SUCCESS;
 }
 
-static void make_real_file_path(char *root_path, char *file_name, char *real_path)
+
+/*!
+ * Check whether some response bytes are still waiting to be sent.
+ *
+ * \param connection connection to be checked.
+ *
+ * \return AKWBS_YES if there are bytes waiting, AKWBS_NO otherwise.
+ */
+static int has_pending_response(struct akwbs_connection *connection)
 {
-  char *index = root_path;
-  int i = 0;
+  if (connection->response_iov_sent < connection->response_iov_count)
+    return AKWBS_YES;
 
+  if (ring_buffer_count_bytes(&connection->buffer) != 0)
+    return AKWBS_YES;
 
-  while (*index != '\0')
-  {
-    real_path[i] = *index;
-    i++;
-    index++;
-  }
+  return AKWBS_NO;
+}
 
-  index = file_name;
+/*!
+ * Reply the bytes of a ranged upload target held by the server, as the Range a client
+ * resumes from. No Range field is sent when the target is empty.
+ *
+ * \param connection connection of a ranged upload.
+ * \param status_line status line of the reply.
+ * \param held_size number of bytes held.
+ */
+static void send_held_range(struct akwbs_connection *connection,
+                            const char *status_line,
+                            off_t held_size)
+{
+  char reply[128];
+  int length = 0;
 
-  while (*index != '\0')
-  {
-    real_path[i] = *index;
-    i++;
-    index++;
-  }
 
-  real_path[i] = '\0';
+  if (held_size == 0)
+    length = snprintf(reply, sizeof(reply), "%s\r\n", status_line);
+  else
+    length = snprintf(reply,
+                      sizeof(reply),
+                      "%sRange: bytes=0-%lld\r\n\r\n",
+                      status_line,
+                      (long long)(held_size - 1));
+
+  send(connection->client_socket, reply, (size_t)length, 0);
 }
 
 /*!
@@ -216,20 +293,17 @@ static void make_real_file_path(char *root_path, char *file_name, char *real_pat
  */
 static int decrease_file_stat_reference(struct akwbs_connection *connection)
 {
-  struct stat stat_buf;
   struct akwbs_file_stat *result = NULL;
   struct akwbs_file_stat key_to_search;
 
 
-  if (fstat(connection->file_descriptor, &stat_buf) == AKWBS_ERROR)
-    return AKWBS_ERROR;
-
   if (connection->connection_state != AKWBS_CONNECTION_CLOSED)
     return AKWBS_ERROR;
 
   bzero(&key_to_search, sizeof(struct akwbs_file_stat));
 
-  key_to_search.inode_number = stat_buf.st_ino;
+  key_to_search.inode_number = connection->file_stat->inode_number;
+  key_to_search.device       = connection->file_stat->device;
 
   result = (struct akwbs_file_stat *) tfind(&key_to_search,
                                             &connection->daemon_ref->tree_opened_files,
@@ -242,13 +316,15 @@ static int decrease_file_stat_reference(struct akwbs_connection *connection)
 
   if ((*((struct akwbs_file_stat **)result))->number_of_references == 0)
   {
-    struct akwbs_file_stat *to_be_freed = NULL;
+    struct akwbs_file_stat *to_be_freed = *((struct akwbs_file_stat **)result);
 
 
-    close((*((struct akwbs_file_stat **)result))->file_descriptor);
-    to_be_freed = tdelete(result,
-                  &connection->daemon_ref->tree_opened_files,
-                  akwbs_compare_file_stat);
+    akwbs_opening_close(connection,
+                        to_be_freed->file_descriptor,
+                        to_be_freed->direct_descriptor);
+    tdelete(to_be_freed,
+            &connection->daemon_ref->tree_opened_files,
+            akwbs_compare_file_stat);
 
     free(to_be_freed);
 
@@ -260,31 +336,30 @@ static int decrease_file_stat_reference(struct akwbs_connection *connection)
 
 /*!
  * \brief Create a leaf in the binary tree representing
- *        a reference and status about a file.
+ *        a reference and status about a file, once a
+ *        working thread opened it.
  * \param connection connection that is requesting operation
  *        on file.
  * \return AKWBS_ERROR on error.
  * \return AKWBS_SUCCESS if a reference already exists or
  *         it has been created.
+ * \details If the file is already opened, the connection
+ *          shares its descriptors, and the ones just opened
+ *          are closed.
  */
 static int create_file_stat(struct akwbs_connection *connection)
 {
-  char real_path[PATH_MAX];
-  struct stat stat_buf;
+  struct stat *stat_buf = &connection->opening.stat_buf;
   struct akwbs_file_stat key_to_search;
   struct akwbs_file_stat *search_result = NULL;
   struct akwbs_file_stat *file_stat_to_insert = NULL;
   struct akwbs_file_stat *insert_result = NULL;
+  struct akwbs_file_stat *file_stat = NULL;
+  int spare_direct = AKWBS_ERROR;
 
 
-  make_real_file_path(connection->daemon_ref->root_path,
-                      connection->file_name,
-                      real_path);
-
-  if (stat(real_path, &stat_buf) == AKWBS_ERROR)
-    return AKWBS_ERROR;
-
-  key_to_search.inode_number         = stat_buf.st_ino;
+  key_to_search.inode_number         = stat_buf->st_ino;
+  key_to_search.device               = stat_buf->st_dev;
   key_to_search.file_descriptor      = -1;
   key_to_search.number_of_references = 0;
 
@@ -294,81 +369,138 @@ static int create_file_stat(struct akwbs_connection *connection)
 
   if (search_result != NULL)
   {
-    (* (struct akwbs_file_stat **) search_result)->number_of_references++;
-    connection->file_descriptor = (* (struct akwbs_file_stat **)search_result)->file_descriptor;
-    connection->file_total_offset = stat_buf.st_size;
+    file_stat = * (struct akwbs_file_stat **) search_result;
+
+    file_stat->number_of_references++;
+    akwbs_update_file_stat(file_stat, stat_buf);
+
+    /* The first download of the file read directly gives it its direct descriptor. */
+    if ((connection->direct_descriptor != AKWBS_ERROR)
+        && (file_stat->direct_descriptor != AKWBS_ERROR))
+      spare_direct = connection->direct_descriptor;
+    else if (connection->direct_descriptor != AKWBS_ERROR)
+      file_stat->direct_descriptor = connection->direct_descriptor;
+
+    if (connection->direct_descriptor != AKWBS_ERROR)
+      connection->direct_descriptor = file_stat->direct_descriptor;
+
+    akwbs_opening_close(connection, connection->file_descriptor, spare_direct);
+
+    connection->file_stat = file_stat;
+    connection->file_descriptor = file_stat->file_descriptor;
+    connection->file_total_offset = stat_buf->st_size;
     return AKWBS_SUCCESS;
   }
 
-  file_stat_to_insert = (struct akwbs_file_stat *) malloc(sizeof(struct akwbs_file_stat));
+  file_stat_to_insert = (struct akwbs_file_stat *) calloc(1, sizeof(struct akwbs_file_stat));
 
   if (file_stat_to_insert == NULL)
-    return AKWBS_ERROR;
+    goto close_and_fail;
 
   file_stat_to_insert->inode_number = key_to_search.inode_number;
+  file_stat_to_insert->device       = key_to_search.device;
   file_stat_to_insert->number_of_references = 1;
-  file_stat_to_insert->file_descriptor = open(real_path, O_RDONLY | O_NONBLOCK);
-
-  if (file_stat_to_insert->file_descriptor == AKWBS_ERROR)
-    goto free_and_fail;
+  file_stat_to_insert->direct_descriptor    = connection->direct_descriptor;
+  akwbs_update_file_stat(file_stat_to_insert, stat_buf);
+  file_stat_to_insert->file_descriptor = connection->file_descriptor;
 
   insert_result = tsearch((void *) file_stat_to_insert,
                           &connection->daemon_ref->tree_opened_files,
                           akwbs_compare_file_stat);
 
-  if ((* (struct akwbs_file_stat **) insert_result) != file_stat_to_insert)
+  if ((insert_result == NULL)
+      || ((* (struct akwbs_file_stat **) insert_result) != file_stat_to_insert))
     goto free_and_fail;
 
-  connection->file_descriptor   = (* (struct akwbs_file_stat **)insert_result)->file_descriptor;
-  connection->file_total_offset = stat_buf.st_size;
+  connection->file_stat         = file_stat_to_insert;
+  connection->file_total_offset = stat_buf->st_size;
 
   return AKWBS_SUCCESS;
 
 free_and_fail:
   free(file_stat_to_insert);
+
+close_and_fail:
+  akwbs_opening_close(connection, connection->file_descriptor, connection->direct_descriptor);
+  connection->file_descriptor   = AKWBS_ERROR;
+  connection->direct_descriptor = AKWBS_ERROR;
   return AKWBS_ERROR;
 
 }
 
-/* Decides if we should create or update references about files. */
+/*!
+ * Release the references about the file of a connection, once closed, and only once.
+ * The reads or writes in flight still use the file: it is released when the last of
+ * them is back, by the cleanup of the connection.
+ *
+ * \param connection the closed connection.
+ *
+ * \return AKWBS_SUCCESS on success, or if the release is deferred. AKWBS_ERROR on error.
+ */
 static int manage_file_stat_tree(struct akwbs_connection *connection)
 {
-  if (connection->file_descriptor != AKWBS_ERROR)
-  {
-    if (decrease_file_stat_reference(connection) == AKWBS_ERROR)
-      return AKWBS_ERROR;
-  }
-  else
+  int status = AKWBS_SUCCESS;
+
+
+  if ((connection->has_released_file == AKWBS_YES)
+      || (connection->is_waiting_result == AKWBS_YES))
+    return AKWBS_SUCCESS;
+
+  connection->has_released_file = AKWBS_YES;
+
+  /* Uploads are not shared: they are released, published or not. */
+  if (connection->io_type == AKWBS_IO_PUT_TYPE)
   {
-    if (create_file_stat(connection) == AKWBS_ERROR)
-      return AKWBS_ERROR;
+    akwbs_writeback_release(connection);
+    akwbs_opening_release(connection);
+    return AKWBS_SUCCESS;
   }
 
-  return AKWBS_SUCCESS;
-}
+  if (connection->file_stat == NULL)
+    return AKWBS_SUCCESS;
 
-static int open_file_for_writing(struct akwbs_connection *connection)
-{
-  char real_path[PATH_MAX];
+  akwbs_compress_release(connection);
 
+  status = decrease_file_stat_reference(connection);
 
-  make_real_file_path(connection->daemon_ref->root_path,
-                      connection->file_name,
-                      real_path);
+  /* The file may be freed now, and the closings it left are queued without it. */
+  connection->file_stat = NULL;
 
+  return status;
+}
 
-  connection->file_descriptor = open(basename(real_path),
-                                     O_CREAT | O_WRONLY | O_NONBLOCK,
-                                     S_IRWXU | S_IRWXG | S_IRWXO);
+/*!
+ * Close a connection: its socket is closed and its file released, each only once.
+ *
+ * \param connection the connection.
+ */
+static void close_connection(struct akwbs_connection *connection)
+{
+  if (connection->connection_state == AKWBS_CONNECTION_CLOSED)
+    return;
 
-  if (connection->file_descriptor == AKWBS_ERROR)
-    return AKWBS_ERROR;
+  close(connection->client_socket);
+  connection->connection_state = AKWBS_CONNECTION_CLOSED;
+  manage_file_stat_tree(connection);
+  FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
+  FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
+}
 
-  return AKWBS_SUCCESS;
+
+/*!
+ * Release the file of a closed connection whose release was deferred, once its I/O in
+ * flight is all back. Called by the cleanup of connections.
+ *
+ * \param connection the closed connection.
+ */
+void akwbs_release_connection_file(struct akwbs_connection *connection)
+{
+  manage_file_stat_tree(connection);
 }
 
+
 /*!
- * Open the requested file for this connection.
+ * Take the requested file, once a working thread opened it for this connection.
  *
  * \param connection connection holding file name.
  *
@@ -377,26 +509,24 @@ static int open_file_for_writing(struct akwbs_connection *connection)
  */
 static int open_resource(struct akwbs_connection *connection)
 {
-  struct stat stat_buf;
-
+  if (connection->opening.status == AKWBS_ERROR)
+    return AKWBS_ERROR;
 
   switch (connection->io_type)
   {
   case AKWBS_IO_GET_TYPE:
-    if (manage_file_stat_tree(connection) == AKWBS_ERROR)
+    if (create_file_stat(connection) == AKWBS_ERROR)
       return AKWBS_ERROR;
     break;
   case AKWBS_IO_PUT_TYPE:
-    if (open_file_for_writing(connection) == AKWBS_ERROR)
-      return AKWBS_ERROR;
+    akwbs_writeback_open(connection);
     break;
   default:
     /* AKWBS_IO_UNKNOWN_TYPE. Obviously an error. */
     return AKWBS_ERROR;
   }
 
-  if (connection->file_descriptor == AKWBS_ERROR)
-    return AKWBS_ERROR;
+  akwbs_pool_route(connection);
 
   return AKWBS_SUCCESS;
 }
@@ -417,20 +547,36 @@ static int prepare_io_request(struct akwbs_connection *connection)
     switch (connection->io_type)
     {
     case AKWBS_IO_GET_TYPE:
-      connection->pending_io_msg.address = ring_buffer_write_address(&connection->buffer);
-      connection->pending_io_msg.bytes   = ring_buffer_count_free_bytes(&connection->buffer);
-      break;
+      /* Downloads read through their pipeline. */
+      return AKWBS_ERROR;
     case AKWBS_IO_PUT_TYPE:
       connection->pending_io_msg.address = ring_buffer_read_address(&connection->buffer);
       connection->pending_io_msg.bytes   = ring_buffer_count_bytes(&connection->buffer);
+
+      /* Only the payload of the current chunk, its framing is not part of the file. */
+      if (connection->is_chunked == AKWBS_NO)
+        break;
+
+      if (connection->chunk_state != AKWBS_HTTP_CHUNK_DATA)
+        connection->pending_io_msg.bytes = 0;
+      else
+        connection->pending_io_msg.bytes = MIN(connection->pending_io_msg.bytes,
+                                               connection->chunk_end_offset
+                                               - connection->file_cur_offset);
       break;
-    case AKWBS_IO_UNKNOWN_TYPE:
+    default:
+      /* Only uploads write through a prepared request. */
       return AKWBS_ERROR;
     }
     connection->pending_io_msg.fd      = connection->file_descriptor;
     connection->pending_io_msg.sd      = connection->client_socket;
     connection->pending_io_msg.type    = connection->io_type;
     connection->pending_io_msg.offset  = connection->file_cur_offset;
+
+    connection->pending_io_msg.connection       = connection;
+
+    connection->pending_io_msg.synced_offset    = connection->synced_offset;
+    connection->pending_io_msg.writeback_device = connection->writeback_device;
     break;
   case AKWBS_YES:
     /* We will send the request that is pending and was previously prepared */
@@ -443,6 +589,81 @@ static int prepare_io_request(struct akwbs_connection *connection)
 }
 
 
+/*!
+ * Fill the buffer of a connection with the compressed output it is sending. The output
+ * is already in memory, so no working thread is involved.
+ *
+ * \param connection connection sending a compressed output.
+ *
+ * \return AKWBS_SUCCESS.
+ */
+static int copy_compressed_data(struct akwbs_connection *connection)
+{
+  size_t bytes = MIN(ring_buffer_count_free_bytes(&connection->buffer),
+                     (size_t)(connection->file_total_offset - connection->file_cur_offset));
+
+
+  memcpy(ring_buffer_write_address(&connection->buffer),
+         connection->compressed->data + connection->file_cur_offset,
+         bytes);
+
+  ring_buffer_write_advance(&connection->buffer, bytes);
+  connection->file_cur_offset += bytes;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Write the prepared bytes of an upload on the event loop itself, as far as the page
+ * cache takes them without waiting, and the writeback policy has nothing to flush.
+ * Whatever is left stays in the prepared request, for a working thread.
+ *
+ * \param connection connection uploading a file, its request just prepared.
+ *
+ * \return AKWBS_YES if all the bytes were written, AKWBS_NO otherwise.
+ */
+static int write_inline(struct akwbs_connection *connection)
+{
+  struct akwbs_io_pool *pool       = connection->io_group->pool;
+  struct akwbs_request_io_msg *msg = &connection->pending_io_msg;
+  struct akwbs_daemon *daemon_p    = connection->daemon_ref;
+  ssize_t requested = msg->bytes;
+  ssize_t bytes     = msg->bytes;
+
+
+  if ((pool->is_inline_write == AKWBS_NO)
+      || (akwbs_writeback_is_silent(msg, daemon_p->writeback_window, daemon_p->dirty_budget)
+          == AKWBS_NO))
+    return AKWBS_NO;
+
+  if (akwbs_do_io_nowait(msg->fd, msg->address, &bytes, &msg->offset, AKWBS_IO_PUT_TYPE)
+      == AKWBS_ERROR)
+  {
+    pool->is_inline_write = AKWBS_NO;
+    return AKWBS_NO;
+  }
+
+  if (bytes == 0)
+    return AKWBS_NO;
+
+  msg->bytes = bytes;
+  akwbs_writeback_after_write(msg, daemon_p->writeback_window, daemon_p->dirty_budget);
+
+  ring_buffer_read_advance(&connection->buffer, (size_t)bytes);
+  connection->file_cur_offset += bytes;
+  connection->synced_offset    = msg->synced_offset;
+
+  if (bytes == requested)
+    return AKWBS_YES;
+
+  /* The rest of the bytes, from the first the cache did not take. */
+  prepare_io_request(connection);
+
+  return AKWBS_NO;
+}
+
+
 /*!
  * Open the requested file and send the first request I/O of this connection.
  *
@@ -453,29 +674,122 @@ static int prepare_io_request(struct akwbs_connection *connection)
  */
 static int do_handle_request(struct akwbs_connection *connection)
 {
-  if (connection->is_waiting_result == AKWBS_YES)
+  int status = AKWBS_SUCCESS;
+
+
+  /* A download keeps reading while some of its reads are in flight. */
+  if ((connection->is_waiting_result == AKWBS_YES)
+      && (connection->io_type != AKWBS_IO_GET_TYPE))
     return AKWBS_SUCCESS;
 
-  if (connection->file_cur_offset == connection->file_total_offset)
+  if ((connection->is_chunked == AKWBS_YES)
+      && (connection->has_request_pending == AKWBS_NO)
+      && (connection->io_error == 0))
+    status = akwbs_http_decode_chunks(connection);
+
+  if (connection->io_error != 0)
   {
+    if ((connection->io_error == ENOSPC) || (connection->io_error == EDQUOT))
+      send(connection->client_socket, AKWBS_HTTP_507, AKWBS_STRLEN(AKWBS_HTTP_507), 0);
+    else
+      send(connection->client_socket, AKWBS_HTTP_500, AKWBS_STRLEN(AKWBS_HTTP_500), 0);
+  }
+  else if (status == 413)
+    send(connection->client_socket, AKWBS_HTTP_413, AKWBS_STRLEN(AKWBS_HTTP_413), 0);
+  else if (status != AKWBS_SUCCESS)
+    send(connection->client_socket, AKWBS_HTTP_400, AKWBS_STRLEN(AKWBS_HTTP_400), 0);
+
+  if ((connection->io_error != 0) || (status != AKWBS_SUCCESS))
+  {
+    close_connection(connection);
+
+    return AKWBS_SUCCESS;
+  }
+
+  if (connection->file_cur_offset >= connection->file_total_offset)
+  {
+    if (connection->io_type == AKWBS_IO_GET_TYPE)
+    {
+      /* The current range is completely read, but maybe not completely sent yet.      */
+      if (has_pending_response(connection) == AKWBS_YES)
+        return AKWBS_SUCCESS;
+
+      if (akwbs_http_next_part(connection) == AKWBS_YES)
+        return AKWBS_SUCCESS;
+    }
+
     if (connection->io_type == AKWBS_IO_PUT_TYPE)
-      send(connection->client_socket, AKWBS_HTTP_201, strlen(AKWBS_HTTP_201), 0);
+    {
+      /* The parts of a multipart upload, or the source of a copy, are written first. */
+      if ((connection->multipart.action == AKWBS_MULTIPART_COMPLETE)
+          && (connection->multipart.state == AKWBS_MULTIPART_NOT_ASSEMBLED))
+        return (akwbs_multipart_start_assembly(connection), AKWBS_SUCCESS);
+
+      if ((connection->request.method_id == AKWBS_HTTP_METHOD_COPY)
+          && (connection->copy.state == AKWBS_COPY_NOT_STARTED))
+        return (akwbs_copy_start(connection), AKWBS_SUCCESS);
+
+      if (((connection->multipart.state == AKWBS_MULTIPART_FAILED)
+           || (connection->copy.state == AKWBS_COPY_FAILED))
+          && (connection->sync_state == AKWBS_SYNC_NOT_STARTED))
+        connection->sync_state = AKWBS_SYNC_FAILED;
+
+      /*
+       * Readers see the new file only once it is complete, and the 201 promises it
+       * survives a crash, in the configured sense: the sync publishes the file between
+       * syncing its data and its directory.
+       */
+      if (connection->sync_state == AKWBS_SYNC_NOT_STARTED)
+        return (akwbs_commit_start_sync(connection), AKWBS_SUCCESS);
+
+      if (connection->sync_state == AKWBS_SYNC_FAILED)
+        send(connection->client_socket, AKWBS_HTTP_500, AKWBS_STRLEN(AKWBS_HTTP_500), 0);
+      else if ((connection->upload.is_ranged == AKWBS_YES)
+               && (connection->upload.total_size != connection->file_total_offset))
+        send_held_range(connection,
+                        AKWBS_HTTP_204_LINE,
+                        MAX(connection->upload.held_size, connection->file_total_offset));
+      else
+        send(connection->client_socket, AKWBS_HTTP_201, AKWBS_STRLEN(AKWBS_HTTP_201), 0);
+    }
 
-    close(connection->client_socket);
-    connection->connection_state = AKWBS_CONNECTION_CLOSED;
-    manage_file_stat_tree(connection);
-    FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
-    FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
+    close_connection(connection);
 
     return AKWBS_SUCCESS;
   }
 
+  /* The file was cut short under the download, or cannot be read: it is given up. */
+  if ((connection->io_type == AKWBS_IO_GET_TYPE)
+      && (connection->pipeline.is_broken == AKWBS_YES))
+  {
+    if (connection->pipeline.count > 0)
+      return AKWBS_SUCCESS;
+
+    close_connection(connection);
+
+    return AKWBS_SUCCESS;
+  }
+
+  if (connection->compressed != NULL)
+    return copy_compressed_data(connection);
+
+  if (connection->io_type == AKWBS_IO_GET_TYPE)
+  {
+    akwbs_pipeline_submit(connection);
+    return AKWBS_SUCCESS;
+  }
+
   if (prepare_io_request(connection) == AKWBS_ERROR)
     return AKWBS_ERROR;
 
-  if (akwbs_request_io_send_msg(&connection->pending_io_msg,
-                                connection->daemon_ref->request_io_queue[AKWBS_WRITE_INDEX])
-      == AKWBS_ERROR)
+  if (connection->pending_io_msg.bytes <= 0)
+    return AKWBS_SUCCESS;
+
+  if ((connection->has_request_pending == AKWBS_NO)
+      && (write_inline(connection) == AKWBS_YES))
+    return AKWBS_SUCCESS;
+
+  if (akwbs_pool_submit(connection, &connection->pending_io_msg) == AKWBS_ERROR)
     connection->has_request_pending = AKWBS_YES;
   else
   {
@@ -483,13 +797,6 @@ static int do_handle_request(struct akwbs_connection *connection)
     connection->is_waiting_result   = AKWBS_YES;
   }
 
-  posix_fadvise(connection->file_descriptor,
-                connection->file_cur_offset,
-                connection->pending_io_msg.bytes,
-                POSIX_FADV_SEQUENTIAL);
-
-  pthread_cond_signal(&connection->daemon_ref->request_io_queue_cond);
-
   return AKWBS_SUCCESS;
 }
 
@@ -511,11 +818,11 @@ static int check_end_of_header(struct akwbs_connection *connection)
 {
   char *initial_address = ring_buffer_read_address(&connection->buffer);
   size_t total_bytes_in_buffer = ring_buffer_count_bytes(&connection->buffer);
-  size_t bytes_read = 0;
+  size_t bytes_read = connection->header_scanned_bytes;
   char *variable_position = NULL;
 
 
-  for (variable_position = initial_address;
+  for (variable_position = initial_address + bytes_read;
        ((bytes_read != total_bytes_in_buffer)
         && (bytes_read < AKWBS_SIZE_HEADER_TOO_BIG));
        bytes_read++, variable_position++)
@@ -528,11 +835,7 @@ static int check_end_of_header(struct akwbs_connection *connection)
         break;
       case AKWBS_HEADER_FIRST_CARRIAGE_RETURN:
         if (*variable_position == '\n')
-        {
           connection->header_state = AKWBS_HEADER_FIRST_LINEFEED;
-          if (connection->end_of_first_header_line == NULL)
-            connection->end_of_first_header_line = variable_position;
-        }
         else
           connection->header_state = AKWBS_HEADER_INITIAL;
         break;
@@ -547,6 +850,7 @@ static int check_end_of_header(struct akwbs_connection *connection)
         {
           connection->header_state = AKWBS_HEADER_LAST_LINEFEED;
           connection->end_of_header = ++variable_position;
+          connection->header_scanned_bytes = ++bytes_read;
           return AKWBS_SUCCESS;
         }
         else
@@ -557,6 +861,8 @@ static int check_end_of_header(struct akwbs_connection *connection)
     }
   }
 
+  connection->header_scanned_bytes = bytes_read;
+
   if ((bytes_read >= AKWBS_SIZE_HEADER_TOO_BIG)
       && (connection->header_state != AKWBS_HEADER_LAST_LINEFEED))
     return AKWBS_ERROR;
@@ -602,14 +908,16 @@ static int recv_header(struct akwbs_connection *connection)
   return AKWBS_SUCCESS;
 
 close_and_error:
-  send(connection->client_socket, AKWBS_HTTP_400, strlen(AKWBS_HTTP_400), 0);
+  send(connection->client_socket, AKWBS_HTTP_400, AKWBS_STRLEN(AKWBS_HTTP_400), 0);
   close(connection->client_socket);
+  FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
+  FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
   connection->connection_state = AKWBS_CONNECTION_CLOSED;
-  return AKWBS_ERROR;
+  return AKWBS_SUCCESS;
 }
 
 /*!
- * Start the transmission for this connection.
+ * Start the transmission for this connection, once a working thread opened its file.
  *
  * \param connection connection to handle.
  * \param daemon_p pointer to the daemon structure containing data about the request I/O
@@ -621,11 +929,33 @@ static int init_transmission(struct akwbs_connection *connection)
 {
   struct stat s_stat;
   int ret = AKWBS_ERROR;
+  int is_full = AKWBS_NO;
 
 
+  /* Initiating or aborting a multipart upload was done with the opening, and replied. */
+  if ((connection->io_type == AKWBS_IO_PUT_TYPE)
+      && ((connection->multipart.action == AKWBS_MULTIPART_INITIATE)
+          || (connection->multipart.action == AKWBS_MULTIPART_ABORT)))
+  {
+    close(connection->client_socket);
+    connection->connection_state = AKWBS_CONNECTION_CLOSED;
+    FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
+    FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
+    return AKWBS_SUCCESS;
+  }
+
+  /* What an upload opened is already released, by the working thread that failed. */
   if (open_resource(connection) == AKWBS_ERROR)
   {
-    send(connection->client_socket, AKWBS_HTTP_404, strlen(AKWBS_HTTP_404), 0);
+    if ((connection->io_type == AKWBS_IO_PUT_TYPE)
+        && ((connection->opening.error == ENOSPC) || (connection->opening.error == EDQUOT)))
+      is_full = AKWBS_YES;
+
+    if (is_full == AKWBS_YES)
+      send(connection->client_socket, AKWBS_HTTP_507, AKWBS_STRLEN(AKWBS_HTTP_507), 0);
+    else
+      send(connection->client_socket, AKWBS_HTTP_404, AKWBS_STRLEN(AKWBS_HTTP_404), 0);
+
     close(connection->client_socket);
     connection->connection_state = AKWBS_CONNECTION_CLOSED;
     FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
@@ -633,6 +963,36 @@ static int init_transmission(struct akwbs_connection *connection)
     return AKWBS_SUCCESS;
   }
 
+  /* A query, or a range that would leave a hole, gets the bytes already held. */
+  if ((connection->io_type == AKWBS_IO_PUT_TYPE)
+      && (connection->upload.is_ranged == AKWBS_YES)
+      && ((connection->upload.is_query == AKWBS_YES)
+          || (connection->file_cur_offset > connection->upload.held_size)))
+  {
+    send_held_range(connection,
+                    (connection->upload.is_query == AKWBS_YES) ? AKWBS_HTTP_204_LINE
+                                                               : AKWBS_HTTP_416_LINE,
+                    connection->upload.held_size);
+
+    close_connection(connection);
+    return AKWBS_SUCCESS;
+  }
+
+  /* The target is opened and its space reserved: the client may now send the body. */
+  if ((connection->io_type == AKWBS_IO_PUT_TYPE)
+      && (connection->expects_continue == AKWBS_YES))
+    send(connection->client_socket, AKWBS_HTTP_100, AKWBS_STRLEN(AKWBS_HTTP_100), 0);
+
+  if (connection->io_type == AKWBS_IO_GET_TYPE)
+    akwbs_compress_select(connection);
+
+  if ((connection->io_type == AKWBS_IO_GET_TYPE)
+      && (akwbs_http_prepare_response(connection) != AKWBS_SUCCESS))
+  {
+    close_connection(connection);
+    return AKWBS_SUCCESS;
+  }
+
   ret = do_handle_request(connection);
 
   connection->connection_state = AKWBS_CONNECTION_ON_TRANSMISSION;
@@ -641,6 +1001,26 @@ static int init_transmission(struct akwbs_connection *connection)
 }
 
 
+/*!
+ * Check whether the upload of a client that left can no longer be completed: its body
+ * is short, and every byte it sent is written.
+ *
+ * \param connection connection holding a PUT request.
+ *
+ * \return AKWBS_YES if the upload is cut short. AKWBS_NO otherwise.
+ */
+static int is_body_cut(struct akwbs_connection *connection)
+{
+  if ((connection->is_waiting_result == AKWBS_YES)
+      || (ring_buffer_count_bytes(&connection->buffer) > 0))
+    return AKWBS_NO;
+
+  /* A chunked body has no end known before its last chunk. */
+  return (connection->file_cur_offset < connection->file_total_offset) ? AKWBS_YES
+                                                                       : AKWBS_NO;
+}
+
+
 /*!
  * Handle the given connection on transmission state.
  *
@@ -662,18 +1042,24 @@ static int handle_transmission(struct akwbs_connection *connection)
 
       if (send_data_to_socket(connection) == AKWBS_ERROR)
       {
-        manage_file_stat_tree(connection);
-        close(connection->client_socket);
-        connection->connection_state = AKWBS_CONNECTION_CLOSED;
-
+        close_connection(connection);
         return AKWBS_ERROR;
       }
       do_handle_request(connection);
       break;
     case AKWBS_IO_PUT_TYPE:
-      if (FD_ISSET(connection->client_socket, &connection->daemon_ref->temp_read_set))
-        recv_data_from_socket(connection);
+      /* What a client sent before it left is still written, and replied if complete. */
+      if (FD_ISSET(connection->client_socket, &connection->daemon_ref->temp_read_set)
+          && (recv_data_from_socket(connection) == AKWBS_ERROR))
+      {
+        connection->is_peer_closed = AKWBS_YES;
+        FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
+      }
       do_handle_request(connection);
+      if ((connection->is_peer_closed == AKWBS_YES)
+          && (connection->connection_state != AKWBS_CONNECTION_CLOSED)
+          && (is_body_cut(connection) == AKWBS_YES))
+        close_connection(connection);
       break;
     default:
       /* If we got here, the genius programmer is missing something... I assume.        */
@@ -686,11 +1072,12 @@ static int handle_transmission(struct akwbs_connection *connection)
  * Create a new connection object.
  *
  * \param connection pointer to the location where the new connection will be stored.
+ * \param buffer_order order of its ring buffer, log2 of its size.
  *
  * \return AKWBS_SUCCESS on success creating this new connection.
  *         AKWBS_ERROR on error while creating new connection.
  */
-int akwbs_create_new_connection(struct akwbs_connection **connection)
+int akwbs_create_new_connection(struct akwbs_connection **connection, size_t buffer_order)
 {
   if (*connection != NULL)
     return AKWBS_ERROR;
@@ -701,8 +1088,12 @@ int akwbs_create_new_connection(struct akwbs_connection **connection)
     return AKWBS_ERROR;
 
   (*connection)->file_descriptor = AKWBS_ERROR;
+  (*connection)->direct_descriptor = AKWBS_ERROR;
+  (*connection)->upload.directory_descriptor  = AKWBS_ERROR;
+  (*connection)->multipart.staging_descriptor = AKWBS_ERROR;
+  (*connection)->copy.source_descriptor       = AKWBS_ERROR;
 
-  if (ring_buffer_create(&(*connection)->buffer, 15) == AKWBS_ERROR)
+  if (ring_buffer_create(&(*connection)->buffer, buffer_order) == AKWBS_ERROR)
     goto free_and_fail;
 
   gettimeofday(&(*connection)->last_activity, NULL);
@@ -737,16 +1128,18 @@ int akwbs_handle_connection(struct akwbs_connection *connection)
       return AKWBS_ERROR;
     break;
   case AKWBS_CONNECTION_HEADERS_PROCESSED:
+    /* If no working thread can take the opening now, it is tried again later. */
+    akwbs_opening_start(connection);
+    break;
+  case AKWBS_CONNECTION_OPENING:
+    if (connection->is_waiting_result == AKWBS_YES)
+      break;
     if (init_transmission(connection) == AKWBS_ERROR)
       return AKWBS_ERROR;
     break;
   case AKWBS_CONNECTION_ON_TRANSMISSION:
     if (handle_transmission(connection) == AKWBS_ERROR)
-    {
-      close(connection->client_socket);
-      manage_file_stat_tree(connection);
-      connection->connection_state = AKWBS_CONNECTION_CLOSED;
-    }
+      close_connection(connection);
     if (connection->connection_state != AKWBS_CONNECTION_CLOSED)
       break;
     /* INTENTIONAL FALL THROUGH! */
@@ -9,10 +9,22 @@
 #define _AKWBS_MT_CONNECTION_H_
 
 
+#include <sys/uio.h>
+
 #include "ringbuffer.h"
 #include "io.h"
 #include "requestio.h"
 #include "daemon.h"
+#include "http.h"
+#include "file_tree.h"
+#include "mime.h"
+#include "upload.h"
+#include "multipart.h"
+#include "copy.h"
+#include "pipeline.h"
+#include "direct.h"
+#include "readahead.h"
+#include "opening.h"
 
 
 /*!
@@ -21,12 +33,26 @@
 #define AKWBS_HTTP_200 "HTTP/1.0 200 OK\r\n\r\n"
 #define AKWBS_HTTP_201 "HTTP/1.0 201 CREATED\r\n\r\n"
 #define AKWBS_HTTP_202 "HTTP/1.0 202 ACCEPTED\r\n\r\n"
+#define AKWBS_HTTP_204 "HTTP/1.0 204 NO CONTENT\r\n\r\n"
 #define AKWBS_HTTP_400 "HTTP/1.0 400 BAD REQUEST\r\n\r\n"
 #define AKWBS_HTTP_411 "HTTP/1.0 411 LENGTH REQUIRED\r\n\r\n"
 #define AKWBS_HTTP_413 "HTTP/1.0 413 REQUEST ENTITY TOO LARGE\r\n\r\n"
 #define AKWBS_HTTP_414 "HTTP/1.0 414 REQUESTED-URI TOO LONG\r\n\r\n"
+#define AKWBS_HTTP_417 "HTTP/1.0 417 EXPECTATION FAILED\r\n\r\n"
 #define AKWBS_HTTP_404 "HTTP/1.0 404 NOT FOUND\r\n\r\n"
+#define AKWBS_HTTP_END_OF_HEAD "\r\n"
+#define AKWBS_HTTP_100 "HTTP/1.1 100 Continue\r\n\r\n"
+
+#define AKWBS_HTTP_200_LINE "HTTP/1.0 200 OK\r\n"
+#define AKWBS_HTTP_201_LINE "HTTP/1.0 201 CREATED\r\n"
+#define AKWBS_HTTP_204_LINE "HTTP/1.0 204 NO CONTENT\r\n"
+#define AKWBS_HTTP_206_LINE "HTTP/1.0 206 PARTIAL CONTENT\r\n"
+#define AKWBS_HTTP_304_LINE "HTTP/1.0 304 NOT MODIFIED\r\n"
+#define AKWBS_HTTP_416_LINE "HTTP/1.0 416 REQUESTED RANGE NOT SATISFIABLE\r\n"
+#define AKWBS_HTTP_500 "HTTP/1.0 500 INTERNAL SERVER ERROR\r\n\r\n"
+#define AKWBS_HTTP_501 "HTTP/1.0 501 NOT IMPLEMENTED\r\n\r\n"
 #define AKWBS_HTTP_505 "HTTP/1.0 505 HTTP VERSION NOT SUPPORTED\r\n\r\n"
+#define AKWBS_HTTP_507 "HTTP/1.0 507 INSUFFICIENT STORAGE\r\n\r\n"
 
 
 #define AKWBS_SIZE_HEADER_TOO_BIG 8000 /*!< Beyond this limit, the requested header is
@@ -36,6 +62,26 @@
                                         */
 
 
+#define AKWBS_RESPONSE_HEAD_SIZE 768 /*!< Room for the response header of a connection,
+                                      *   with a copy of the cached header lines of its
+                                      *   file, or for the header of a multipart body part.
+                                      */
+
+
+#define AKWBS_RESPONSE_MAX_IOV 8     /*!< Pieces a response head may be made of.        */
+
+
+/*!
+ * Length of a string literal, computed at compile time.
+ */
+#define AKWBS_STRLEN(literal) (sizeof(literal) - 1)
+
+
+#define AKWBS_MAX_RANGES 8           /*!< Beyond this number of byte ranges, a Range
+                                      *   header is ignored and the whole file is sent.
+                                      */
+
+
 #define AKWBS_TIMEOUT_SECONDS 120     /*!< After this limit, the connection will be
                                        *   dropped.
                                        */
@@ -72,17 +118,22 @@ enum akwbs_connection_state
   AKWBS_CONNECTION_HEADERS_PROCESSED = AKWBS_CONNECTION_HEADERS_RECEIVED + 1,
 
   /*!
-   * 5: We are currently on transmission of data.
+   * 5: A working thread is opening the requested file.
    */
-  AKWBS_CONNECTION_ON_TRANSMISSION = AKWBS_CONNECTION_HEADERS_PROCESSED + 1,
+  AKWBS_CONNECTION_OPENING = AKWBS_CONNECTION_HEADERS_PROCESSED + 1,
 
   /*!
-   * 6: We have closed this connection.
+   * 6: We are currently on transmission of data.
+   */
+  AKWBS_CONNECTION_ON_TRANSMISSION = AKWBS_CONNECTION_OPENING + 1,
+
+  /*!
+   * 7: We have closed this connection.
    */
   AKWBS_CONNECTION_CLOSED = AKWBS_CONNECTION_ON_TRANSMISSION + 1,
 
   /*!
-   * 7: This connection is marked for cleanup.
+   * 8: This connection is marked for cleanup.
    */
   AKWBS_CONNECTION_CLEANUP = AKWBS_CONNECTION_CLOSED + 1
 };
@@ -136,6 +187,31 @@ enum akwbs_header_state
 };
 
 
+/*!
+ * Progress of the sync publishing an upload, and making it durable as configured.
+ */
+enum akwbs_sync_state
+{
+  AKWBS_SYNC_NOT_STARTED = 0,   /*!< Not published nor synced yet.                      */
+
+  AKWBS_SYNC_IN_PROGRESS,       /*!< Waiting for the sync result.                       */
+
+  AKWBS_SYNC_DONE,              /*!< The upload is published, and on disk as configured.*/
+
+  AKWBS_SYNC_FAILED             /*!< The sync failed, the upload may be lost.           */
+};
+
+
+/*!
+ * Inclusive byte range of a file, as requested by a Range header.
+ */
+struct akwbs_byte_range
+{
+  off_t first;                  /*!< Offset of the first byte.                          */
+  off_t last;                   /*!< Offset of the last byte.                           */
+};
+
+
 /*!
  * Structure representing a connection with client through a socket.
  */
@@ -149,15 +225,19 @@ struct akwbs_connection
 
   int file_descriptor;               /*!< File descriptor of requested resource.        */
 
+  int direct_descriptor;             /*!< The same file opened for direct reads, or -1. */
+
   int client_socket;                 /*!< Client socket descriptor.                     */
 
   int has_request_pending;           /*!< A previous request could not be sent.         */
 
   int is_waiting_result;             /*!< Waiting for a result.                         */
 
+  int has_released_file;             /*!< The file of the closed connection is released.*/
+
   int has_opening_fd_pending;        /*!< Resource could not be opened in last attempt. */
 
-  char *file_name;                   /*!< Resource name.                                */
+  char *file_name;                   /*!< Resource name, inside the request header.     */
 
   off_t file_total_offset;           /*!< Total offset for the reuested file.           */
 
@@ -174,6 +254,16 @@ struct akwbs_connection
 
   struct akwbs_daemon *daemon_ref;   /*!< Reference to the daemon handling this conn.   */
 
+  struct akwbs_io_group *io_group;   /*!< Working threads serving this connection.      */
+
+  unsigned long io_submitted;        /*!< I/O requests handed to the working threads.   */
+
+  struct akwbs_pipeline pipeline;    /*!< Reads of the download in flight.              */
+
+  struct akwbs_readahead readahead;  /*!< Readahead of the download.                    */
+
+  struct akwbs_opening opening;      /*!< Opening of the requested file.                */
+
   enum akwbs_io_type io_type;        /*!< Type of I/O that must be performed.           */
 
   struct timeval last_time_io;       /*!< Last time we performed some transmission.     */
@@ -182,9 +272,69 @@ struct akwbs_connection
 
   size_t bytes_sent_last_io;         /*!< Bytes on last I/O operation.                  */
 
-  char *end_of_first_header_line;    /*!< Pointer to the end of first line on header.   */
+  size_t header_scanned_bytes;       /*!< Header bytes already scanned for CRLFCRLF.    */
+
+  int is_chunked;                    /*!< The request body uses chunked coding.         */
+  int expects_continue;              /*!< The client waits for 100 before the body.     */
+  int is_peer_closed;                /*!< The client will send nothing more.            */
+
+  enum akwbs_http_chunk_state
+    chunk_state;                     /*!< State of the chunked body decoder.            */
+
+  off_t chunk_end_offset;            /*!< File offset where the current chunk ends.     */
+
+  enum akwbs_sync_state
+    sync_state;                      /*!< Progress of the sync of the upload.           */
+
+  off_t synced_offset;               /*!< Uploaded bytes below it are on disk.          */
+
+  int io_error;                      /*!< errno of a failed write of the upload, or 0.  */
+
+  struct akwbs_upload upload;        /*!< Upload in progress, for PUT.                  */
+  struct akwbs_multipart multipart;  /*!< Multipart request, for PUT.                   */
+  struct akwbs_copy copy;            /*!< Server-side copy, for COPY.                   */
+
+  struct akwbs_writeback_device
+    *writeback_device;               /*!< Dirty byte account of the uploaded file.      */
 
   char *end_of_header;               /*!< Pointer to the end of the header.             */
+
+  struct akwbs_http_request request; /*!< Index of the request header.                  */
+
+  struct akwbs_file_stat *file_stat; /*!< Opened file being read.                       */
+
+  char response_head
+    [AKWBS_RESPONSE_HEAD_SIZE];      /*!< Header lines formatted for this response.     */
+
+  size_t response_head_length;       /*!< Bytes used in response_head.                  */
+
+  struct iovec response_iov
+    [AKWBS_RESPONSE_MAX_IOV];        /*!< Pieces of the response head, to be sent
+                                      *   before the buffer. They point to literals,
+                                      *   to response_head or to the opened file.
+                                      */
+
+  unsigned int response_iov_count;   /*!< Pieces in the response head.                  */
+
+  unsigned int response_iov_sent;    /*!< Pieces of the response head already sent.     */
+
+  struct akwbs_byte_range
+    ranges[AKWBS_MAX_RANGES];        /*!< Requested byte ranges.                        */
+
+  unsigned int ranges_count;         /*!< Number of requested byte ranges.              */
+
+  unsigned int ranges_started;       /*!< Byte ranges whose transmission started.       */
+
+  char boundary[17];                 /*!< Boundary of a multipart/byteranges body.      */
+
+  const struct akwbs_mime_type
+    *mime_type;                      /*!< Media type of the requested file.             */
+
+  enum akwbs_http_encoding
+    content_encoding;                /*!< Content coding of the opened file.            */
+
+  struct akwbs_compressed
+    *compressed;                     /*!< Compressed output being sent, if any.         */
 };
 
 
@@ -192,6 +342,7 @@ struct akwbs_connection
  * Public interface.
  */
 int akwbs_handle_connection(struct akwbs_connection *connection);
-int akwbs_create_new_connection(struct akwbs_connection **connection);
+int akwbs_create_new_connection(struct akwbs_connection **connection, size_t buffer_order);
+void akwbs_release_connection_file(struct akwbs_connection *connection);
 
 #endif /* END OF CONNECTION.H */
@@ -0,0 +1,157 @@
+/*!
+ * \file   copy.c
+ * \brief  Server-side copies. The source never crosses the network, nor user space
+ *         where copy_file_range works: on XFS and btrfs the copy shares the extents of
+ *         the source, so even large files are copied in milliseconds.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "copy.h"
+#include "connection.h"
+#include "daemon.h"
+#include "pool.h"
+#include "internal.h"
+#include "io.h"
+
+
+/*!
+ * Open the source of a COPY, which is the path of the request. It must be a regular
+ * file.
+ *
+ * \param connection connection holding a PUT or COPY request.
+ *
+ * \return AKWBS_SUCCESS on success, or if the request is not a COPY.
+ *         AKWBS_ERROR on error, errno is then ENOENT if there is no such source.
+ */
+int akwbs_copy_open(struct akwbs_connection *connection)
+{
+  struct akwbs_copy *copy = &connection->copy;
+  char path[PATH_MAX];
+  struct stat stat_buf;
+  int length = 0;
+
+
+  copy->source_descriptor = AKWBS_ERROR;
+  copy->state             = AKWBS_COPY_NOT_STARTED;
+
+  if (connection->request.method_id != AKWBS_HTTP_METHOD_COPY)
+    return AKWBS_SUCCESS;
+
+  length = snprintf(path,
+                    sizeof(path),
+                    "%s%s",
+                    connection->daemon_ref->root_path,
+                    connection->request.uri.data);
+
+  if ((length < 0) || ((size_t)length >= sizeof(path)))
+    return AKWBS_ERROR;
+
+  copy->source_descriptor = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (copy->source_descriptor == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  if ((fstat(copy->source_descriptor, &stat_buf) == AKWBS_ERROR)
+      || (! S_ISREG(stat_buf.st_mode)))
+  {
+    errno = ENOENT;
+    return AKWBS_ERROR;
+  }
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Hand the copy of the source to a working thread. If the request queue is full,
+ * nothing is changed and the copy is tried again later.
+ *
+ * \param connection connection holding a COPY, its upload file opened.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR if the request could not be queued.
+ */
+int akwbs_copy_start(struct akwbs_connection *connection)
+{
+  struct akwbs_request_io_msg msg;
+
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.sd        = connection->client_socket;
+  msg.fd        = connection->file_descriptor;
+  msg.source_fd = connection->copy.source_descriptor;
+  msg.type      = AKWBS_IO_COPY_TYPE;
+  msg.connection = connection;
+
+  if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  connection->copy.state        = AKWBS_COPY_IN_PROGRESS;
+  connection->is_waiting_result = AKWBS_YES;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Copy the whole source into the upload file. Called by working threads.
+ *
+ * \param msg param-return request of the copy. On return, its bytes are the number of
+ *        bytes copied, or AKWBS_ERROR on error.
+ */
+void akwbs_copy_run(struct akwbs_request_io_msg *msg)
+{
+  struct stat stat_buf;
+  off_t offset = 0;
+
+
+  msg->bytes = AKWBS_ERROR;
+
+  if (fstat(msg->source_fd, &stat_buf) == AKWBS_ERROR)
+    return;
+
+  if (akwbs_copy_file(msg->source_fd, stat_buf.st_size, msg->fd, &offset) == AKWBS_ERROR)
+    return;
+
+  msg->bytes = (ssize_t)offset;
+}
+
+
+/*!
+ * Account a finished copy. Called by the daemon thread, with the result sent by the
+ * working thread.
+ *
+ * \param connection connection holding the COPY.
+ * \param result result of the copy.
+ */
+void akwbs_copy_complete(struct akwbs_connection *connection, struct akwbs_result_io *result)
+{
+  if ((ssize_t)result->bytes_read == AKWBS_ERROR)
+    connection->copy.state = AKWBS_COPY_FAILED;
+  else
+    connection->copy.state = AKWBS_COPY_DONE;
+
+  connection->is_waiting_result = AKWBS_NO;
+}
+
+
+/*!
+ * Release the source of a copy, if any.
+ *
+ * \param connection connection being closed.
+ */
+void akwbs_copy_release(struct akwbs_connection *connection)
+{
+  if (connection->copy.source_descriptor != AKWBS_ERROR)
+    close(connection->copy.source_descriptor);
+
+  connection->copy.source_descriptor = AKWBS_ERROR;
+}
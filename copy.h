@@ -0,0 +1,53 @@
+/*!
+ * \file   copy.h
+ * \brief  Server-side copies: a COPY is an upload whose body is another served file.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_COPY_H_
+#define _AKWBS_MT_COPY_H_
+
+#include "requestio.h"
+#include "resultio.h"
+
+
+struct akwbs_connection;
+
+
+/*!
+ * States of the copy of a source file into an upload.
+ */
+enum akwbs_copy_state
+{
+  AKWBS_COPY_NOT_STARTED = 0,   /*!< The source has not been copied yet.                */
+
+  AKWBS_COPY_IN_PROGRESS,       /*!< A working thread is copying the source.            */
+
+  AKWBS_COPY_DONE,              /*!< The source is copied into the upload file.         */
+
+  AKWBS_COPY_FAILED             /*!< The copy failed.                                   */
+};
+
+
+/*!
+ * A server-side copy. The source is copied by a working thread into the upload file of
+ * the destination, which is then published like any other upload.
+ */
+struct akwbs_copy
+{
+  int source_descriptor;        /*!< Source file, or -1.                                */
+
+  enum akwbs_copy_state state;  /*!< State of the copy.                                 */
+};
+
+
+/*
+ * Public Interface.
+ */
+int akwbs_copy_open(struct akwbs_connection *connection);
+int akwbs_copy_start(struct akwbs_connection *connection);
+void akwbs_copy_run(struct akwbs_request_io_msg *msg);
+void akwbs_copy_complete(struct akwbs_connection *connection, struct akwbs_result_io *result);
+void akwbs_copy_release(struct akwbs_connection *connection);
+
+#endif /* END OF copy.h */
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/param.h>
+#include <time.h>
 
 #include "daemon.h"
 #include "internal.h"
@@ -26,6 +27,8 @@
 #include "resultio.h"
 #include "thread_io.h"
 #include "http.h"
+#include "compress.h"
+#include "pool.h"
 
 
 /* GLOBAL VARIABLES FOR SIGNALS USED BY THE SERVER'S DAEMON. */
@@ -315,10 +318,13 @@ static int handle_incoming_connections(struct akwbs_daemon *daemon_p)
         return AKWBS_ERROR;
     }
 
-  if (akwbs_create_new_connection(&connection) == AKWBS_ERROR)
+  if (akwbs_create_new_connection(&connection,
+                                  akwbs_pipeline_buffer_order(daemon_p->read_depth))
+      == AKWBS_ERROR)
     return (close(new_socket), AKWBS_ERROR);
 
   connection->daemon_ref = daemon_p;
+  connection->io_group   = akwbs_pool_assign(daemon_p, &connection->buffer);
 
   if (new_socket > daemon_p->max_fds)
     daemon_p->max_fds = new_socket;
@@ -341,38 +347,102 @@ static int handle_incoming_connections(struct akwbs_daemon *daemon_p)
 
 
 /*!
- * Search for the given socket in the active connections list.
+ * Search for the connection a result was requested for, among the active connections
+ * and those waiting for their results to come back before being freed.
  *
  * \param connection param-return that will be pointing to the found connection.
  * \param daemon_p pointer to the daemon that holds all information about connections.
- * \param socket_to_find the socket descriptor to perform the search.
+ * \param connection_to_find the connection carried by the result.
+ *
+ * \return AKWBS_SUCCESS in case we did found the connection. AKWBS_ERROR otherwise.
  *
- * \return AKWBS_SUCCESS in case we did found the connection with the given socket
- *         descriptor. The param <u>connection</u> is set to point to found connection.
- *         AKWBS_ERROR if we did not found the given socket descriptor in the active
- *         connections list.
+ * \details The result is matched by its connection, not by socket: the socket of a
+ *          closed connection may already belong to a new one.
  */
-static int search_connection_by_socket(struct akwbs_connection **connection,
-                                      struct akwbs_daemon *daemon_p,
-                                      int socket_to_find)
+static int search_connection(struct akwbs_connection **connection,
+                             struct akwbs_daemon *daemon_p,
+                             struct akwbs_connection *connection_to_find)
 {
-  struct akwbs_connection *next = NULL;
-  struct akwbs_connection *pos  = NULL;
+  struct akwbs_connection *lists[2];
+  struct akwbs_connection *pos = NULL;
+  unsigned int i;
 
 
-  next = daemon_p->active_connections_head;
+  lists[0] = daemon_p->active_connections_head;
+  lists[1] = daemon_p->cleanup_connections_head;
 
-  while (NULL != (pos = next))
-  {
-    next = pos->next;
+  for (i = 0; i < 2; i++)
+    for (pos = lists[i]; pos != NULL; pos = pos->next)
+      if (pos == connection_to_find)
+      {
+        *connection = pos;
 
-    if (pos->client_socket != socket_to_find)
-      continue;
+        return AKWBS_SUCCESS;
+      }
 
-    *connection = pos;
+  return AKWBS_ERROR;
+}
 
-    return AKWBS_SUCCESS;
-  }
+
+/*!
+ * Drop the result of a connection closed while it was in flight. What an opening
+ * handed to a download is closed; an upload is released with the connection, now that
+ * nothing it opened is in use.
+ *
+ * \param connection the closed connection.
+ * \param result_msg the result dropped.
+ */
+static void drop_result(struct akwbs_connection *connection,
+                        struct akwbs_result_io *result_msg)
+{
+  connection->is_waiting_result = AKWBS_NO;
+
+  if ((result_msg->type != AKWBS_IO_OPEN_TYPE)
+      || (connection->io_type != AKWBS_IO_GET_TYPE)
+      || (connection->file_descriptor == AKWBS_ERROR))
+    return;
+
+  akwbs_opening_close(connection, connection->file_descriptor, connection->direct_descriptor);
+
+  connection->file_descriptor   = AKWBS_ERROR;
+  connection->direct_descriptor = AKWBS_ERROR;
+}
+
+
+/*!
+ * Search for the connection a read of a download belongs to, among the active
+ * connections and those waiting for their reads to come back before being freed.
+ *
+ * \param connection param-return that will be pointing to the found connection.
+ * \param daemon_p pointer to the daemon that holds all information about connections.
+ * \param address address the read landed at.
+ *
+ * \return AKWBS_SUCCESS in case we did found the connection owning the read.
+ *         AKWBS_ERROR otherwise.
+ *
+ * \details The read is matched by its place in a ring buffer, not by socket: the socket
+ *          of a closed connection may already belong to a new one.
+ */
+static int search_connection_by_read(struct akwbs_connection **connection,
+                                     struct akwbs_daemon *daemon_p,
+                                     void *address)
+{
+  struct akwbs_connection *lists[2];
+  struct akwbs_connection *pos = NULL;
+  unsigned int i;
+
+
+  lists[0] = daemon_p->active_connections_head;
+  lists[1] = daemon_p->cleanup_connections_head;
+
+  for (i = 0; i < 2; i++)
+    for (pos = lists[i]; pos != NULL; pos = pos->next)
+      if (akwbs_pipeline_owns(pos, address) == AKWBS_YES)
+      {
+        *connection = pos;
+
+        return AKWBS_SUCCESS;
+      }
 
   return AKWBS_ERROR;
 }
@@ -385,7 +455,7 @@ static int search_connection_by_socket(struct akwbs_connection **connection,
  *        connections.
  *
  * \return AKWBS_SUCCESS on success.
- *         AKWBS_ERROR on error while trying to get results or finding the connection.
+ *         AKWBS_ERROR on error while trying to get results.
  *
  * \details This function starts by checking if the daemon pointer is not NULL and if the
  *          result queue descriptor is ready or reading.
@@ -410,15 +480,75 @@ static int handle_results(struct akwbs_daemon *daemon_p)
       == AKWBS_ERROR)
     return AKWBS_ERROR;
 
-  if (search_connection_by_socket(&connection,
-                                  daemon_p,
-                                  result_msg.connection_fd) == AKWBS_ERROR)
-    return AKWBS_ERROR;
+  if (result_msg.type == AKWBS_IO_COMPRESS_TYPE)
+  {
+    akwbs_compress_complete(daemon_p, &result_msg);
+    return AKWBS_SUCCESS;
+  }
 
-  if (connection->io_type == AKWBS_IO_GET_TYPE)
-    ring_buffer_write_advance(&connection->buffer, result_msg.bytes_read);
-  else
-    ring_buffer_read_advance(&connection->buffer, result_msg.bytes_read);
+  if (result_msg.type == AKWBS_IO_GET_TYPE)
+  {
+    if (search_connection_by_read(&connection, daemon_p, result_msg.address)
+        == AKWBS_SUCCESS)
+      akwbs_pipeline_complete(connection, &result_msg);
+
+    return AKWBS_SUCCESS;
+  }
+
+  /* The connection is closed, but kept until this result. */
+  if (result_msg.type == AKWBS_IO_RELEASE_TYPE)
+  {
+    akwbs_opening_released((struct akwbs_connection *)result_msg.address);
+    return AKWBS_SUCCESS;
+  }
+
+  /* A connection is kept until its results are back: a miss has nothing left to free. */
+  if (search_connection(&connection, daemon_p, result_msg.connection) == AKWBS_ERROR)
+    return AKWBS_SUCCESS;
+
+  if ((connection->connection_state == AKWBS_CONNECTION_CLOSED)
+      || (connection->connection_state == AKWBS_CONNECTION_CLEANUP))
+  {
+    drop_result(connection, &result_msg);
+    return AKWBS_SUCCESS;
+  }
+
+  if (result_msg.type == AKWBS_IO_SYNC_TYPE)
+  {
+    if ((ssize_t)result_msg.bytes_read == AKWBS_ERROR)
+      connection->sync_state = AKWBS_SYNC_FAILED;
+    else
+      connection->sync_state = AKWBS_SYNC_DONE;
+
+    connection->is_waiting_result = AKWBS_NO;
+
+    return AKWBS_SUCCESS;
+  }
+
+  if (result_msg.type == AKWBS_IO_ASSEMBLE_TYPE)
+  {
+    akwbs_multipart_assembled(connection, &result_msg);
+    return AKWBS_SUCCESS;
+  }
+
+  if (result_msg.type == AKWBS_IO_COPY_TYPE)
+  {
+    akwbs_copy_complete(connection, &result_msg);
+    return AKWBS_SUCCESS;
+  }
+
+  if (result_msg.type == AKWBS_IO_OPEN_TYPE)
+  {
+    akwbs_opening_complete(connection, &result_msg);
+    return AKWBS_SUCCESS;
+  }
+
+  /* A failed write would only fail again: the upload is given up. */
+  if (result_msg.error != 0)
+    connection->io_error = result_msg.error;
+
+  ring_buffer_read_advance(&connection->buffer, result_msg.bytes_read);
+  connection->synced_offset = result_msg.synced_offset;
 
   connection->file_cur_offset += result_msg.bytes_read;
   connection->is_waiting_result = 0;
@@ -467,9 +597,15 @@ static int update_max_fds(struct akwbs_daemon *daemon_p)
  * Clean up the given connection.
  *
  * \param connection pointer to the connection that must be cleaned up.
+ * \param is_deferring AKWBS_YES to keep the connections with I/O in flight, which still
+ *        uses their buffers and files, until its result is back, and those whose upload
+ *        a working thread is releasing or could not be handed yet. Their file is released
+ *        once nothing is in flight. AKWBS_NO once the working threads are stopped: what
+ *        could not be handed to them is done at once.
  */
 static void cleanup_connections_list(struct akwbs_connection **list_head,
-                                     struct akwbs_connection **list_tail)
+                                     struct akwbs_connection **list_tail,
+                                     int is_deferring)
 {
   struct akwbs_connection *next = NULL;
   struct akwbs_connection *pos  = NULL;
@@ -481,12 +617,31 @@ static void cleanup_connections_list(struct akwbs_connection **list_head,
   {
     next = pos->next;
 
+    /* Its socket is closed and may be reused, so it is cleared from the sets once. */
+    if (pos->client_socket != AKWBS_ERROR)
+    {
+      FD_CLR(pos->client_socket, &pos->daemon_ref->master_read_set);
+      FD_CLR(pos->client_socket, &pos->daemon_ref->master_write_set);
+    }
+
+    if ((is_deferring == AKWBS_YES) && (pos->is_waiting_result == AKWBS_NO))
+      akwbs_release_connection_file(pos);
+
+    if ((is_deferring == AKWBS_YES)
+        && ((pos->is_waiting_result == AKWBS_YES)
+            || (pos->opening.is_releasing == AKWBS_YES)
+            || (akwbs_opening_retry(pos) == AKWBS_YES)))
+    {
+      pos->client_socket = AKWBS_ERROR;
+      continue;
+    }
+
+    if (is_deferring == AKWBS_NO)
+      akwbs_opening_finish(pos);
+
     ring_buffer_free(&pos->buffer);
-    free(pos->file_name);
 
     DLL_remove((*list_head), (*list_tail), pos);
-    FD_CLR(pos->client_socket, &pos->daemon_ref->master_read_set);
-    FD_CLR(pos->client_socket, &pos->daemon_ref->master_write_set);
     free(pos);
   }
 }
@@ -500,7 +655,8 @@ static void cleanup_connections_list(struct akwbs_connection **list_head,
 static void clean_active_connections_list(struct akwbs_daemon *daemon_p)
 {
   cleanup_connections_list(&daemon_p->active_connections_head,
-                           &daemon_p->active_connections_tail);
+                           &daemon_p->active_connections_tail,
+                           AKWBS_NO);
 }
 
 
@@ -512,7 +668,8 @@ static void clean_active_connections_list(struct akwbs_daemon *daemon_p)
 void akwbs_clean_cleanup_connections_list(struct akwbs_daemon *daemon_p)
 {
   cleanup_connections_list(&daemon_p->cleanup_connections_head,
-                           &daemon_p->cleanup_connections_tail);
+                           &daemon_p->cleanup_connections_tail,
+                           AKWBS_YES);
 
   update_max_fds(daemon_p);
 }
@@ -525,8 +682,10 @@ void akwbs_clean_cleanup_connections_list(struct akwbs_daemon *daemon_p)
  */
 void akwbs_cleanup_connections(struct akwbs_daemon *daemon_p)
 {
-  if (daemon_p->cleanup_connections_head != NULL)
-    akwbs_clean_cleanup_connections_list(daemon_p);
+  /* The working threads are stopped: no read is in flight anymore. */
+  cleanup_connections_list(&daemon_p->cleanup_connections_head,
+                           &daemon_p->cleanup_connections_tail,
+                           AKWBS_NO);
 
   if (daemon_p->active_connections_head != NULL)
     clean_active_connections_list(daemon_p);
@@ -564,6 +723,25 @@ static int handle_connections(struct akwbs_daemon *daemon_p)
 }
 
 
+/*!
+ * Refresh the cached Date of the responses. The date has a resolution of one second, so
+ * it is formatted at most once per second, whatever the number of responses.
+ *
+ * \param daemon_p pointer to the daemon structure.
+ */
+static void update_http_date(struct akwbs_daemon *daemon_p)
+{
+  time_t now = time(NULL);
+
+
+  if (now == daemon_p->http_date_time)
+    return;
+
+  daemon_p->http_date_time = now;
+  akwbs_http_format_date(now, daemon_p->http_date);
+}
+
+
 /*!
  * Main routine performed by the server's daemon.
  *
@@ -590,6 +768,8 @@ static int daemon_routine(struct akwbs_daemon *daemon_p)
       return AKWBS_ERROR;
     }
 
+    update_http_date(daemon_p);
+
     if (handle_incoming_connections(daemon_p) == AKWBS_ERROR)
       return AKWBS_ERROR;
 
@@ -617,7 +797,6 @@ static int setup_daemon(struct akwbs_daemon *daemon_p,
 {
   int ret_setsock_opt = -1;
   int opt_reuse       = AKWBS_YES;
-  int i;
 
 
   if ((daemon_p == NULL) || (serv_conf_p == NULL))
@@ -626,19 +805,39 @@ static int setup_daemon(struct akwbs_daemon *daemon_p,
   if (setup_signal_handlers() == AKWBS_ERROR)
     return AKWBS_ERROR;
 
-  if(pthread_mutex_init(&daemon_p->request_io_queue_mutex, NULL) == AKWBS_ERROR)
-    return AKWBS_ERROR;
-
-  if (pthread_cond_init(&daemon_p->request_io_queue_cond, NULL) == AKWBS_ERROR)
-    return AKWBS_ERROR;
-
   daemon_p->tree_opened_files = NULL;
+  daemon_p->http_date_time    = 0;
+
+  update_http_date(daemon_p);
+
+  daemon_p->root_path        = strdup(serv_conf_p->root_path);
+  daemon_p->send_rate        = serv_conf_p->send_rate;
+  daemon_p->port             = serv_conf_p->port;
+  daemon_p->durability       = serv_conf_p->durability;
+  daemon_p->commit_window_us = serv_conf_p->commit_window_us;
+  daemon_p->writeback_window = serv_conf_p->writeback_window;
+  daemon_p->dirty_budget     = serv_conf_p->dirty_budget;
+  daemon_p->max_upload_size  = serv_conf_p->max_upload_size;
+  daemon_p->io_threads       = serv_conf_p->io_threads;
+  daemon_p->io_threads_max   = MAX(serv_conf_p->io_threads_max, serv_conf_p->io_threads);
+  daemon_p->latency_bytes    = serv_conf_p->latency_bytes;
+  daemon_p->latency_reserve  = serv_conf_p->latency_reserve;
+  daemon_p->read_depth       = serv_conf_p->read_depth;
+  daemon_p->inline_io        = serv_conf_p->inline_io;
+  daemon_p->direct_io_size   = serv_conf_p->direct_io_size;
+  daemon_p->readahead_max    = serv_conf_p->readahead_max;
+  daemon_p->drop_behind_size = serv_conf_p->drop_behind_size;
+
+  if (serv_conf_p->metrics_file != NULL)
+    daemon_p->metrics_file = strdup(serv_conf_p->metrics_file);
+
+  if (serv_conf_p->direct_io_paths != NULL)
+    daemon_p->direct_io_paths = strdup(serv_conf_p->direct_io_paths);
+
+  if (pthread_mutex_init(&daemon_p->commit_mutex, NULL) == AKWBS_ERROR)
+    return AKWBS_ERROR;
 
-  daemon_p->root_path = strdup(serv_conf_p->root_path);
-  daemon_p->send_rate = serv_conf_p->send_rate;
-  daemon_p->port      = serv_conf_p->port;
-
-  if (akwbs_request_io_create_queue() == AKWBS_ERROR)
+  if (pthread_cond_init(&daemon_p->commit_cond, NULL) == AKWBS_ERROR)
     return AKWBS_ERROR;
 
   daemon_p->listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -665,24 +864,21 @@ static int setup_daemon(struct akwbs_daemon *daemon_p,
            (socklen_t)sizeof(daemon_p->serv_addr)) == AKWBS_ERROR)
     return AKWBS_ERROR;
 
-  if (akwbs_request_io_open_for_read(&daemon_p->request_io_queue[AKWBS_READ_INDEX])
-      == AKWBS_ERROR)
+  if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, daemon_p->result_io_queue) == AKWBS_ERROR)
     return AKWBS_ERROR;
 
-  if (akwbs_request_io_open_for_write(&daemon_p->request_io_queue[AKWBS_WRITE_INDEX])
-      == AKWBS_ERROR)
+  if (akwbs_pool_create(daemon_p, serv_conf_p) == AKWBS_ERROR)
     return AKWBS_ERROR;
 
-  if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, daemon_p->result_io_queue) == AKWBS_ERROR)
+  if ((daemon_p->durability == AKWBS_DURABILITY_GROUP)
+      && (pthread_create(&daemon_p->commit_thread,
+                         NULL,
+                         akwbs_commit_thread_routine,
+                         daemon_p) != AKWBS_SUCCESS))
     return AKWBS_ERROR;
 
-  for (i = 0; i < AKWBS_WORKING_THREADS; i++)
-    if (pthread_create(&daemon_p->thread_ids[i],
-                   NULL,
-                   akwbs_thread_io_routine,
-                   daemon_p)
-        != AKWBS_SUCCESS)
-      return AKWBS_ERROR;
+  if (akwbs_pool_pin_loop(serv_conf_p) == AKWBS_ERROR)
+    return AKWBS_ERROR;
 
   if (listen(daemon_p->listen_fd, SOMAXCONN) == AKWBS_ERROR)
     return AKWBS_ERROR;
@@ -705,63 +901,55 @@ static int setup_daemon(struct akwbs_daemon *daemon_p,
  */
 static void shutdown_daemon(struct akwbs_daemon *daemon_p)
 {
-  int i;
   void *res = NULL;
 
 
   close(daemon_p->listen_fd);
   free(daemon_p->root_path);
 
-  for (i = 0; i < AKWBS_WORKING_THREADS; i++)
+  akwbs_pool_destroy(daemon_p);
+  free(daemon_p->metrics_file);
+  free(daemon_p->direct_io_paths);
+
+  if (daemon_p->durability == AKWBS_DURABILITY_GROUP)
   {
-    pthread_cancel(daemon_p->thread_ids[i]);
-    pthread_join(daemon_p->thread_ids[i], &res);
+    pthread_cancel(daemon_p->commit_thread);
+    pthread_join(daemon_p->commit_thread, &res);
   }
 
-  close(daemon_p->request_io_queue[AKWBS_READ_INDEX]);
-  close(daemon_p->request_io_queue[AKWBS_WRITE_INDEX]);
-  unlink(AKWBS_REQUEST_IO_FIFO_PATH);
+  pthread_mutex_destroy(&daemon_p->commit_mutex);
+  pthread_cond_destroy(&daemon_p->commit_cond);
 
   close(daemon_p->result_io_queue[AKWBS_READ_INDEX]);
   close(daemon_p->result_io_queue[AKWBS_WRITE_INDEX]);
 
-  pthread_mutex_destroy(&daemon_p->request_io_queue_mutex);
-  pthread_cond_destroy(&daemon_p->request_io_queue_cond);
-
   akwbs_cleanup_connections(daemon_p);
 
   tdestroy(daemon_p->tree_opened_files, free);
+  akwbs_compress_destroy(daemon_p);
 }
 
 
 /*!
  * Start server's daemon.
  *
- * \param port port to bind to.
- * \param root_path root path for this daemon.
- * \param rate_send the rate of transmission.
+ * \param conf server's configuration.
  *
  * \return AKWBS_SUCCESS on success.
  *         AKWBS_ERROR on error.
  */
-int akwbs_start_daemon(uint16_t port, char *root_path, unsigned long send_rate)
+int akwbs_start_daemon(struct akwbs_server_conf *conf)
 {
   struct akwbs_daemon daemon_s;
-  struct akwbs_server_conf conf;
   int ret = AKWBS_ERROR;
 
 
-  //if (daemonize(root_path) == AKWBS_ERROR)
+  //if (daemonize(conf->root_path) == AKWBS_ERROR)
   //  return AKWBS_ERROR;
 
   bzero(&daemon_s, sizeof(struct akwbs_daemon));
 
-  conf.port = port;
-  conf.root_path = root_path;
-  conf.send_rate = send_rate;
-
-
-  if (setup_daemon(&daemon_s, &conf) == AKWBS_ERROR)
+  if (setup_daemon(&daemon_s, conf) == AKWBS_ERROR)
     ret = AKWBS_ERROR;
   else if (daemon_routine(&daemon_s) == AKWBS_SUCCESS)
     ret = AKWBS_SUCCESS;
@@ -12,9 +12,10 @@
 #include <netinet/in.h>
 
 #include "io.h"
-
-
-#define AKWBS_WORKING_THREADS 10  /*!< Number of working threads.                        */
+#include "internal.h"
+#include "commit.h"
+#include "writeback.h"
+#include "pool.h"
 
 
 /*!
@@ -41,13 +42,46 @@ struct akwbs_daemon
 
   int has_new_conf;             /*!< New server's configuration has been set.           */
 
-  int request_io_queue[2];      /*!< Queue of I/O requests.                             */
+  struct akwbs_io_pool
+    *io_pools;                  /*!< Working threads, one pool per device used.         */
+
+  unsigned int io_pools_count;  /*!< Number of pools of working threads.                */
+
+  struct akwbs_io_pool
+    *io_root_pool;              /*!< Pool of the device of root_path.                   */
+
+  struct akwbs_io_nodes
+    *io_nodes;                  /*!< NUMA nodes the working threads may run on.         */
+
+  unsigned long io_threads;     /*!< Fewest working threads of a device not configured. */
+
+  unsigned long io_threads_max; /*!< Most working threads of such a device.             */
+
+  unsigned long latency_bytes;  /*!< Transfers this short take the latency lane.        */
+
+  unsigned long
+    latency_reserve;            /*!< Percent of working threads kept for that lane.     */
+
+  unsigned long read_depth;     /*!< Reads of a download in flight at once.             */
+
+  int inline_io;                /*!< Cached I/O is tried by the event loop first.       */
+
+  unsigned long direct_io_size; /*!< Files this large are read directly, 0 for none.    */
+
+  char *direct_io_paths;        /*!< Paths read directly, as "/a,/b", or NULL.          */
+
+  unsigned long readahead_max;  /*!< Largest readahead of a download, 0 for none.       */
+
+  unsigned long
+    drop_behind_size;           /*!< Files this large are dropped behind, 0 never.      */
+
+  pthread_t scaler_thread;      /*!< Autoscaler of the working threads, if any.         */
+
+  int has_scaler;               /*!< Is the autoscaler running.                         */
 
-  pthread_mutex_t
-    request_io_queue_mutex;     /*!< Mutex variable for the request I/O queue.          */
+  char *metrics_file;           /*!< File the pool metrics are written to, or NULL.     */
 
-  pthread_cond_t
-    request_io_queue_cond;      /*!< Condition variable for the request I/O queue.      */
+  unsigned long io_assigned;    /*!< Connections tied to a group so far.                */
 
   int result_io_queue[2];       /*!< Queue of I/O results.                              */
 
@@ -71,16 +105,60 @@ struct akwbs_daemon
 
   unsigned long send_rate;      /*!< Send rate for out going transmissions.             */
 
-  pthread_t thread_ids
-    [AKWBS_WORKING_THREADS];    /*!< Array containing threads' IDs.                     */
+  int durability;               /*!< Durability of uploads, enum akwbs_durability.      */
+
+  unsigned long
+    commit_window_us;           /*!< Time gathering uploads into a group commit.        */
+
+  pthread_t commit_thread;      /*!< Group commit thread, with group durability only.   */
+
+  pthread_mutex_t commit_mutex; /*!< Mutex variable for the group commit queue.         */
+
+  pthread_cond_t commit_cond;   /*!< Condition variable for the group commit queue.     */
+
+  struct akwbs_commit_entry
+    commit_queue
+    [AKWBS_COMMIT_MAX_BATCH];   /*!< Uploads waiting for the next group commit.         */
+
+  unsigned int commit_count;    /*!< Number of uploads waiting for a group commit.      */
+
+  unsigned long
+    writeback_window;           /*!< Bytes of uploads flushed at once, 0 to disable.    */
+
+  unsigned long dirty_budget;   /*!< Dirty bytes of uploads per device, 0 for none.     */
+
+  unsigned long
+    max_upload_size;            /*!< Largest accepted upload body, 0 for no limit.      */
+
+  struct akwbs_writeback_device
+    writeback_devices
+    [AKWBS_WRITEBACK_MAX_DEVICES]; /*!< Dirty byte accounts of the devices.             */
+
+  unsigned int
+    writeback_devices_count;    /*!< Number of dirty byte accounts.                     */
 
   void *tree_opened_files;      /*!< Tree root of opened files.                         */
+
+  char http_date
+    [AKWBS_HTTP_DATE_SIZE];     /*!< Current date, as an HTTP-date.                     */
+
+  time_t http_date_time;        /*!< Current date, when http_date was formatted.        */
+
+  void *tree_compressed;        /*!< Tree root of compressed outputs.                   */
+
+  struct akwbs_compressed
+    *compressed_head;           /*!< Most recently used compressed output.              */
+
+  struct akwbs_compressed
+    *compressed_tail;           /*!< Least recently used compressed output.             */
+
+  size_t compressed_bytes;      /*!< Bytes held by the compressed outputs.              */
 };
 
 /*
  * Public Interface.
  */
-int akwbs_start_daemon(uint16_t port, char *root_path, unsigned long send_rate);
+int akwbs_start_daemon(struct akwbs_server_conf *conf);
 
 
 #endif  /* END OF daemon.h */
@@ -0,0 +1,144 @@
+/*!
+ * \file   direct.c
+ * \brief  Direct reads of downloads. A large one-shot download read through the page
+ *         cache evicts the files served over and over. The files over direct_io_size,
+ *         or under a prefix of direct_io_paths, are read with O_DIRECT instead, wherever
+ *         the file offset and the place in the ring buffer line up; the few bytes that
+ *         do not, at the start of a range, still go through the cache.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "direct.h"
+#include "connection.h"
+#include "daemon.h"
+#include "internal.h"
+
+
+/*!
+ * Check whether a requested path is under one of a list of prefixes.
+ *
+ * \param list prefixes, separated by commas, such as "/video,/backup".
+ * \param name requested path.
+ *
+ * \return AKWBS_YES if it is, AKWBS_NO otherwise.
+ */
+static int is_under_paths(const char *list, const char *name)
+{
+  const char *end = NULL;
+  size_t length   = 0;
+
+
+  while (*list != '\0')
+  {
+    end    = strchrnul(list, ',');
+    length = (size_t)(end - list);
+
+    if ((length > 0)
+        && (strncmp(name, list, length) == 0)
+        && ((name[length] == '\0') || (name[length] == '/') || (list[length - 1] == '/')))
+      return AKWBS_YES;
+
+    list = (*end == ',') ? end + 1 : end;
+  }
+
+  return AKWBS_NO;
+}
+
+
+/*!
+ * Decide whether a download is read directly, and if so open its direct descriptor.
+ * Called by working threads, once the file is opened; the event loop then shares the
+ * descriptor with the other downloads of the file read directly.
+ *
+ * \param connection connection sending a file.
+ *
+ * \details The descriptor is opened again through /proc, so it is the same file even if
+ *          its path was replaced meanwhile. Where the file system refuses O_DIRECT, the
+ *          download is read through the cache as usual.
+ */
+void akwbs_direct_open(struct akwbs_connection *connection)
+{
+  struct akwbs_daemon *daemon_p = connection->daemon_ref;
+  char path[64];
+
+
+  connection->direct_descriptor = AKWBS_ERROR;
+
+  if (((daemon_p->direct_io_size == 0)
+       || (connection->opening.stat_buf.st_size < (off_t)daemon_p->direct_io_size))
+      && ((daemon_p->direct_io_paths == NULL)
+          || (is_under_paths(daemon_p->direct_io_paths, connection->file_name) == AKWBS_NO)))
+    return;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", connection->file_descriptor);
+  connection->direct_descriptor = open(path, O_RDONLY | O_DIRECT);
+}
+
+
+/*!
+ * Plan a read of a download read directly. Where the file offset and the buffer address
+ * are both aligned, the read is direct, asking for whole aligned blocks; it may run past
+ * the bytes wanted at the end of a range, into free room of the buffer, and only the
+ * wanted ones are kept. Where they are not, the read goes through the cache, and stops
+ * at the next aligned offset if that lines both up.
+ *
+ * \param connection connection sending a file, with a direct descriptor.
+ * \param offset offset of the read in the file.
+ * \param address where the read lands in the buffer.
+ * \param room free bytes of the buffer from address on, for this read.
+ * \param bytes param-return bytes of the file wanted, at most room; fewer once planned,
+ *        if the read has to stop at an aligned offset.
+ * \param io_bytes return-param bytes to ask for.
+ *
+ * \return the descriptor to read from.
+ */
+int akwbs_direct_plan(struct akwbs_connection *connection,
+                      off_t offset,
+                      void *address,
+                      size_t room,
+                      size_t *bytes,
+                      size_t *io_bytes)
+{
+  size_t misalignment = (size_t)(offset % AKWBS_DIRECT_ALIGN);
+
+
+  *io_bytes = *bytes;
+
+  if (misalignment != (uintptr_t)address % AKWBS_DIRECT_ALIGN)
+    return connection->file_descriptor;
+
+  if (misalignment != 0)
+  {
+    *bytes    = MIN(*bytes, AKWBS_DIRECT_ALIGN - misalignment);
+    *io_bytes = *bytes;
+
+    return connection->file_descriptor;
+  }
+
+  *io_bytes = roundup(*bytes, AKWBS_DIRECT_ALIGN);
+
+  if (*io_bytes <= room)
+    return connection->direct_descriptor;
+
+  /* Not even a block of room: the few bytes wanted go through the cache. */
+  if (room < AKWBS_DIRECT_ALIGN)
+  {
+    *io_bytes = *bytes;
+
+    return connection->file_descriptor;
+  }
+
+  *io_bytes = room - room % AKWBS_DIRECT_ALIGN;
+  *bytes    = MIN(*bytes, *io_bytes);
+
+  return connection->direct_descriptor;
+}
@@ -0,0 +1,32 @@
+/*!
+ * \file   direct.h
+ * \brief  Direct reads of large or configured downloads, bypassing the page cache.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_DIRECT_H_
+#define _AKWBS_MT_DIRECT_H_
+
+#include <sys/types.h>
+
+
+#define AKWBS_DIRECT_ALIGN 4096 /*!< Alignment of the offsets, sizes and buffers of
+                                 *   direct reads, enough for any common device.
+                                 */
+
+
+struct akwbs_connection;
+
+
+/*
+ * Public Interface.
+ */
+void akwbs_direct_open(struct akwbs_connection *connection);
+int akwbs_direct_plan(struct akwbs_connection *connection,
+                      off_t offset,
+                      void *address,
+                      size_t room,
+                      size_t *bytes,
+                      size_t *io_bytes);
+
+#endif /* END OF direct.h */
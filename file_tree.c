@@ -1,22 +1,91 @@
 /*!
  * \file file_tree.c
- * \brief Function that implements a comparison to walkthrough the tree of opened files.
+ * \brief Functions that walk through and maintain the tree of opened files.
  * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <search.h>
+#include <time.h>
 
 #include "file_tree.h"
+#include "http.h"
 
 
+/*!
+ * Order of the opened files in their tree: by device, then by inode number, as root_path
+ * may span several file systems.
+ *
+ * \param pa an opened file.
+ * \param pb another opened file.
+ *
+ * \return less than, equal to or greater than 0, as pa is before, the same as or after pb.
+ */
 int akwbs_compare_file_stat(const void *pa, const void *pb)
 {
-  if (* (ino_t *) pa < *(ino_t *) pb)
-    return -1;
+  const struct akwbs_file_stat *a = pa;
+  const struct akwbs_file_stat *b = pb;
+
 
-  if (* (ino_t *) pa > *(ino_t *) pb)
-    return 1;
+  if (a->device != b->device)
+    return (a->device < b->device) ? -1 : 1;
+
+  if (a->inode_number != b->inode_number)
+    return (a->inode_number < b->inode_number) ? -1 : 1;
 
   return 0;
 }
+
+
+/*!
+ * Update the cached status of an opened file. The validators and the header lines sent
+ * with every response are only formatted again when the file has changed since they
+ * were built. Responses copy the header lines, so they are rebuilt in place.
+ *
+ * \param file_stat the opened file.
+ * \param stat_buf fresh status of the file.
+ */
+void akwbs_update_file_stat(struct akwbs_file_stat *file_stat, const struct stat *stat_buf)
+{
+  int length = 0;
+
+
+  if ((file_stat->etag[0] != '\0')
+      && (file_stat->size == stat_buf->st_size)
+      && (file_stat->mtime == stat_buf->st_mtim.tv_sec)
+      && (file_stat->mtime_nsec == stat_buf->st_mtim.tv_nsec))
+    return;
+
+  file_stat->size       = stat_buf->st_size;
+  file_stat->mtime      = stat_buf->st_mtim.tv_sec;
+  file_stat->mtime_nsec = stat_buf->st_mtim.tv_nsec;
+
+  snprintf(file_stat->etag,
+           sizeof(file_stat->etag),
+           "\"%llx-%lx-%llx-%llx\"",
+           (unsigned long long)stat_buf->st_dev,
+           (unsigned long)stat_buf->st_ino,
+           (unsigned long long)stat_buf->st_size,
+           (unsigned long long)stat_buf->st_mtim.tv_sec * 1000000000ULL
+           + (unsigned long long)stat_buf->st_mtim.tv_nsec);
+
+  akwbs_http_format_date(file_stat->mtime, file_stat->last_modified);
+
+  length = snprintf(file_stat->headers,
+                    sizeof(file_stat->headers),
+                    "Content-Length: %lld\r\n",
+                    (long long)file_stat->size);
+
+  file_stat->validators_offset = (size_t)length;
+
+  length += snprintf(file_stat->headers + length,
+                     sizeof(file_stat->headers) - length,
+                     "ETag: %s\r\n"
+                     "Last-Modified: %s\r\n"
+                     "Accept-Ranges: bytes\r\n",
+                     file_stat->etag,
+                     file_stat->last_modified);
+
+  file_stat->headers_length = (size_t)length;
+}
@@ -5,18 +5,38 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "internal.h"
+
+
+#define AKWBS_ETAG_SIZE          72   /*!< Room for an entity tag, with its quotes.     */
+
+#define AKWBS_FILE_HEADERS_SIZE  192  /*!< Room for the cached header lines of a file.  */
+
 /*!
  * Structure representing opened files.
  */
 struct akwbs_file_stat
 {
   ino_t inode_number;        /*!< Inode number of this opened file.                     */
+  dev_t device;              /*!< Device holding this opened file.                      */
   int file_descriptor;       /*!< File descriptor of this opened file.                  */
+  int direct_descriptor;     /*!< Opened for direct reads as well, or -1.               */
   unsigned int number_of_references;  /*!< Number of connections using this descriptor.          */
+  off_t size;                /*!< Size of the file when it was last looked up.          */
+  time_t mtime;              /*!< Last modification time of the file.                   */
+  long mtime_nsec;           /*!< Nanoseconds of the last modification time.            */
+  char etag[AKWBS_ETAG_SIZE];                /*!< Entity tag of the current contents.   */
+  char last_modified[AKWBS_HTTP_DATE_SIZE];  /*!< mtime, as an HTTP-date.               */
+  char headers[AKWBS_FILE_HEADERS_SIZE];     /*!< Content-Length and validator lines.   */
+  size_t headers_length;                     /*!< Length of the cached header lines.    */
+  size_t validators_offset;                  /*!< Offset of the validator lines, past
+                                              *   Content-Length.
+                                              */
 };
 
 /* PROTOTYPES */
 int akwbs_compare_file_stat(const void *pa, const void *pb);
+void akwbs_update_file_stat(struct akwbs_file_stat *file_stat, const struct stat *stat_buf);
 
 
 #endif /* END OF FILE_TREE.H */
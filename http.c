@@ -6,21 +6,341 @@
 //  Copyright (c) 2013 Henrique Nascimento Gouveia. All rights reserved.
 //
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 
 #include "connection.h"
 #include "internal.h"
 #include "http.h"
+#include "mime.h"
+
+
+#define AKWBS_HTTP_HEADER_HASH_SIZE 32 /*!< Slots in the known header table, a power of
+                                        *   two.
+                                        */
+
+
+#define AKWBS_HTTP_PART_HEAD_FORMAT \
+  "\r\n--%s\r\n%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n" /*!< Head of a body part. */
+
+#define AKWBS_HTTP_LAST_BOUNDARY_FORMAT \
+  "\r\n--%s--\r\n"                                /*!< Close a multipart body.      */
+
+
+/*!
+ * Slot of the perfect hash table holding the known header fields.
+ */
+struct akwbs_known_header
+{
+  const char                *name;   /*!< Lower case field name, NULL for empty slots.  */
+  size_t                    length;  /*!< Length of the field name.                     */
+  enum akwbs_http_header_id id;      /*!< Identifier of the field.                      */
+};
+
+
+/*!
+ * Perfect hash table of known header fields. The slot of each name is given by
+ * hash_header_name(), and no two known names share a slot. Whenever a field is added,
+ * the multipliers in hash_header_name() must be chosen again so this still holds.
+ */
+static const struct akwbs_known_header known_headers[AKWBS_HTTP_HEADER_HASH_SIZE] =
+{
+  [0]  = { "transfer-encoding",   17, AKWBS_HTTP_HEADER_TRANSFER_ENCODING   },
+  [3]  = { "if-modified-since",   17, AKWBS_HTTP_HEADER_IF_MODIFIED_SINCE   },
+  [4]  = { "content-type",        12, AKWBS_HTTP_HEADER_CONTENT_TYPE        },
+  [5]  = { "content-range",       13, AKWBS_HTTP_HEADER_CONTENT_RANGE       },
+  [7]  = { "connection",          10, AKWBS_HTTP_HEADER_CONNECTION          },
+  [11] = { "accept-encoding",     15, AKWBS_HTTP_HEADER_ACCEPT_ENCODING     },
+  [12] = { "host",                 4, AKWBS_HTTP_HEADER_HOST                },
+  [13] = { "content-length",      14, AKWBS_HTTP_HEADER_CONTENT_LENGTH      },
+  [14] = { "content-encoding",    16, AKWBS_HTTP_HEADER_CONTENT_ENCODING    },
+  [15] = { "accept",               6, AKWBS_HTTP_HEADER_ACCEPT              },
+  [18] = { "if-none-match",       13, AKWBS_HTTP_HEADER_IF_NONE_MATCH       },
+  [19] = { "expect",               6, AKWBS_HTTP_HEADER_EXPECT              },
+  [20] = { "range",                5, AKWBS_HTTP_HEADER_RANGE               },
+  [21] = { "destination",         11, AKWBS_HTTP_HEADER_DESTINATION         },
+  [23] = { "user-agent",          10, AKWBS_HTTP_HEADER_USER_AGENT          },
+  [25] = { "if-unmodified-since", 19, AKWBS_HTTP_HEADER_IF_UNMODIFIED_SINCE },
+  [26] = { "if-range",             8, AKWBS_HTTP_HEADER_IF_RANGE            },
+  [29] = { "if-match",             8, AKWBS_HTTP_HEADER_IF_MATCH            }
+};
+
+
+/*!
+ * Hash a header field name, ignoring its case.
+ *
+ * \param name   first byte of the name.
+ * \param length length of the name, greater than zero.
+ *
+ * \return slot of the name in the known header table.
+ */
+static unsigned int hash_header_name(const char *name, size_t length)
+{
+  return (unsigned int)(length
+                        + tolower((unsigned char)name[0])
+                        + tolower((unsigned char)name[length - 1])
+                        + 4 * tolower((unsigned char)name[length / 2]))
+         & (AKWBS_HTTP_HEADER_HASH_SIZE - 1);
+}
+
+
+/*!
+ * Find the identifier of a header field name.
+ *
+ * \param name the field name.
+ *
+ * \return the identifier of the field, or AKWBS_HTTP_HEADER_COUNT if the field is not
+ *         known by the server.
+ */
+static enum akwbs_http_header_id lookup_header(const struct akwbs_http_slice *name)
+{
+  const struct akwbs_known_header *slot = NULL;
+
+
+  slot = &known_headers[hash_header_name(name->data, name->length)];
+
+  if ((slot->name == NULL)
+      || (slot->length != name->length)
+      || (strncasecmp(slot->name, name->data, name->length) != 0))
+    return AKWBS_HTTP_HEADER_COUNT;
+
+  return slot->id;
+}
+
+
+/*!
+ * Reply an error to the client and close its connection.
+ *
+ * \param connection connection to be closed.
+ * \param status HTTP status code of the reply.
+ *
+ * \return AKWBS_SUCCESS, the daemon keeps serving other connections.
+ */
+static int reply_and_close(struct akwbs_connection *connection, int status)
+{
+  int fd = connection->client_socket;
+
+
+  switch (status)
+  {
+    case 411:
+      send(fd, AKWBS_HTTP_411, AKWBS_STRLEN(AKWBS_HTTP_411), 0);
+      break;
+    case 413:
+      send(fd, AKWBS_HTTP_413, AKWBS_STRLEN(AKWBS_HTTP_413), 0);
+      break;
+    case 414:
+      send(fd, AKWBS_HTTP_414, AKWBS_STRLEN(AKWBS_HTTP_414), 0);
+      break;
+    case 417:
+      send(fd, AKWBS_HTTP_417, AKWBS_STRLEN(AKWBS_HTTP_417), 0);
+      break;
+    case 501:
+      send(fd, AKWBS_HTTP_501, AKWBS_STRLEN(AKWBS_HTTP_501), 0);
+      break;
+    case 505:
+      send(fd, AKWBS_HTTP_505, AKWBS_STRLEN(AKWBS_HTTP_505), 0);
+      break;
+    default:
+      send(fd, AKWBS_HTTP_400, AKWBS_STRLEN(AKWBS_HTTP_400), 0);
+  }
+
+  close(fd);
+  FD_CLR(fd, &connection->daemon_ref->master_read_set);
+  FD_CLR(fd, &connection->daemon_ref->master_write_set);
+  connection->connection_state = AKWBS_CONNECTION_CLOSED;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Get the value of an hexadecimal digit.
+ *
+ * \param c the digit.
+ *
+ * \return value of the digit, or AKWBS_ERROR if it is not an hexadecimal digit.
+ */
+static int hex_value(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+
+  return AKWBS_ERROR;
+}
+
+
+/*!
+ * Decode the percent-encoded octets of a path, in place.
+ *
+ * \param path param-return the path to be decoded, shrunk to its decoded length.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on a malformed escape or an escaped NUL.
+ */
+static int decode_path(struct akwbs_http_slice *path)
+{
+  char *read_position  = path->data;
+  char *write_position = path->data;
+  char *end            = path->data + path->length;
+
+
+  while (read_position < end)
+  {
+    if (*read_position != '%')
+    {
+      *write_position++ = *read_position++;
+      continue;
+    }
+
+    if ((end - read_position < 3)
+        || (hex_value(read_position[1]) == AKWBS_ERROR)
+        || (hex_value(read_position[2]) == AKWBS_ERROR))
+      return AKWBS_ERROR;
+
+    *write_position = (char)((hex_value(read_position[1]) << 4)
+                             | hex_value(read_position[2]));
+
+    if (*write_position == '\0')
+      return AKWBS_ERROR;
+
+    write_position++;
+    read_position += 3;
+  }
+
+  path->length = (size_t)(write_position - path->data);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Normalize a decoded path, in place. Repeated slashes are merged, "." segments are
+ * dropped and ".." segments remove the segment before them.
+ *
+ * \param path param-return the path to be normalized, starting with '/'.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the path escapes the root.
+ */
+static int normalize_path(struct akwbs_http_slice *path)
+{
+  char   *read_position  = path->data;
+  char   *write_position = path->data;
+  char   *end            = path->data + path->length;
+  char   *segment        = NULL;
+  size_t segment_length  = 0;
+  int    trailing_slash  = (path->length > 1) && (end[-1] == '/');
+
+
+  while (read_position < end)
+  {
+    while ((read_position < end) && (*read_position == '/'))
+      read_position++;
+
+    segment = read_position;
+
+    while ((read_position < end) && (*read_position != '/'))
+      read_position++;
+
+    segment_length = (size_t)(read_position - segment);
+
+    if ((segment_length == 0)
+        || ((segment_length == 1) && (segment[0] == '.')))
+      continue;
+
+    if ((segment_length == 2) && (segment[0] == '.') && (segment[1] == '.'))
+    {
+      if (write_position == path->data)
+        return AKWBS_ERROR;
+
+      while (*--write_position != '/')
+        ;
+      continue;
+    }
+
+    *write_position++ = '/';
+    memmove(write_position, segment, segment_length);
+    write_position += segment_length;
+  }
+
+  if ((write_position == path->data) || trailing_slash)
+    *write_position++ = '/';
+
+  path->length = (size_t)(write_position - path->data);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Split the request target into path and query, then decode and normalize the path.
+ *
+ * \param connection connection holding the parsed request line.
+ *
+ * \return AKWBS_SUCCESS on success, otherwise the HTTP status code to be replied.
+ */
+static int process_uri(struct akwbs_connection *connection)
+{
+  struct akwbs_http_request *request = &connection->request;
+  char   *raw_end                    = request->uri.data + request->uri.length;
+  char   *question_mark              = NULL;
+  size_t max_length                  = 0;
+
+
+  if ((request->uri.length == 0) || (request->uri.data[0] != '/'))
+    return 400;
+
+  question_mark = memchr(request->uri.data, '?', request->uri.length);
+
+  if (question_mark != NULL)
+  {
+    request->query.data   = question_mark + 1;
+    request->query.length = (size_t)(raw_end - request->query.data);
+    request->uri.length   = (size_t)(question_mark - request->uri.data);
+    *raw_end = '\0';
+  }
+
+  if (decode_path(&request->uri) == AKWBS_ERROR)
+    return 400;
+
+  if (normalize_path(&request->uri) == AKWBS_ERROR)
+    return 400;
+
+  max_length = PATH_MAX - strlen(connection->daemon_ref->root_path) - 1;
+
+  if (request->uri.length >= max_length)
+    return 414;
+
+  /* Decoding only shrinks the path, so there is always room for the terminator. */
+  request->uri.data[request->uri.length] = '\0';
+
+  return AKWBS_SUCCESS;
+}
 
 
 /*!
  * Parse the first line of the HTTP HEADER.
  *
  * \example Example of a simple HTTP request: "METHOD SP URI SP VERSION CRLFCRLF".<p>
- *          METHOD  = GET | PUT                      <p>
+ *          METHOD  = GET | HEAD | PUT               <p>
  *          SP      = whitespace ' '                 <p>
  *          URI     = absolute path to file.         <p>
  *          VERSION = HTTP/1.0                       <p>
@@ -28,177 +348,1442 @@
  *          LF      = '\n'                           <p>
  *
  * \param connection the connection (updated)
- * \param line the first line
+ * \param position param-return beginning of the line, set to the beginning of the next
+ *        line afterwards.
  *
- * \return AKWBS_REACHED_HEADER_END if we have reached the header's end
- *         AKWBS_ERROR if the header is malformed.
+ * \return AKWBS_SUCCESS on success, otherwise the HTTP status code to be replied.
  */
-static int parse_initial_message_line(struct akwbs_connection *connection)
+static int parse_initial_message_line(struct akwbs_connection *connection,
+                                      char **position)
 {
-  char *uri                      = NULL;
-  char *line                     = NULL;
-  char *first_space_after_uri    = NULL;
-  char *first_space_after_method = NULL;
+  struct akwbs_http_request *request = &connection->request;
+  char *cursor                       = *position;
 
 
-  *(connection->end_of_first_header_line -= 1) = '\0';
+  request->method.data = cursor;
 
-  line = ring_buffer_read_address(&connection->buffer);
+  while ((*cursor >= 'A') && (*cursor <= 'Z'))
+    cursor++;
 
-  if (! isspace(*(line + STRLEN_ANY_ACCEPTED_METHOD)))
-    return AKWBS_ERROR;
+  request->method.length = (size_t)(cursor - request->method.data);
+
+  if ((request->method.length == 0) || (*cursor++ != ' '))
+    return 400;
+
+  request->uri.data = cursor;
+
+  while ((*cursor != ' ') && (*cursor != '\r'))
+  {
+    if (iscntrl((unsigned char)*cursor))
+      return 400;
+    cursor++;
+  }
+
+  request->uri.length = (size_t)(cursor - request->uri.data);
+
+  if (*cursor++ != ' ')
+    return 400;
 
-  first_space_after_method = line + STRLEN_ANY_ACCEPTED_METHOD;
+  request->version.data = cursor;
 
-  *first_space_after_method = '\0';
+  while (*cursor != '\r')
+    cursor++;
 
+  request->version.length = (size_t)(cursor - request->version.data);
 
-  if (strncmp(line, "GET", STRLEN_ANY_ACCEPTED_METHOD) == AKWBS_SUCCESS)
+  if (cursor[1] != '\n')
+    return 400;
+
+  *position = cursor + 2;
+
+  if ((request->version.length != strlen("HTTP/1.0"))
+      || (strncmp(request->version.data, "HTTP/1.", strlen("HTTP/1.")) != 0)
+      || ((request->version.data[7] != '0') && (request->version.data[7] != '1')))
+    return 505;
+
+  if ((request->method.length == 3) && (strncmp(request->method.data, "GET", 3) == 0))
+  {
+    request->method_id  = AKWBS_HTTP_METHOD_GET;
     connection->io_type = AKWBS_IO_GET_TYPE;
-  else if (strncmp(line, "PUT", STRLEN_ANY_ACCEPTED_METHOD) == AKWBS_SUCCESS)
+  }
+  else if ((request->method.length == 4) && (strncmp(request->method.data, "HEAD", 4) == 0))
+  {
+    request->method_id  = AKWBS_HTTP_METHOD_HEAD;
+    connection->io_type = AKWBS_IO_GET_TYPE;
+  }
+  else if ((request->method.length == 3) && (strncmp(request->method.data, "PUT", 3) == 0))
+  {
+    request->method_id  = AKWBS_HTTP_METHOD_PUT;
+    connection->io_type = AKWBS_IO_PUT_TYPE;
+  }
+  else if ((request->method.length == 4) && (strncmp(request->method.data, "COPY", 4) == 0))
+  {
+    request->method_id  = AKWBS_HTTP_METHOD_COPY;
     connection->io_type = AKWBS_IO_PUT_TYPE;
+  }
   else
   {
+    request->method_id  = AKWBS_HTTP_METHOD_UNKNOWN;
     connection->io_type = AKWBS_IO_UNKNOWN_TYPE;
-    goto free_and_fail;
+    return 400;
   }
 
-  if (*(++first_space_after_method) != '/')
-    goto free_and_fail;
+  return process_uri(connection);
+}
+
+
+/*!
+ * Parse the header fields, building the index of the request.
+ *
+ * \param connection connection holding the request header.
+ * \param position beginning of the first header field.
+ *
+ * \return AKWBS_SUCCESS on success, otherwise the HTTP status code to be replied.
+ *
+ * \details The header ends with an empty line, already found by the connection, so
+ *          every line here is known to end with CRLF.
+ */
+static int parse_header_fields(struct akwbs_connection *connection, char *position)
+{
+  struct akwbs_http_request *request = &connection->request;
+  struct akwbs_http_field   *field   = NULL;
+  enum akwbs_http_header_id id;
+  char *value_end                    = NULL;
+
+
+  while (*position != '\r')
+  {
+    if (request->fields_count == AKWBS_HTTP_MAX_FIELDS)
+      return 400;
+
+    field = &request->fields[request->fields_count];
+
+    field->name.data = position;
+
+    while ((*position != ':') && (*position > ' ') && (*position != 0x7f))
+      position++;
+
+    field->name.length = (size_t)(position - field->name.data);
+
+    if ((field->name.length == 0) || (*position++ != ':'))
+      return 400;
+
+    while ((*position == ' ') || (*position == '\t'))
+      position++;
+
+    field->value.data = position;
 
-  first_space_after_uri = first_space_after_method;
+    while (*position != '\r')
+      position++;
 
-  while (*first_space_after_uri != ' ')
-    first_space_after_uri++;
+    value_end = position;
 
-  *first_space_after_uri = '\0';
+    while ((value_end > field->value.data)
+           && ((value_end[-1] == ' ') || (value_end[-1] == '\t')))
+      value_end--;
 
-  uri = strdup(first_space_after_method);
+    field->value.length = (size_t)(value_end - field->value.data);
 
-  if (uri == NULL)
-    goto free_and_fail;
+    if (position[1] != '\n')
+      return 400;
 
-  connection->file_name = uri;
+    position += 2;
+    request->fields_count++;
+
+    id = lookup_header(&field->name);
+
+    if (id == AKWBS_HTTP_HEADER_COUNT)
+      continue;
+
+    if (request->known[id] == NULL)
+      request->known[id] = field;
+    else if ((id == AKWBS_HTTP_HEADER_CONTENT_LENGTH)
+             && ((request->known[id]->value.length != field->value.length)
+                 || (memcmp(request->known[id]->value.data,
+                            field->value.data,
+                            field->value.length) != 0)))
+      return 400;
+  }
 
   return AKWBS_SUCCESS;
+}
 
-free_and_fail:
-  free(uri);
-  return AKWBS_ERROR;
+
+/*!
+ * Parse a non-negative decimal number.
+ *
+ * \param cursor param-return position of the first digit, set past the last digit.
+ * \param end end of the text.
+ * \param value param-return parsed number.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if there are no digits or the number overflows.
+ */
+static int parse_offset(char **cursor, char *end, off_t *value)
+{
+  char *position = *cursor;
+
+
+  *value = 0;
+
+  while ((position < end) && isdigit((unsigned char)*position))
+  {
+    if (*value > (INT64_MAX - (*position - '0')) / 10)
+      return AKWBS_ERROR;
+
+    *value = *value * 10 + (*position - '0');
+    position++;
+  }
+
+  if (position == *cursor)
+    return AKWBS_ERROR;
+
+  *cursor = position;
+
+  return AKWBS_SUCCESS;
 }
 
 
 /*!
  * Get the content length of a PUT request header.
  *
- * \param connection connection holding the requested header in buffer.
+ * \param connection connection holding the index of the requested header.
  *
- * \return AKWBS_SUCCESS on success getting the content length value.
- *         AKWBS_ERRROR on error while trying to get the content length off the requested
- *         header.
+ * \return AKWBS_SUCCESS on success getting the content length value, otherwise the HTTP
+ *         status code to be replied.
  */
 static int get_content_length(struct akwbs_connection *connection)
 {
-  int i = 0;
-  size_t bytes_in_buffer = ring_buffer_count_bytes(&connection->buffer);
-  char *content_length = NULL;
+  struct akwbs_http_slice *value = NULL;
+  off_t length                   = 0;
+  size_t i;
 
-  char *read_address = ring_buffer_read_address(&connection->buffer);
 
-  while (content_length == NULL)
-  {
-    for (; i <= bytes_in_buffer; read_address++, i++)
-      if (*read_address == ':')
-      {
-        *read_address = '\0';
-        break;
-      }
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_CONTENT_LENGTH);
 
-    content_length = strstr(ring_buffer_read_address(&connection->buffer) + i
-                             - strlen("Content-Length"),
-                             "Content-Length");
-    if (content_length == NULL)
-      continue;
-    else
-    {
-      char *begining_number_content_length = ++read_address;
+  if (value == NULL)
+    return 411;
 
-      while (connection->file_total_offset == 0)
-      {
-        unsigned long j = bytes_in_buffer;
+  if (value->length == 0)
+    return 400;
 
-        for (; j <= bytes_in_buffer; read_address++, j++)
-          if (*read_address == '\r')
-          {
-            *read_address = '\0';
-            connection->file_total_offset = atol(++begining_number_content_length);
-            return AKWBS_SUCCESS;
-          }
+  for (i = 0; i < value->length; i++)
+  {
+    if (! isdigit((unsigned char)value->data[i]))
+      return 400;
 
-        if (j == bytes_in_buffer)
-          return AKWBS_ERROR;
-      }
-    }
+    if (length > (INT64_MAX - (value->data[i] - '0')) / 10)
+      return 413;
+
+    length = length * 10 + (value->data[i] - '0');
   }
 
-  if ((i == bytes_in_buffer)
-      && (content_length == NULL))
-    return AKWBS_ERROR;
+  if ((connection->daemon_ref->max_upload_size != 0)
+      && ((unsigned long)length > connection->daemon_ref->max_upload_size))
+    return 413;
+
+  connection->file_total_offset = length;
 
   return AKWBS_SUCCESS;
 }
 
 
 /*!
- * Do header processing to collect requested informations.
+ * Get the transfer coding of a request body. Only chunked is supported; when present,
+ * it overrides Content-Length and the body length is only known once decoded.
  *
- * \param connection connection containing the header.
- * \param daemon_p pointer to the daemon structure containing all file descriptors sets.
+ * \param connection connection holding the request.
  *
- * \return AKWBS_SUCCESS on success.
- *         AKWBS_ERROR on error.
+ * \return AKWBS_SUCCESS on success, or the HTTP status code to reply.
  */
-static int do_processing(struct akwbs_connection *connection)
+static int get_transfer_coding(struct akwbs_connection *connection)
 {
-  size_t end_of_header = 0;
+  struct akwbs_http_slice *value = NULL;
 
 
-  if (parse_initial_message_line(connection) == AKWBS_ERROR)
-    return AKWBS_ERROR;
-
-  if (connection->io_type == AKWBS_IO_PUT_TYPE)
-    if (get_content_length(connection) == AKWBS_ERROR)
-      return AKWBS_ERROR;
+  connection->is_chunked = AKWBS_NO;
 
-  end_of_header = (size_t)((connection->end_of_header)
-                           - (char *)ring_buffer_read_address(&connection->buffer));
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_TRANSFER_ENCODING);
 
-  ring_buffer_read_advance(&connection->buffer, end_of_header);
+  if (value == NULL)
+    return AKWBS_SUCCESS;
 
-  switch (connection->io_type)
-  {
-    case AKWBS_IO_GET_TYPE:
-      FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
-      FD_SET(connection->client_socket, &connection->daemon_ref->master_write_set);
-      break;
-    case AKWBS_IO_PUT_TYPE:
-      FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
-      FD_SET(connection->client_socket, &connection->daemon_ref->master_read_set);
-      break;
-    default:
-      close(connection->client_socket);
-      connection->connection_state = AKWBS_CONNECTION_CLOSED;
-      return AKWBS_ERROR;
-  }
+  if ((value->length != AKWBS_STRLEN("chunked"))
+      || (strncasecmp(value->data, "chunked", value->length) != 0))
+    return 501;
 
-  connection->connection_state = AKWBS_CONNECTION_HEADERS_PROCESSED;
+  connection->is_chunked        = AKWBS_YES;
+  connection->chunk_state       = AKWBS_HTTP_CHUNK_SIZE_START;
+  connection->chunk_end_offset  = 0;
+  connection->file_total_offset = INT64_MAX;
 
   return AKWBS_SUCCESS;
 }
 
-int akwbs_process_header(struct akwbs_connection *connection)
-{
-  if (do_processing(connection) == AKWBS_ERROR)
-    return AKWBS_ERROR;
+
+/*!
+ * Get the range of a PUT request. A ranged PUT writes its body at the given offset of
+ * the file, to resume an interrupted upload or to append to a file: "bytes
+ * first-last/total", the total being "*" when unknown. An asterisk in place of
+ * first-last, with an empty body, asks how many bytes the server holds.
+ *
+ * \param connection connection holding the request, its body length already known.
+ *
+ * \return AKWBS_SUCCESS on success, or the HTTP status code to reply.
+ */
+static int get_content_range(struct akwbs_connection *connection)
+{
+  struct akwbs_upload *upload    = &connection->upload;
+  struct akwbs_http_slice *value = NULL;
+  char *cursor = NULL;
+  char *end    = NULL;
+  off_t first  = 0;
+  off_t last   = 0;
+
+
+  upload->is_ranged  = AKWBS_NO;
+  upload->is_query   = AKWBS_NO;
+  upload->total_size = AKWBS_ERROR;
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_CONTENT_RANGE);
+
+  if (value == NULL)
+    return AKWBS_SUCCESS;
+
+  if (connection->is_chunked == AKWBS_YES)
+    return 400;
+
+  cursor = value->data;
+  end    = value->data + value->length;
+
+  if (((size_t)(end - cursor) <= AKWBS_STRLEN("bytes "))
+      || (strncasecmp(cursor, "bytes ", AKWBS_STRLEN("bytes ")) != 0))
+    return 400;
+
+  cursor += AKWBS_STRLEN("bytes ");
+
+  if (*cursor == '*')
+  {
+    if (connection->file_total_offset != 0)
+      return 400;
+
+    upload->is_query = AKWBS_YES;
+    cursor++;
+  }
+  else
+  {
+    if ((parse_offset(&cursor, end, &first) == AKWBS_ERROR)
+        || (cursor == end)
+        || (*cursor++ != '-')
+        || (parse_offset(&cursor, end, &last) == AKWBS_ERROR)
+        || (last < first)
+        || (last - first + 1 != connection->file_total_offset))
+      return 400;
+  }
+
+  if ((cursor == end) || (*cursor++ != '/'))
+    return 400;
+
+  if ((cursor < end) && (*cursor == '*'))
+    cursor++;
+  else if ((parse_offset(&cursor, end, &upload->total_size) == AKWBS_ERROR)
+           || ((upload->is_query == AKWBS_NO) && (upload->total_size <= last)))
+    return 400;
+
+  if (cursor != end)
+    return 400;
+
+  if ((upload->is_query == AKWBS_NO)
+      && (connection->daemon_ref->max_upload_size != 0)
+      && ((unsigned long)last >= connection->daemon_ref->max_upload_size))
+    return 413;
+
+  upload->is_ranged = AKWBS_YES;
+
+  if (upload->is_query == AKWBS_NO)
+  {
+    connection->file_cur_offset   = first;
+    connection->file_total_offset = last + 1;
+  }
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Get the destination of a COPY request. A COPY is handled as a PUT of the destination
+ * whose body, instead of coming from the client, is copied from the requested file.
+ * An absolute URI is taken to name this server, and only its path is kept.
+ *
+ * \param connection connection holding the request.
+ *
+ * \return AKWBS_SUCCESS on success, or the HTTP status code to reply.
+ */
+static int get_destination(struct akwbs_connection *connection)
+{
+  struct akwbs_http_slice *destination = &connection->request.destination;
+  struct akwbs_http_slice *value       = NULL;
+  char *authority = NULL;
+  char *path      = NULL;
+
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_DESTINATION);
+
+  if (value == NULL)
+    return 400;
+
+  *destination = *value;
+
+  authority = memmem(value->data, value->length, "://", AKWBS_STRLEN("://"));
+
+  if (authority != NULL)
+  {
+    authority += AKWBS_STRLEN("://");
+    path       = memchr(authority, '/', (size_t)(value->data + value->length - authority));
+
+    if (path == NULL)
+      return 400;
+
+    destination->data   = path;
+    destination->length = (size_t)(value->data + value->length - path);
+  }
+
+  if ((destination->length == 0)
+      || (destination->data[0] != '/')
+      || (memchr(destination->data, '?', destination->length) != NULL))
+    return 400;
+
+  if ((decode_path(destination) == AKWBS_ERROR)
+      || (normalize_path(destination) == AKWBS_ERROR))
+    return 400;
+
+  if (destination->length >= PATH_MAX - strlen(connection->daemon_ref->root_path) - 1)
+    return 414;
+
+  destination->data[destination->length] = '\0';
+
+  /* The body of a COPY is the source file, nothing is received. */
+  connection->is_chunked        = AKWBS_NO;
+  connection->expects_continue  = AKWBS_NO;
+  connection->file_total_offset = 0;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Get the expectation of a PUT request. A client sending Expect: 100-continue holds the
+ * body back until the upload has been accepted, so a rejected upload costs no transfer.
+ * HTTP/1.0 clients know no expectations, and their Expect field is ignored.
+ *
+ * \param connection connection holding the request.
+ *
+ * \return AKWBS_SUCCESS on success, or the HTTP status code to reply.
+ */
+static int get_expectation(struct akwbs_connection *connection)
+{
+  struct akwbs_http_slice *value = NULL;
+
+
+  connection->expects_continue = AKWBS_NO;
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_EXPECT);
+
+  if ((value == NULL) || (connection->request.version.data[7] == '0'))
+    return AKWBS_SUCCESS;
+
+  if ((value->length != AKWBS_STRLEN("100-continue"))
+      || (strncasecmp(value->data, "100-continue", value->length) != 0))
+    return 417;
+
+  connection->expects_continue = AKWBS_YES;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Do header processing to collect requested informations.
+ *
+ * \param connection connection containing the header.
+ *
+ * \return AKWBS_SUCCESS on success, otherwise the HTTP status code to be replied.
+ */
+static int do_processing(struct akwbs_connection *connection)
+{
+  char *position       = ring_buffer_read_address(&connection->buffer);
+  size_t end_of_header = 0;
+  int status           = AKWBS_SUCCESS;
+
+
+  status = parse_initial_message_line(connection, &position);
+
+  if (status != AKWBS_SUCCESS)
+    return status;
+
+  status = parse_header_fields(connection, position);
+
+  if (status != AKWBS_SUCCESS)
+    return status;
+
+  if (connection->io_type == AKWBS_IO_PUT_TYPE)
+  {
+    if (connection->request.method_id == AKWBS_HTTP_METHOD_COPY)
+      status = get_destination(connection);
+    else
+    {
+      status = get_expectation(connection);
+
+      if (status == AKWBS_SUCCESS)
+        status = get_transfer_coding(connection);
+
+      if ((status == AKWBS_SUCCESS) && (connection->is_chunked == AKWBS_NO))
+        status = get_content_length(connection);
+    }
+
+    if (status == AKWBS_SUCCESS)
+      status = get_content_range(connection);
+
+    if (status == AKWBS_SUCCESS)
+      status = akwbs_multipart_parse_query(connection);
+
+    if (status != AKWBS_SUCCESS)
+      return status;
+  }
+
+  end_of_header = (size_t)((connection->end_of_header)
+                           - (char *)ring_buffer_read_address(&connection->buffer));
+
+  ring_buffer_read_advance(&connection->buffer, end_of_header);
+
+  switch (connection->io_type)
+  {
+    case AKWBS_IO_GET_TYPE:
+      FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
+      FD_SET(connection->client_socket, &connection->daemon_ref->master_write_set);
+      break;
+    case AKWBS_IO_PUT_TYPE:
+      FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
+      FD_SET(connection->client_socket, &connection->daemon_ref->master_read_set);
+      break;
+    default:
+      return 400;
+  }
+
+  if (connection->request.method_id == AKWBS_HTTP_METHOD_COPY)
+    connection->file_name = connection->request.destination.data;
+  else
+    connection->file_name = connection->request.uri.data;
+
+  connection->connection_state = AKWBS_CONNECTION_HEADERS_PROCESSED;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Parse an HTTP-date in the preferred IMF-fixdate format.
+ *
+ * \param value the date, as sent by the client.
+ * \param date param-return the parsed date.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the value is not a date.
+ */
+static int parse_http_date(struct akwbs_http_slice *value, time_t *date)
+{
+  char text[64];
+  char *end = NULL;
+  struct tm tm;
+
+
+  if (value->length >= sizeof(text))
+    return AKWBS_ERROR;
+
+  memcpy(text, value->data, value->length);
+  text[value->length] = '\0';
+
+  bzero(&tm, sizeof(struct tm));
+
+  end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+  if ((end == NULL) || (*end != '\0'))
+    return AKWBS_ERROR;
+
+  *date = timegm(&tm);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Check whether a list of entity tags, as in If-None-Match, holds the given tag. The
+ * weak comparison is used, so "W/" prefixes are ignored.
+ *
+ * \param value the list of entity tags.
+ * \param etag the entity tag of the file, with its quotes.
+ *
+ * \return AKWBS_YES if the list holds the tag or is "*", AKWBS_NO otherwise.
+ */
+static int etag_list_matches(struct akwbs_http_slice *value, const char *etag)
+{
+  char   *cursor      = value->data;
+  char   *end         = value->data + value->length;
+  char   *tag         = NULL;
+  size_t etag_length  = strlen(etag);
+
+
+  while (cursor < end)
+  {
+    if ((*cursor == ' ') || (*cursor == '\t') || (*cursor == ','))
+    {
+      cursor++;
+      continue;
+    }
+
+    if (*cursor == '*')
+      return AKWBS_YES;
+
+    if ((end - cursor > 2) && (cursor[0] == 'W') && (cursor[1] == '/'))
+      cursor += 2;
+
+    if (*cursor != '"')
+      return AKWBS_NO;
+
+    tag = cursor++;
+
+    while ((cursor < end) && (*cursor != '"'))
+      cursor++;
+
+    if (cursor == end)
+      return AKWBS_NO;
+
+    cursor++;
+
+    if (((size_t)(cursor - tag) == etag_length)
+        && (memcmp(tag, etag, etag_length) == 0))
+      return AKWBS_YES;
+  }
+
+  return AKWBS_NO;
+}
+
+
+/*!
+ * Check whether the client already holds the current contents of the file, according
+ * to If-None-Match or, when it is absent, If-Modified-Since.
+ *
+ * \param connection connection holding the request and the opened file.
+ *
+ * \return AKWBS_YES if a 304 must be replied, AKWBS_NO otherwise.
+ */
+static int is_not_modified(struct akwbs_connection *connection)
+{
+  struct akwbs_http_slice *value = NULL;
+  time_t date;
+
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_IF_NONE_MATCH);
+
+  if (value != NULL)
+    return etag_list_matches(value, connection->file_stat->etag);
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_IF_MODIFIED_SINCE);
+
+  if ((value == NULL) || (parse_http_date(value, &date) == AKWBS_ERROR))
+    return AKWBS_NO;
+
+  return (connection->file_stat->mtime <= date) ? AKWBS_YES : AKWBS_NO;
+}
+
+
+/*!
+ * Check whether the Range header must be honored, according to If-Range. Entity tags
+ * use the strong comparison, so weak tags never match.
+ *
+ * \param connection connection holding the request and the opened file.
+ *
+ * \return AKWBS_YES if the ranges must be sent, AKWBS_NO if the whole file must be sent.
+ */
+static int if_range_matches(struct akwbs_connection *connection)
+{
+  struct akwbs_http_slice *value = NULL;
+  time_t date;
+
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_IF_RANGE);
+
+  if (value == NULL)
+    return AKWBS_YES;
+
+  if ((value->length > 0) && (value->data[0] == '"'))
+    return ((value->length == strlen(connection->file_stat->etag))
+            && (memcmp(value->data, connection->file_stat->etag, value->length) == 0))
+           ? AKWBS_YES : AKWBS_NO;
+
+  if (parse_http_date(value, &date) == AKWBS_ERROR)
+    return AKWBS_NO;
+
+  return (date == connection->file_stat->mtime) ? AKWBS_YES : AKWBS_NO;
+}
+
+
+/*!
+ * Parse the byte ranges of a Range header against the size of the file.
+ *
+ * \param connection param-return connection receiving the satisfiable ranges.
+ * \param value value of the Range header.
+ * \param size size of the file.
+ *
+ * \return AKWBS_SUCCESS on success, ranges_count is zero when no range is satisfiable.
+ *         AKWBS_ERROR if the header is malformed, has no range at all, or too many
+ *         ranges, in which case it must be ignored.
+ */
+static int parse_ranges(struct akwbs_connection *connection,
+                        struct akwbs_http_slice *value,
+                        off_t size)
+{
+  char *cursor = value->data + strlen("bytes=");
+  char *end    = value->data + value->length;
+  off_t first  = 0;
+  off_t last   = 0;
+  unsigned int specs = 0;
+
+
+  connection->ranges_count = 0;
+
+  if ((value->length < strlen("bytes="))
+      || (strncasecmp(value->data, "bytes=", strlen("bytes=")) != 0))
+    return AKWBS_ERROR;
+
+  while (cursor < end)
+  {
+    if ((*cursor == ' ') || (*cursor == '\t') || (*cursor == ','))
+    {
+      cursor++;
+      continue;
+    }
+
+    if (*cursor == '-')
+    {
+      cursor++;
+
+      if (parse_offset(&cursor, end, &last) == AKWBS_ERROR)
+        return AKWBS_ERROR;
+
+      first = (last < size) ? size - last : 0;
+      last  = size - 1;
+    }
+    else
+    {
+      if (parse_offset(&cursor, end, &first) == AKWBS_ERROR)
+        return AKWBS_ERROR;
+
+      if ((cursor == end) || (*cursor++ != '-'))
+        return AKWBS_ERROR;
+
+      if ((cursor < end) && isdigit((unsigned char)*cursor))
+      {
+        if (parse_offset(&cursor, end, &last) == AKWBS_ERROR)
+          return AKWBS_ERROR;
+
+        if (last < first)
+          return AKWBS_ERROR;
+      }
+      else
+        last = size - 1;
+
+      if (last >= size)
+        last = size - 1;
+    }
+
+    while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t')))
+      cursor++;
+
+    if ((cursor < end) && (*cursor != ','))
+      return AKWBS_ERROR;
+
+    specs++;
+
+    /* Unsatisfiable ranges, either past the end or suffixes of zero bytes. */
+    if ((first >= size) || (last < first))
+      continue;
+
+    if (connection->ranges_count == AKWBS_MAX_RANGES)
+      return AKWBS_ERROR;
+
+    connection->ranges[connection->ranges_count].first = first;
+    connection->ranges[connection->ranges_count].last  = last;
+    connection->ranges_count++;
+  }
+
+  /* A range set holds at least one range, RFC 9110 14.1.1: an empty one is no range. */
+  if (specs == 0)
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Push a piece of bytes to the response head of a connection. A piece that follows the
+ * previous one in memory is merged with it.
+ *
+ * \param connection connection holding the response head.
+ * \param base first byte of the piece, which must outlive the response.
+ * \param length length of the piece.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the response head has no room for another piece.
+ */
+static int push_response_iov(struct akwbs_connection *connection,
+                             const void *base,
+                             size_t length)
+{
+  struct iovec *last = NULL;
+
+
+  if (length == 0)
+    return AKWBS_SUCCESS;
+
+  if (connection->response_iov_count > 0)
+  {
+    last = &connection->response_iov[connection->response_iov_count - 1];
+
+    if ((char *)last->iov_base + last->iov_len == (const char *)base)
+    {
+      last->iov_len += length;
+      return AKWBS_SUCCESS;
+    }
+  }
+
+  if (connection->response_iov_count == AKWBS_RESPONSE_MAX_IOV)
+    return AKWBS_ERROR;
+
+  connection->response_iov[connection->response_iov_count].iov_base = (void *)base;
+  connection->response_iov[connection->response_iov_count].iov_len  = length;
+  connection->response_iov_count++;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Push a string literal to the response head of a connection.
+ */
+#define push_response_literal(connection, literal) \
+  push_response_iov((connection), (literal), AKWBS_STRLEN(literal))
+
+
+/*!
+ * Append formatted bytes to the response head of a connection.
+ *
+ * \param connection connection holding the response head.
+ * \param format format of the bytes, as in printf.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the response head has no room for the bytes.
+ */
+static int append_response_head(struct akwbs_connection *connection,
+                                const char *format,
+                                ...)
+{
+  char *start = connection->response_head + connection->response_head_length;
+  size_t room = AKWBS_RESPONSE_HEAD_SIZE - connection->response_head_length;
+  va_list arguments;
+  int length  = 0;
+
+
+  va_start(arguments, format);
+  length = vsnprintf(start, room, format, arguments);
+  va_end(arguments);
+
+  if ((length < 0) || ((size_t)length >= room))
+    return AKWBS_ERROR;
+
+  connection->response_head_length += length;
+
+  return push_response_iov(connection, start, (size_t)length);
+}
+
+
+/*!
+ * Copy bytes to the response head of a connection, as pieces shared with other
+ * connections may change before the head is sent.
+ *
+ * \param connection connection holding the response head.
+ * \param data bytes to copy.
+ * \param length number of bytes.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the response head has no room for them.
+ */
+static int copy_response_head(struct akwbs_connection *connection,
+                              const char *data,
+                              size_t length)
+{
+  char *start = connection->response_head + connection->response_head_length;
+
+
+  if (length > AKWBS_RESPONSE_HEAD_SIZE - connection->response_head_length)
+    return AKWBS_ERROR;
+
+  memcpy(start, data, length);
+  connection->response_head_length += length;
+
+  return push_response_iov(connection, start, length);
+}
+
+
+/*!
+ * Empty the response head of a connection.
+ *
+ * \param connection connection holding the response head.
+ */
+static void reset_response_head(struct akwbs_connection *connection)
+{
+  connection->response_head_length = 0;
+  connection->response_iov_count   = 0;
+  connection->response_iov_sent    = 0;
+}
+
+
+/*!
+ * Start a response head with its status line and the Date header. The date is cached
+ * by the daemon and copied, so a head sent across two seconds is never torn.
+ *
+ * \param connection connection holding the response head.
+ * \param status_line status line, outliving the response.
+ * \param length length of the status line.
+ */
+static void begin_response_head(struct akwbs_connection *connection,
+                                const char *status_line,
+                                size_t length)
+{
+  reset_response_head(connection);
+  push_response_iov(connection, status_line, length);
+  append_response_head(connection, "Date: %s\r\n", connection->daemon_ref->http_date);
+}
+
+
+/*!
+ * Push the header lines describing the representation being sent: its content coding,
+ * and Vary when another coding of the same file could have been chosen.
+ *
+ * \param connection connection holding the response head.
+ */
+static void push_representation(struct akwbs_connection *connection)
+{
+  switch (connection->content_encoding)
+  {
+    case AKWBS_HTTP_ENCODING_GZIP:
+      push_response_literal(connection, "Content-Encoding: gzip\r\n");
+      break;
+    case AKWBS_HTTP_ENCODING_BR:
+      push_response_literal(connection, "Content-Encoding: br\r\n");
+      break;
+    default:
+      break;
+  }
+
+  if (connection->mime_type->compressible == AKWBS_YES)
+    push_response_literal(connection, "Vary: Accept-Encoding\r\n");
+}
+
+
+/*!
+ * Copy the validator header lines of the opened file to the response head. They are
+ * rebuilt in place when the file changes, while other connections still send theirs.
+ *
+ * \param connection connection holding the response head.
+ */
+static void push_validators(struct akwbs_connection *connection)
+{
+  struct akwbs_file_stat *file_stat = connection->file_stat;
+
+
+  copy_response_head(connection,
+                     file_stat->headers + file_stat->validators_offset,
+                     file_stat->headers_length - file_stat->validators_offset);
+}
+
+
+/*!
+ * Make the given byte range the current one. Its body part head is appended to the
+ * response head and the file offsets are set to the range.
+ *
+ * \param connection connection being transmitted.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the response head has no room for the body part head.
+ */
+static int start_range(struct akwbs_connection *connection)
+{
+  struct akwbs_byte_range *range = &connection->ranges[connection->ranges_started];
+
+
+  if (connection->ranges_count > 1)
+    if (append_response_head(connection,
+                             AKWBS_HTTP_PART_HEAD_FORMAT,
+                             connection->boundary,
+                             connection->mime_type->header,
+                             (long long)range->first,
+                             (long long)range->last,
+                             (long long)connection->file_stat->size) == AKWBS_ERROR)
+      return AKWBS_ERROR;
+
+  connection->file_cur_offset   = range->first;
+  connection->file_total_offset = range->last + 1;
+  connection->ranges_started++;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Compute the length of a multipart/byteranges body.
+ *
+ * \param connection connection holding the byte ranges.
+ *
+ * \return length of the body.
+ */
+static off_t multipart_length(struct akwbs_connection *connection)
+{
+  off_t length = 0;
+  unsigned int i;
+
+
+  for (i = 0; i < connection->ranges_count; i++)
+    length += snprintf(NULL,
+                       0,
+                       AKWBS_HTTP_PART_HEAD_FORMAT,
+                       connection->boundary,
+                       connection->mime_type->header,
+                       (long long)connection->ranges[i].first,
+                       (long long)connection->ranges[i].last,
+                       (long long)connection->file_stat->size)
+              + connection->ranges[i].last - connection->ranges[i].first + 1;
+
+  return length + snprintf(NULL, 0, AKWBS_HTTP_LAST_BOUNDARY_FORMAT, connection->boundary);
+}
+
+
+/*!
+ * Write the head of a response without body and mark the file as already transmitted,
+ * so no I/O is ever queued for it.
+ *
+ * \param connection connection whose file has just been opened.
+ *
+ * \return AKWBS_SUCCESS.
+ */
+static int finish_bodiless_response(struct akwbs_connection *connection)
+{
+  push_response_literal(connection, AKWBS_HTTP_END_OF_HEAD);
+
+  connection->file_cur_offset = connection->file_total_offset;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Write the head of a 206 response, for the byte ranges found in the request.
+ *
+ * \param connection connection whose file has just been opened.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the response head has no room for the first body part.
+ */
+static int prepare_partial_response(struct akwbs_connection *connection)
+{
+  struct akwbs_byte_range *range = &connection->ranges[0];
+  struct timeval now;
+
+
+  begin_response_head(connection, AKWBS_HTTP_206_LINE, AKWBS_STRLEN(AKWBS_HTTP_206_LINE));
+
+  if (connection->ranges_count == 1)
+  {
+    push_response_iov(connection,
+                      connection->mime_type->header,
+                      connection->mime_type->header_length);
+    push_representation(connection);
+    append_response_head(connection,
+                         "Content-Range: bytes %lld-%lld/%lld\r\n"
+                         "Content-Length: %lld\r\n",
+                         (long long)range->first,
+                         (long long)range->last,
+                         (long long)connection->file_stat->size,
+                         (long long)(range->last - range->first + 1));
+    push_validators(connection);
+    push_response_literal(connection, AKWBS_HTTP_END_OF_HEAD);
+
+    return start_range(connection);
+  }
+
+  gettimeofday(&now, NULL);
+
+  snprintf(connection->boundary,
+           sizeof(connection->boundary),
+           "%08lx%08lx",
+           (unsigned long)now.tv_usec ^ (unsigned long)connection->file_stat->inode_number,
+           (unsigned long)now.tv_sec ^ (unsigned long)connection->client_socket);
+
+  append_response_head(connection,
+                       "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                       "Content-Length: %lld\r\n",
+                       connection->boundary,
+                       (long long)multipart_length(connection));
+  push_representation(connection);
+  push_validators(connection);
+  push_response_literal(connection, AKWBS_HTTP_END_OF_HEAD);
+
+  return start_range(connection);
+}
+
+
+/*!
+ * Select the part of the opened file to be sent, according to the conditional and Range
+ * headers, and write the matching response head. The head is assembled from pieces:
+ * static status and Content-Type lines, the cached date of the daemon and a copy of the
+ * cached header lines of the file, so nothing is formatted for a plain 200.
+ *
+ * \param connection connection whose file has just been opened.
+ *
+ * \return AKWBS_SUCCESS on success, the response head is then ready to be sent.
+ *         AKWBS_ERROR if the response head could not be written.
+ */
+int akwbs_http_prepare_response(struct akwbs_connection *connection)
+{
+  struct akwbs_http_slice *value    = NULL;
+  struct akwbs_file_stat *file_stat = connection->file_stat;
+
+
+  connection->ranges_count   = 0;
+  connection->ranges_started = 0;
+
+  if (is_not_modified(connection) == AKWBS_YES)
+  {
+    begin_response_head(connection, AKWBS_HTTP_304_LINE, AKWBS_STRLEN(AKWBS_HTTP_304_LINE));
+    push_representation(connection);
+    push_validators(connection);
+
+    return finish_bodiless_response(connection);
+  }
+
+  value = akwbs_http_get_header(&connection->request, AKWBS_HTTP_HEADER_RANGE);
+
+  if ((value != NULL)
+      && (connection->request.method_id == AKWBS_HTTP_METHOD_GET)
+      && (if_range_matches(connection) == AKWBS_YES)
+      && (parse_ranges(connection, value, file_stat->size) == AKWBS_SUCCESS))
+  {
+    if (connection->ranges_count > 0)
+      return prepare_partial_response(connection);
+
+    begin_response_head(connection, AKWBS_HTTP_416_LINE, AKWBS_STRLEN(AKWBS_HTTP_416_LINE));
+    append_response_head(connection,
+                         "Content-Range: bytes */%lld\r\n",
+                         (long long)file_stat->size);
+
+    return finish_bodiless_response(connection);
+  }
+
+  connection->ranges_count = 0;
+
+  begin_response_head(connection, AKWBS_HTTP_200_LINE, AKWBS_STRLEN(AKWBS_HTTP_200_LINE));
+  push_response_iov(connection,
+                    connection->mime_type->header,
+                    connection->mime_type->header_length);
+  push_representation(connection);
+  copy_response_head(connection, file_stat->headers, file_stat->headers_length);
+
+  if (connection->request.method_id == AKWBS_HTTP_METHOD_HEAD)
+    return finish_bodiless_response(connection);
+
+  return push_response_literal(connection, AKWBS_HTTP_END_OF_HEAD);
+}
+
+
+/*!
+ * Move the transmission to the next body part of a multipart/byteranges response, once
+ * the current one has been completely sent.
+ *
+ * \param connection connection being transmitted, with an empty response head.
+ *
+ * \return AKWBS_YES if there is something else to be sent.
+ *         AKWBS_NO if the response is complete.
+ */
+int akwbs_http_next_part(struct akwbs_connection *connection)
+{
+  if (connection->ranges_count < 2)
+    return AKWBS_NO;
+
+  if (connection->ranges_started > connection->ranges_count)
+    return AKWBS_NO;
+
+  reset_response_head(connection);
+
+  if (connection->ranges_started < connection->ranges_count)
+    return (start_range(connection) == AKWBS_SUCCESS) ? AKWBS_YES : AKWBS_NO;
+
+  append_response_head(connection,
+                       AKWBS_HTTP_LAST_BOUNDARY_FORMAT,
+                       connection->boundary);
+  connection->ranges_started++;
+
+  return AKWBS_YES;
+}
+
+
+/*!
+ * Check whether the client accepts a content coding, according to its Accept-Encoding
+ * header. A coding listed with q=0 is refused, even if "*" is accepted.
+ *
+ * \param request parsed request.
+ * \param coding content coding, in lower case.
+ *
+ * \return AKWBS_YES if the coding is accepted, AKWBS_NO otherwise.
+ */
+int akwbs_http_accepts_encoding(struct akwbs_http_request *request, const char *coding)
+{
+  struct akwbs_http_slice *value = akwbs_http_get_header(request,
+                                                         AKWBS_HTTP_HEADER_ACCEPT_ENCODING);
+  size_t coding_length = strlen(coding);
+  int wildcard         = AKWBS_NO;
+  int accepted         = AKWBS_NO;
+  char *cursor         = NULL;
+  char *end            = NULL;
+  char *token          = NULL;
+  char *digit          = NULL;
+  size_t token_length  = 0;
+
+
+  if (value == NULL)
+    return AKWBS_NO;
+
+  cursor = value->data;
+  end    = value->data + value->length;
+
+  while (cursor < end)
+  {
+    while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t') || (*cursor == ',')))
+      cursor++;
+
+    token = cursor;
+
+    while ((cursor < end) && (*cursor != ',') && (*cursor != ';')
+           && (*cursor != ' ') && (*cursor != '\t'))
+      cursor++;
+
+    token_length = cursor - token;
+    accepted     = AKWBS_YES;
+
+    /* Parameters: only a zero quality value matters. */
+    while ((cursor < end) && (*cursor != ','))
+    {
+      if ((*cursor == 'q') && (cursor + 2 < end) && (cursor[1] == '='))
+      {
+        accepted = AKWBS_NO;
+
+        for (digit = cursor + 2; (digit < end) && (*digit != ',') && (*digit != ';'); digit++)
+          if ((*digit >= '1') && (*digit <= '9'))
+            accepted = AKWBS_YES;
+      }
+
+      cursor++;
+    }
+
+    if ((token_length == coding_length)
+        && (strncasecmp(token, coding, coding_length) == 0))
+      return accepted;
+
+    if ((token_length == 1) && (*token == '*'))
+      wildcard = accepted;
+  }
+
+  return wildcard;
+}
+
+
+/*!
+ * Consume the chunk framing found at the start of the buffer of a connection, up to the
+ * next payload bytes. Decoding is incremental: it stops wherever the received bytes
+ * stop, and resumes from its saved state.
+ *
+ * \param connection connection receiving a chunked body.
+ *
+ * \return AKWBS_SUCCESS on success. When the current chunk still has payload bytes, they
+ *         are the ones at the start of the buffer, up to chunk_end_offset. When the body
+ *         is complete, file_total_offset is set to its decoded length.
+ *         Otherwise the HTTP status code to reply: 400 on malformed framing, 413 when
+ *         the body grows past the upload size limit.
+ */
+int akwbs_http_decode_chunks(struct akwbs_connection *connection)
+{
+  char *data   = ring_buffer_read_address(&connection->buffer);
+  size_t count = ring_buffer_count_bytes(&connection->buffer);
+  size_t used  = 0;
+  int digit    = 0;
+
+
+  while (connection->chunk_state != AKWBS_HTTP_CHUNK_DONE)
+  {
+    if (connection->chunk_state == AKWBS_HTTP_CHUNK_DATA)
+    {
+      if (connection->file_cur_offset < connection->chunk_end_offset)
+        break;
+
+      connection->chunk_state = AKWBS_HTTP_CHUNK_DATA_CR;
+    }
+
+    if (used == count)
+      break;
+
+    switch (connection->chunk_state)
+    {
+      case AKWBS_HTTP_CHUNK_SIZE_START:
+      case AKWBS_HTTP_CHUNK_SIZE:
+        digit = hex_value(data[used]);
+
+        if (digit != AKWBS_ERROR)
+        {
+          if (connection->chunk_end_offset > (INT64_MAX - digit) / 16)
+            return 413;
+
+          connection->chunk_end_offset = connection->chunk_end_offset * 16 + digit;
+          connection->chunk_state      = AKWBS_HTTP_CHUNK_SIZE;
+        }
+        else if (connection->chunk_state == AKWBS_HTTP_CHUNK_SIZE_START)
+          return 400;
+        else if ((data[used] == ';') || (data[used] == ' ') || (data[used] == '\t'))
+          connection->chunk_state = AKWBS_HTTP_CHUNK_EXTENSION;
+        else if (data[used] == '\r')
+          connection->chunk_state = AKWBS_HTTP_CHUNK_SIZE_LF;
+        else
+          return 400;
+        break;
+      case AKWBS_HTTP_CHUNK_EXTENSION:
+        if (data[used] == '\r')
+          connection->chunk_state = AKWBS_HTTP_CHUNK_SIZE_LF;
+        break;
+      case AKWBS_HTTP_CHUNK_SIZE_LF:
+        if (data[used] != '\n')
+          return 400;
+
+        if (connection->chunk_end_offset == 0)
+          connection->chunk_state = AKWBS_HTTP_CHUNK_TRAILER;
+        else if (connection->chunk_end_offset > INT64_MAX - connection->file_cur_offset)
+          return 413;
+        else
+        {
+          connection->chunk_end_offset += connection->file_cur_offset;
+          connection->chunk_state       = AKWBS_HTTP_CHUNK_DATA;
+
+          if ((connection->daemon_ref->max_upload_size != 0)
+              && ((unsigned long)connection->chunk_end_offset
+                  > connection->daemon_ref->max_upload_size))
+            return 413;
+        }
+        break;
+      case AKWBS_HTTP_CHUNK_DATA_CR:
+        if (data[used] != '\r')
+          return 400;
+
+        connection->chunk_state = AKWBS_HTTP_CHUNK_DATA_LF;
+        break;
+      case AKWBS_HTTP_CHUNK_DATA_LF:
+        if (data[used] != '\n')
+          return 400;
+
+        connection->chunk_end_offset = 0;
+        connection->chunk_state      = AKWBS_HTTP_CHUNK_SIZE_START;
+        break;
+      case AKWBS_HTTP_CHUNK_TRAILER:
+        if (data[used] == '\r')
+          connection->chunk_state = AKWBS_HTTP_CHUNK_END_LF;
+        else
+          connection->chunk_state = AKWBS_HTTP_CHUNK_TRAILER_LINE;
+        break;
+      case AKWBS_HTTP_CHUNK_TRAILER_LINE:
+        if (data[used] == '\r')
+          connection->chunk_state = AKWBS_HTTP_CHUNK_TRAILER_LF;
+        break;
+      case AKWBS_HTTP_CHUNK_TRAILER_LF:
+        if (data[used] != '\n')
+          return 400;
+
+        connection->chunk_state = AKWBS_HTTP_CHUNK_TRAILER;
+        break;
+      case AKWBS_HTTP_CHUNK_END_LF:
+        if (data[used] != '\n')
+          return 400;
+
+        connection->chunk_state       = AKWBS_HTTP_CHUNK_DONE;
+        connection->file_total_offset = connection->file_cur_offset;
+        break;
+      default:
+        return 400;
+    }
+
+    used++;
+  }
+
+  ring_buffer_read_advance(&connection->buffer, used);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Format a date as an HTTP-date, in the IMF-fixdate format.
+ *
+ * \param date the date.
+ * \param text param-return room for AKWBS_HTTP_DATE_SIZE bytes.
+ */
+void akwbs_http_format_date(time_t date, char *text)
+{
+  struct tm tm;
+
+
+  gmtime_r(&date, &tm);
+  strftime(text, AKWBS_HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+
+/*!
+ * Get the value of a known header field of the request.
+ *
+ * \param request index of the request.
+ * \param id identifier of the header field.
+ *
+ * \return the value of the field, or NULL if the client did not send it.
+ */
+struct akwbs_http_slice *akwbs_http_get_header(struct akwbs_http_request *request,
+                                               enum akwbs_http_header_id id)
+{
+  if (request->known[id] == NULL)
+    return NULL;
+
+  return &request->known[id]->value;
+}
+
+
+/*!
+ * Process the request header of the given connection. Malformed requests are replied
+ * with the proper error and their connection is closed.
+ *
+ * \param connection connection containing the header.
+ *
+ * \return AKWBS_SUCCESS, errors only affect the given connection.
+ */
+int akwbs_process_header(struct akwbs_connection *connection)
+{
+  int status = do_processing(connection);
+
+
+  if (status != AKWBS_SUCCESS)
+    return reply_and_close(connection, status);
+
   return AKWBS_SUCCESS;
 }
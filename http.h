@@ -9,11 +9,186 @@
 #ifndef _AKWBS_HTTP_H_
 #define _AKWBS_HTTP_H_
 
-#define STRLEN_ANY_ACCEPTED_METHOD 3 /*!< strlen value for GET or PUT.                  */
+#include <stddef.h>
+#include <time.h>
+
+
+#define AKWBS_HTTP_MAX_FIELDS 64     /*!< Maximum number of header fields in a request. */
+
+
+struct akwbs_connection;
+
+
+/*!
+ * Header fields known by the server. Their values are reachable in constant time
+ * through the index of the parsed request.
+ */
+enum akwbs_http_header_id
+{
+  AKWBS_HTTP_HEADER_HOST = 0,          /*!< Host.                                       */
+
+  AKWBS_HTTP_HEADER_CONNECTION,        /*!< Connection.                                 */
+
+  AKWBS_HTTP_HEADER_CONTENT_LENGTH,    /*!< Content-Length.                             */
+
+  AKWBS_HTTP_HEADER_CONTENT_TYPE,      /*!< Content-Type.                               */
+
+  AKWBS_HTTP_HEADER_CONTENT_ENCODING,  /*!< Content-Encoding.                           */
+
+  AKWBS_HTTP_HEADER_CONTENT_RANGE,     /*!< Content-Range.                              */
+
+  AKWBS_HTTP_HEADER_TRANSFER_ENCODING, /*!< Transfer-Encoding.                          */
+
+  AKWBS_HTTP_HEADER_EXPECT,            /*!< Expect.                                     */
+
+  AKWBS_HTTP_HEADER_RANGE,             /*!< Range.                                      */
+
+  AKWBS_HTTP_HEADER_IF_RANGE,          /*!< If-Range.                                   */
+
+  AKWBS_HTTP_HEADER_IF_MATCH,          /*!< If-Match.                                   */
+
+  AKWBS_HTTP_HEADER_IF_NONE_MATCH,     /*!< If-None-Match.                              */
+
+  AKWBS_HTTP_HEADER_IF_MODIFIED_SINCE, /*!< If-Modified-Since.                          */
+
+  AKWBS_HTTP_HEADER_IF_UNMODIFIED_SINCE, /*!< If-Unmodified-Since.                      */
+
+  AKWBS_HTTP_HEADER_ACCEPT,            /*!< Accept.                                     */
+
+  AKWBS_HTTP_HEADER_ACCEPT_ENCODING,   /*!< Accept-Encoding.                            */
+
+  AKWBS_HTTP_HEADER_USER_AGENT,        /*!< User-Agent.                                 */
+
+  AKWBS_HTTP_HEADER_DESTINATION,       /*!< Destination.                                */
+
+  AKWBS_HTTP_HEADER_COUNT              /*!< Number of known header fields.              */
+};
+
+
+/*!
+ * Request methods accepted by the server.
+ */
+enum akwbs_http_method
+{
+  AKWBS_HTTP_METHOD_UNKNOWN = 0,       /*!< Method not supported.                       */
+
+  AKWBS_HTTP_METHOD_GET,               /*!< GET.                                        */
+
+  AKWBS_HTTP_METHOD_HEAD,              /*!< HEAD, a GET without the body.               */
+
+  AKWBS_HTTP_METHOD_PUT,               /*!< PUT.                                        */
+
+  AKWBS_HTTP_METHOD_COPY               /*!< COPY, a PUT whose body is another file.     */
+};
+
+
+/*!
+ * Content codings the server is able to send.
+ */
+enum akwbs_http_encoding
+{
+  AKWBS_HTTP_ENCODING_IDENTITY = 0,    /*!< No content coding.                          */
+
+  AKWBS_HTTP_ENCODING_GZIP,            /*!< gzip.                                       */
+
+  AKWBS_HTTP_ENCODING_BR               /*!< Brotli.                                     */
+};
+
+
+/*!
+ * States of the decoder of a chunked request body.
+ */
+enum akwbs_http_chunk_state
+{
+  AKWBS_HTTP_CHUNK_SIZE_START = 0,     /*!< First hexadecimal digit of a chunk size.    */
+
+  AKWBS_HTTP_CHUNK_SIZE,               /*!< Following digits of a chunk size.           */
+
+  AKWBS_HTTP_CHUNK_EXTENSION,          /*!< Chunk extensions, ignored.                  */
+
+  AKWBS_HTTP_CHUNK_SIZE_LF,            /*!< Line feed ending the chunk size line.       */
+
+  AKWBS_HTTP_CHUNK_DATA,               /*!< Chunk payload.                              */
+
+  AKWBS_HTTP_CHUNK_DATA_CR,            /*!< Carriage return ending the payload.         */
+
+  AKWBS_HTTP_CHUNK_DATA_LF,            /*!< Line feed ending the payload.               */
+
+  AKWBS_HTTP_CHUNK_TRAILER,            /*!< Start of a trailer line.                    */
+
+  AKWBS_HTTP_CHUNK_TRAILER_LINE,       /*!< Trailer field, ignored.                     */
+
+  AKWBS_HTTP_CHUNK_TRAILER_LF,         /*!< Line feed ending a trailer field.           */
+
+  AKWBS_HTTP_CHUNK_END_LF,             /*!< Line feed ending the body.                  */
+
+  AKWBS_HTTP_CHUNK_DONE                /*!< The whole body has been decoded.            */
+};
+
+
+/*!
+ * A slice of bytes living inside the connection's ring buffer. Slices are not NUL
+ * terminated, unless stated otherwise.
+ */
+struct akwbs_http_slice
+{
+  char   *data;                 /*!< First byte of the slice.                           */
+  size_t length;                /*!< Number of bytes in the slice.                      */
+};
+
+
+/*!
+ * A header field of the request.
+ */
+struct akwbs_http_field
+{
+  struct akwbs_http_slice name;  /*!< Field name, as sent by the client.                */
+  struct akwbs_http_slice value; /*!< Field value, without surrounding whitespaces.     */
+};
+
+
+/*!
+ * Index of the request header. Nothing is copied, every slice points into the ring
+ * buffer of the connection, so the index is valid until the header bytes are reused.
+ */
+struct akwbs_http_request
+{
+  struct akwbs_http_slice method;   /*!< Request method.                                */
+
+  enum akwbs_http_method method_id; /*!< Request method, as recognized by the server.   */
+
+  struct akwbs_http_slice uri;      /*!< Percent-decoded and normalized path, NUL
+                                     *   terminated in place.
+                                     */
+
+  struct akwbs_http_slice query;    /*!< Raw query string, without the '?'.             */
+
+  struct akwbs_http_slice
+    destination;                    /*!< Decoded and normalized Destination path of a
+                                     *   COPY, NUL terminated in place.
+                                     */
+
+  struct akwbs_http_slice version;  /*!< Protocol version.                              */
+
+  struct akwbs_http_field
+    fields[AKWBS_HTTP_MAX_FIELDS];  /*!< Every header field, in order of arrival.       */
+
+  unsigned int fields_count;        /*!< Number of header fields.                       */
+
+  struct akwbs_http_field
+    *known[AKWBS_HTTP_HEADER_COUNT];/*!< Known header fields, indexed by their id.       */
+};
 
 
 /* Public Interface. */
 
 int akwbs_process_header(struct akwbs_connection *connection);
+int akwbs_http_prepare_response(struct akwbs_connection *connection);
+int akwbs_http_next_part(struct akwbs_connection *connection);
+struct akwbs_http_slice *akwbs_http_get_header(struct akwbs_http_request *request,
+                                               enum akwbs_http_header_id id);
+void akwbs_http_format_date(time_t date, char *text);
+int akwbs_http_accepts_encoding(struct akwbs_http_request *request, const char *coding);
+int akwbs_http_decode_chunks(struct akwbs_connection *connection);
 
 #endif
@@ -22,6 +22,21 @@
 
 #define AKWBS_WRITE_INDEX 1  /*!< Index indicating the write side.                      */
 
+#define AKWBS_HTTP_DATE_SIZE 32 /*!< Room for an HTTP-date.                               */
+
+
+/*!
+ * When an upload is considered done, and its 201 sent.
+ */
+enum akwbs_durability
+{
+  AKWBS_DURABILITY_NONE = 0,       /*!< Once written to the page cache.                 */
+
+  AKWBS_DURABILITY_FSYNC,          /*!< Once synced on its own by a working thread.     */
+
+  AKWBS_DURABILITY_GROUP           /*!< Once synced in a batch with other uploads.      */
+};
+
 
 /*!
  * This structure represents the server's configuration.
@@ -31,6 +46,25 @@ struct akwbs_server_conf
   char          *root_path;        /*!< Root path to this directory.                    */
   uint16_t      port;              /*!< Server's port.                                  */
   unsigned long send_rate;         /*!< Rate of send transmission, in bytes per second. */
+  int           durability;        /*!< Durability of uploads, enum akwbs_durability.   */
+  unsigned long commit_window_us;  /*!< Time gathering uploads into a group commit.     */
+  unsigned long writeback_window;  /*!< Bytes of uploads flushed at once, 0 to disable. */
+  unsigned long dirty_budget;      /*!< Dirty bytes of uploads per device, 0 for none.  */
+  unsigned long max_upload_size;   /*!< Largest accepted upload body, 0 for no limit.   */
+  unsigned long io_threads;        /*!< Fewest I/O working threads, started at once.    */
+  unsigned long io_threads_max;    /*!< Most I/O working threads, 0 for io_threads.     */
+  const char    *io_cpus;          /*!< CPUs of the I/O threads, or NULL for any.       */
+  const char    *loop_cpus;        /*!< CPUs of the event loop, or NULL for any.        */
+  const char    *metrics_file;     /*!< File the metrics are written to, or NULL.       */
+  unsigned long latency_bytes;     /*!< Transfers this short take the latency lane.     */
+  unsigned long latency_reserve;   /*!< Percent of I/O threads kept for that lane.      */
+  unsigned long read_depth;        /*!< Reads of a download in flight at once.          */
+  int           inline_io;         /*!< Cached I/O is done by the event loop.           */
+  unsigned long direct_io_size;    /*!< Files this large are read directly, 0 for none. */
+  const char    *direct_io_paths;  /*!< Paths read directly, as "/a,/b", or NULL.       */
+  unsigned long readahead_max;     /*!< Largest readahead of a download, 0 for none.    */
+  unsigned long drop_behind_size;  /*!< Files this large are dropped behind, 0 never.   */
+  const char    *device_threads;   /*!< Threads of some devices, as "path:N,...".       */
 };
 
 
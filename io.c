@@ -4,14 +4,21 @@
  * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/param.h>
+#include <sys/uio.h>
 
 #include "io.h"
 
+
+#define AKWBS_IO_COPY_SIZE (64 * 1024) /*!< Bytes copied at once, without copy_file_range. */
+
 /*!
  * Read bytes from the given file from the given offset.
  *
@@ -34,12 +41,13 @@ static int do_io_read(int fd, void *address, ssize_t *bytes, off_t *offset)
   switch (bytes_read)
   {
     case -1:
+      *bytes = 0;
       switch (errno)
     {
       case EAGAIN:
         /* This is OK. */
         break;
-      defaul:
+      default:
         return -1;
     }
       break;
@@ -73,13 +81,13 @@ static int do_io_write(int fd, void *address, ssize_t *bytes, off_t *offset)
   switch (bytes_written)
   {
     case -1:
+      *bytes = 0;
       switch (errno)
     {
       case EAGAIN:
         /* This is OK. */
         break;
       default:
-        puts(strerror(errno));
         return -1;
     }
       break;
@@ -142,3 +150,119 @@ int akwbs_do_io(int fd, void *address, ssize_t *bytes, off_t *offset, int io_typ
 
   return ret;
 }
+
+
+/*!
+ * Perform I/O to the given file only as far as it needs no wait on the disk, that is,
+ * within the page cache. Unlike akwbs_do_io, the bytes are not limited to BUFSIZ.
+ *
+ * \param fd      file descriptor.
+ * \param address address to the buffer.
+ * \param bytes   return-param initially with the desired number of bytes used in this
+ *                operation, being set to the actual number of bytes used afterwards: 0 if
+ *                the first of them would wait, or on error.
+ * \param offset  return-param initially containing the actual offset before the I/O,
+ *                and, afterwards, being set to represent the actual offset on file.
+ *
+ * \return -1 if the file does not support such I/O, which may then be left to working
+ *         threads for good. 0 otherwise, even on error: the working threads will meet
+ *         it again.
+ */
+int akwbs_do_io_nowait(int fd, void *address, ssize_t *bytes, off_t *offset, int io_type)
+{
+  struct iovec iov;
+  ssize_t ret = 0;
+
+
+  iov.iov_base = address;
+  iov.iov_len  = (size_t)*bytes;
+
+  if (io_type == AKWBS_IO_GET_TYPE)
+    ret = preadv2(fd, &iov, 1, *offset, RWF_NOWAIT);
+  else
+    ret = pwritev2(fd, &iov, 1, *offset, RWF_NOWAIT);
+
+  if (ret == -1)
+  {
+    *bytes = 0;
+
+    if ((errno == EOPNOTSUPP) || (errno == EINVAL) || (errno == ENOSYS))
+      return -1;
+
+    return 0;
+  }
+
+  *bytes   = ret;
+  *offset += ret;
+
+  return 0;
+}
+
+
+/*!
+ * Copy a whole file into another, at the given offset. copy_file_range shares or
+ * copies the extents in the kernel; where it cannot work across the two files, the
+ * bytes are copied through a buffer.
+ *
+ * \param source_fd file descriptor of the source.
+ * \param size      size of the source.
+ * \param fd        file descriptor of the destination.
+ * \param offset    return-param offset in the destination, moved past the copy.
+ *
+ * \return 0 on success. -1 on error.
+ */
+int akwbs_copy_file(int source_fd, off_t size, int fd, off_t *offset)
+{
+  char buffer[AKWBS_IO_COPY_SIZE];
+  off_t source_offset = 0;
+  ssize_t bytes       = 0;
+  ssize_t written     = 0;
+  ssize_t ret         = 0;
+
+
+  while (source_offset < size)
+  {
+    bytes = copy_file_range(source_fd,
+                            &source_offset,
+                            fd,
+                            offset,
+                            (size_t)(size - source_offset),
+                            0);
+
+    if (bytes > 0)
+      continue;
+
+    if (bytes == 0)
+      return -1;
+
+    if ((errno != EXDEV) && (errno != ENOSYS) && (errno != EINVAL) && (errno != EOPNOTSUPP))
+      return -1;
+
+    break;
+  }
+
+  while (source_offset < size)
+  {
+    bytes = pread(source_fd,
+                  buffer,
+                  MIN(sizeof(buffer), (size_t)(size - source_offset)),
+                  source_offset);
+
+    if (bytes <= 0)
+      return -1;
+
+    for (written = 0; written < bytes; written += ret)
+    {
+      ret = pwrite(fd, buffer + written, (size_t)(bytes - written), *offset);
+
+      if (ret <= 0)
+        return -1;
+
+      *offset += ret;
+    }
+
+    source_offset += bytes;
+  }
+
+  return 0;
+}
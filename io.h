@@ -20,12 +20,30 @@ enum akwbs_io_type
 
   AKWBS_IO_GET_TYPE,               /*!< Reading from file.                              */
 
-  AKWBS_IO_PUT_TYPE                /*!< Writing to file.                                */
+  AKWBS_IO_PUT_TYPE,               /*!< Writing to file.                                */
+
+  AKWBS_IO_COMPRESS_TYPE,          /*!< Compressing a whole file to memory.             */
+
+  AKWBS_IO_SYNC_TYPE,              /*!< Syncing a written file to disk.                 */
+
+  AKWBS_IO_ASSEMBLE_TYPE,          /*!< Assembling the parts of a multipart upload.     */
+
+  AKWBS_IO_COPY_TYPE,              /*!< Copying a file into an upload.                  */
+
+  AKWBS_IO_ADVISE_TYPE,            /*!< Reading ahead or dropping a file, no result.    */
+
+  AKWBS_IO_OPEN_TYPE,              /*!< Opening the file of a connection.               */
+
+  AKWBS_IO_CLOSE_TYPE,             /*!< Closing descriptors no longer used, no result.  */
+
+  AKWBS_IO_RELEASE_TYPE            /*!< Releasing what an upload opened.                */
 };
 
 /*
  * Public Interface.
  */
 int akwbs_do_io(int fd, void *address, ssize_t *bytes, off_t *offset, int io_type);
+int akwbs_do_io_nowait(int fd, void *address, ssize_t *bytes, off_t *offset, int io_type);
+int akwbs_copy_file(int source_fd, off_t size, int fd, off_t *offset);
 
 #endif
@@ -13,6 +13,7 @@
 #include "daemon.h"
 #include "internal.h"
 #include "connection.h"
+#include "conf.h"
 
 #define AKWBS_INDEX_ARGV_PROGRAM_NAME 0          /*!< Index argv to program name.       */
 
@@ -24,6 +25,8 @@
 
 #define AKWBS_INDEX_ARGC_EXPECTED     4          /*!< Expected number of args in argv.  */
 
+#define AKWBS_INDEX_ARGV_OPTIONS      4          /*!< Index argv to name=value options. */
+
 /*!
  * Check if the params are valid.
  *
@@ -34,7 +37,7 @@
  */
 static int akwbs_check_params(const int argc, char *argv[])
 {
-  if (argc != AKWBS_INDEX_ARGC_EXPECTED)
+  if (argc < AKWBS_INDEX_ARGC_EXPECTED)
     return AKWBS_ERROR;
 
   if (strlen(argv[AKWBS_INDEX_ARGV_ROOT_PATH]) >= PATH_MAX)
@@ -52,13 +55,31 @@ static int akwbs_check_params(const int argc, char *argv[])
 
 int main(int argc, char * argv[])
 {
+  struct akwbs_server_conf conf;
+  int i;
+
+
   if (akwbs_check_params(argc, argv) == AKWBS_ERROR)
+  {
+    akwbs_conf_print_usage(argv[AKWBS_INDEX_ARGV_PROGRAM_NAME]);
     return EXIT_FAILURE;
+  }
+
+  akwbs_conf_set_defaults(&conf);
+
+  conf.root_path = argv[AKWBS_INDEX_ARGV_ROOT_PATH];
+  conf.port      = atol(argv[AKWBS_INDEX_ARGV_PORT]);
+  conf.send_rate = atol(argv[AKWBS_INDEX_ARGV_SPEED_LIMIT]);
 
+  for (i = AKWBS_INDEX_ARGV_OPTIONS; i < argc; i++)
+    if (akwbs_conf_parse_option(&conf, argv[i]) == AKWBS_ERROR)
+    {
+      fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      akwbs_conf_print_usage(argv[AKWBS_INDEX_ARGV_PROGRAM_NAME]);
+      return EXIT_FAILURE;
+    }
 
-  if (akwbs_start_daemon(atol(argv[AKWBS_INDEX_ARGV_PORT]),
-                         argv[AKWBS_INDEX_ARGV_ROOT_PATH],
-                         atol(argv[AKWBS_INDEX_ARGV_SPEED_LIMIT])) == AKWBS_ERROR)
+  if (akwbs_start_daemon(&conf) == AKWBS_ERROR)
     return EXIT_FAILURE;
 
   pthread_exit(NULL);
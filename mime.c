@@ -0,0 +1,135 @@
+/*!
+ * \file   mime.c
+ * \brief  Compile-time table of media types, looked up by file extension.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "internal.h"
+#include "mime.h"
+
+
+#define AKWBS_MIME_EXTENSION_MAX 8  /*!< Longest extension in the table.                */
+
+
+/*!
+ * Build a table entry, with the header line and its length computed at compile time.
+ */
+#define AKWBS_MIME(extension, type, compressible) \
+  { extension, "Content-Type: " type "\r\n", sizeof("Content-Type: " type "\r\n") - 1, compressible }
+
+
+/*!
+ * Media types, sorted by extension so they can be binary searched.
+ */
+static const struct akwbs_mime_type mime_types[] =
+{
+  AKWBS_MIME("7z",    "application/x-7z-compressed",     AKWBS_NO),
+  AKWBS_MIME("avif",  "image/avif",                      AKWBS_NO),
+  AKWBS_MIME("bin",   "application/octet-stream",        AKWBS_NO),
+  AKWBS_MIME("bmp",   "image/bmp",                       AKWBS_NO),
+  AKWBS_MIME("br",    "application/x-brotli",            AKWBS_NO),
+  AKWBS_MIME("bz2",   "application/x-bzip2",             AKWBS_NO),
+  AKWBS_MIME("c",     "text/plain; charset=utf-8",       AKWBS_YES),
+  AKWBS_MIME("conf",  "text/plain; charset=utf-8",       AKWBS_YES),
+  AKWBS_MIME("css",   "text/css; charset=utf-8",         AKWBS_YES),
+  AKWBS_MIME("csv",   "text/csv; charset=utf-8",         AKWBS_YES),
+  AKWBS_MIME("gif",   "image/gif",                       AKWBS_NO),
+  AKWBS_MIME("gz",    "application/gzip",                AKWBS_NO),
+  AKWBS_MIME("h",     "text/plain; charset=utf-8",       AKWBS_YES),
+  AKWBS_MIME("htm",   "text/html; charset=utf-8",        AKWBS_YES),
+  AKWBS_MIME("html",  "text/html; charset=utf-8",        AKWBS_YES),
+  AKWBS_MIME("ico",   "image/vnd.microsoft.icon",        AKWBS_YES),
+  AKWBS_MIME("iso",   "application/x-iso9660-image",     AKWBS_NO),
+  AKWBS_MIME("jpeg",  "image/jpeg",                      AKWBS_NO),
+  AKWBS_MIME("jpg",   "image/jpeg",                      AKWBS_NO),
+  AKWBS_MIME("js",    "text/javascript; charset=utf-8",  AKWBS_YES),
+  AKWBS_MIME("json",  "application/json",                AKWBS_YES),
+  AKWBS_MIME("log",   "text/plain; charset=utf-8",       AKWBS_YES),
+  AKWBS_MIME("md",    "text/markdown; charset=utf-8",    AKWBS_YES),
+  AKWBS_MIME("mjs",   "text/javascript; charset=utf-8",  AKWBS_YES),
+  AKWBS_MIME("mp3",   "audio/mpeg",                      AKWBS_NO),
+  AKWBS_MIME("mp4",   "video/mp4",                       AKWBS_NO),
+  AKWBS_MIME("ndjson","application/x-ndjson",            AKWBS_YES),
+  AKWBS_MIME("pdf",   "application/pdf",                 AKWBS_NO),
+  AKWBS_MIME("png",   "image/png",                       AKWBS_NO),
+  AKWBS_MIME("svg",   "image/svg+xml",                   AKWBS_YES),
+  AKWBS_MIME("tar",   "application/x-tar",               AKWBS_NO),
+  AKWBS_MIME("tgz",   "application/gzip",                AKWBS_NO),
+  AKWBS_MIME("txt",   "text/plain; charset=utf-8",       AKWBS_YES),
+  AKWBS_MIME("wasm",  "application/wasm",                AKWBS_YES),
+  AKWBS_MIME("webm",  "video/webm",                      AKWBS_NO),
+  AKWBS_MIME("webp",  "image/webp",                      AKWBS_NO),
+  AKWBS_MIME("woff",  "font/woff",                       AKWBS_NO),
+  AKWBS_MIME("woff2", "font/woff2",                      AKWBS_NO),
+  AKWBS_MIME("xml",   "application/xml",                 AKWBS_YES),
+  AKWBS_MIME("xz",    "application/x-xz",                AKWBS_NO),
+  AKWBS_MIME("yaml",  "application/yaml",                AKWBS_YES),
+  AKWBS_MIME("yml",   "application/yaml",                AKWBS_YES),
+  AKWBS_MIME("zip",   "application/zip",                 AKWBS_NO),
+  AKWBS_MIME("zst",   "application/zstd",                AKWBS_NO)
+};
+
+
+/*!
+ * Media type of files whose extension is unknown.
+ */
+static const struct akwbs_mime_type default_mime_type =
+  AKWBS_MIME("", "application/octet-stream", AKWBS_NO);
+
+
+/*!
+ * Compare an extension with a table entry, for bsearch.
+ *
+ * \param pa extension being searched.
+ * \param pb table entry.
+ *
+ * \return less, equal or greater than zero, as in strcmp.
+ */
+static int compare_mime_type(const void *pa, const void *pb)
+{
+  return strcmp((const char *)pa, ((const struct akwbs_mime_type *)pb)->extension);
+}
+
+
+/*!
+ * Get the media type of a file, from its extension.
+ *
+ * \param file_name name of the file, NUL terminated.
+ *
+ * \return the media type, application/octet-stream when the extension is unknown.
+ */
+const struct akwbs_mime_type *akwbs_mime_lookup(const char *file_name)
+{
+  char extension[AKWBS_MIME_EXTENSION_MAX + 1];
+  const char *dot                    = strrchr(file_name, '.');
+  const struct akwbs_mime_type *type = NULL;
+  size_t i;
+
+
+  if ((dot == NULL) || (strchr(dot, '/') != NULL))
+    return &default_mime_type;
+
+  for (i = 0; (dot[i + 1] != '\0') && (i < AKWBS_MIME_EXTENSION_MAX); i++)
+    extension[i] = (char)tolower((unsigned char)dot[i + 1]);
+
+  if (dot[i + 1] != '\0')
+    return &default_mime_type;
+
+  extension[i] = '\0';
+
+  type = bsearch(extension,
+                 mime_types,
+                 sizeof(mime_types) / sizeof(mime_types[0]),
+                 sizeof(mime_types[0]),
+                 compare_mime_type);
+
+  if (type == NULL)
+    return &default_mime_type;
+
+  return type;
+}
@@ -0,0 +1,31 @@
+/*!
+ * \file   mime.h
+ * \brief  Media types of the served files.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_MIME_H_
+#define _AKWBS_MT_MIME_H_
+
+#include <stddef.h>
+
+
+/*!
+ * Media type of a file extension. The Content-Type header line is built at compile
+ * time, so it is sent as is.
+ */
+struct akwbs_mime_type
+{
+  const char *extension;        /*!< Lower case extension, without the dot.             */
+  const char *header;           /*!< Complete Content-Type header line.                 */
+  size_t     header_length;     /*!< Length of the header line.                         */
+  int        compressible;      /*!< AKWBS_YES if the content shrinks when compressed.  */
+};
+
+
+/*
+ * Public Interface.
+ */
+const struct akwbs_mime_type *akwbs_mime_lookup(const char *file_name);
+
+#endif /* END OF mime.h */
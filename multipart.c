@@ -0,0 +1,564 @@
+/*!
+ * \file   multipart.c
+ * \brief  Multipart uploads. A client initiates an upload, sends its numbered parts over
+ *         as many connections as it likes, then completes it. Each part is stored as an
+ *         atomic upload of its own in a staging directory; on completion a working
+ *         thread assembles them into the target with copy_file_range, which shares the
+ *         extents instead of copying them on file systems supporting reflinks, and never
+ *         moves the bytes through user space otherwise.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "multipart.h"
+#include "connection.h"
+#include "daemon.h"
+#include "pool.h"
+#include "internal.h"
+#include "io.h"
+
+
+#define AKWBS_MULTIPART_STAGING_NAME_SIZE 32   /*!< Room for a staging directory name. */
+
+#define AKWBS_MULTIPART_PART_NAME_SIZE    16   /*!< Room for a part file name.         */
+
+
+/*!
+ * Check whether a query parameter is exactly the given name.
+ *
+ * \param parameter first byte of the parameter.
+ * \param length length of the parameter.
+ * \param name the name.
+ *
+ * \return AKWBS_YES if it is, AKWBS_NO otherwise.
+ */
+static int is_parameter(const char *parameter, size_t length, const char *name)
+{
+  if ((length != strlen(name)) || (strncmp(parameter, name, length) != 0))
+    return AKWBS_NO;
+
+  return AKWBS_YES;
+}
+
+
+/*!
+ * Check whether a query parameter starts with the given name and its '='.
+ *
+ * \param parameter first byte of the parameter.
+ * \param length length of the parameter.
+ * \param name the name, followed by '='.
+ *
+ * \return AKWBS_YES if it does, AKWBS_NO otherwise.
+ */
+static int has_parameter_prefix(const char *parameter, size_t length, const char *name)
+{
+  if ((length < strlen(name)) || (strncmp(parameter, name, strlen(name)) != 0))
+    return AKWBS_NO;
+
+  return AKWBS_YES;
+}
+
+
+/*!
+ * Parse the number of a part, as its file is named.
+ *
+ * \param text first digit.
+ * \param length number of digits.
+ *
+ * \return the part number, or 0 if it is not a valid one.
+ */
+static unsigned long parse_part_number(const char *text, size_t length)
+{
+  unsigned long number = 0;
+  size_t i;
+
+
+  if ((length == 0) || (length > 5) || (text[0] == '0'))
+    return 0;
+
+  for (i = 0; i < length; i++)
+  {
+    if (! isdigit((unsigned char)text[i]))
+      return 0;
+
+    number = number * 10 + (unsigned long)(text[i] - '0');
+  }
+
+  if (number > AKWBS_MULTIPART_MAX_PARTS)
+    return 0;
+
+  return number;
+}
+
+
+/*!
+ * Name of the staging directory of an upload.
+ *
+ * \param upload_id id of the upload.
+ * \param name param-return room for AKWBS_MULTIPART_STAGING_NAME_SIZE bytes.
+ */
+static void staging_name(const char *upload_id, char *name)
+{
+  snprintf(name, AKWBS_MULTIPART_STAGING_NAME_SIZE, "%s%s", AKWBS_MULTIPART_PREFIX, upload_id);
+}
+
+
+/*!
+ * Create the staging directory of a new upload, under a random id.
+ *
+ * \param directory_descriptor directory of the target.
+ * \param multipart param-return the request, its upload id is set.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR on error, with errno set.
+ */
+static int create_staging(int directory_descriptor, struct akwbs_multipart *multipart)
+{
+  char name[AKWBS_MULTIPART_STAGING_NAME_SIZE];
+  unsigned char random_bytes[AKWBS_MULTIPART_ID_LENGTH / 2];
+  int attempts;
+  size_t i;
+
+
+  for (attempts = 0; attempts < 8; attempts++)
+  {
+    if (getrandom(random_bytes, sizeof(random_bytes), 0) != (ssize_t)sizeof(random_bytes))
+      return AKWBS_ERROR;
+
+    for (i = 0; i < sizeof(random_bytes); i++)
+      snprintf(&multipart->upload_id[2 * i], 3, "%02x", random_bytes[i]);
+
+    staging_name(multipart->upload_id, name);
+
+    if (mkdirat(directory_descriptor, name, S_IRWXU) == AKWBS_SUCCESS)
+      return AKWBS_SUCCESS;
+
+    if (errno != EEXIST)
+      return AKWBS_ERROR;
+  }
+
+  return AKWBS_ERROR;
+}
+
+
+/*!
+ * Remove the staging directory of an upload, with every part in it.
+ *
+ * \param directory_descriptor directory of the target.
+ * \param upload_id id of the upload.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR on error, with errno set.
+ */
+static int remove_staging(int directory_descriptor, const char *upload_id)
+{
+  char name[AKWBS_MULTIPART_STAGING_NAME_SIZE];
+  struct dirent *entry = NULL;
+  DIR *stream          = NULL;
+  int fd               = AKWBS_ERROR;
+
+
+  staging_name(upload_id, name);
+
+  fd = openat(directory_descriptor, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  stream = fdopendir(fd);
+
+  if (stream == NULL)
+  {
+    close(fd);
+    return AKWBS_ERROR;
+  }
+
+  while ((entry = readdir(stream)) != NULL)
+    if ((strcmp(entry->d_name, ".") != 0) && (strcmp(entry->d_name, "..") != 0))
+      unlinkat(fd, entry->d_name, 0);
+
+  closedir(stream);
+
+  return unlinkat(directory_descriptor, name, AT_REMOVEDIR);
+}
+
+
+/*!
+ * Count the parts of an upload being completed. They must be numbered from 1 with no
+ * gap; temporary files of parts still being received are not counted.
+ *
+ * \param multipart param-return request completing the upload, with its staging
+ *        directory opened. Its number of parts is set.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if a part is missing, errno is then ENOENT, or on error.
+ */
+static int count_parts(struct akwbs_multipart *multipart)
+{
+  struct dirent *entry = NULL;
+  DIR *stream          = NULL;
+  unsigned long number = 0;
+  unsigned long count  = 0;
+  int fd               = AKWBS_ERROR;
+
+
+  multipart->number_of_parts = 0;
+
+  fd = fcntl(multipart->staging_descriptor, F_DUPFD_CLOEXEC, 0);
+
+  if (fd == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  stream = fdopendir(fd);
+
+  if (stream == NULL)
+  {
+    close(fd);
+    return AKWBS_ERROR;
+  }
+
+  while ((entry = readdir(stream)) != NULL)
+  {
+    number = parse_part_number(entry->d_name, strlen(entry->d_name));
+
+    if (number == 0)
+      continue;
+
+    count++;
+    multipart->number_of_parts = MAX(multipart->number_of_parts, number);
+  }
+
+  closedir(stream);
+
+  if ((count == 0) || (count != multipart->number_of_parts))
+  {
+    errno = ENOENT;
+    return AKWBS_ERROR;
+  }
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Recognize a multipart request by its query string. Unknown parameters are ignored,
+ * so a plain PUT may still carry a query.
+ *
+ * \param connection connection holding a parsed PUT request, its body length known.
+ *
+ * \return AKWBS_SUCCESS on success, or the HTTP status code to reply.
+ */
+int akwbs_multipart_parse_query(struct akwbs_connection *connection)
+{
+  struct akwbs_multipart *multipart = &connection->multipart;
+  struct akwbs_http_slice *query    = &connection->request.query;
+  enum akwbs_multipart_action action = AKWBS_MULTIPART_NONE;
+  char *cursor = query->data;
+  char *end    = query->data + query->length;
+  char *next   = NULL;
+  size_t length = 0;
+  int has_id    = AKWBS_NO;
+  size_t i;
+
+
+  multipart->action             = AKWBS_MULTIPART_NONE;
+  multipart->state              = AKWBS_MULTIPART_NOT_ASSEMBLED;
+  multipart->upload_id[0]       = '\0';
+  multipart->part_number        = 0;
+  multipart->number_of_parts    = 0;
+  multipart->staging_descriptor = AKWBS_ERROR;
+
+  for (; cursor < end; cursor = next + 1)
+  {
+    next = memchr(cursor, '&', (size_t)(end - cursor));
+
+    if (next == NULL)
+      next = end;
+
+    length = (size_t)(next - cursor);
+
+    if (has_parameter_prefix(cursor, length, "uploadId=") == AKWBS_YES)
+    {
+      cursor += strlen("uploadId=");
+      length -= strlen("uploadId=");
+
+      if ((has_id == AKWBS_YES) || (length != AKWBS_MULTIPART_ID_LENGTH))
+        return 400;
+
+      for (i = 0; i < length; i++)
+        if (! isxdigit((unsigned char)cursor[i]) || isupper((unsigned char)cursor[i]))
+          return 400;
+
+      memcpy(multipart->upload_id, cursor, length);
+      multipart->upload_id[length] = '\0';
+      has_id = AKWBS_YES;
+      continue;
+    }
+
+    if ((action != AKWBS_MULTIPART_NONE)
+        && ((is_parameter(cursor, length, "uploads") == AKWBS_YES)
+            || (is_parameter(cursor, length, "complete") == AKWBS_YES)
+            || (is_parameter(cursor, length, "abort") == AKWBS_YES)
+            || (has_parameter_prefix(cursor, length, "partNumber=") == AKWBS_YES)))
+      return 400;
+
+    if (is_parameter(cursor, length, "uploads") == AKWBS_YES)
+      action = AKWBS_MULTIPART_INITIATE;
+    else if (is_parameter(cursor, length, "complete") == AKWBS_YES)
+      action = AKWBS_MULTIPART_COMPLETE;
+    else if (is_parameter(cursor, length, "abort") == AKWBS_YES)
+      action = AKWBS_MULTIPART_ABORT;
+    else if (has_parameter_prefix(cursor, length, "partNumber=") == AKWBS_YES)
+    {
+      action                 = AKWBS_MULTIPART_PART;
+      multipart->part_number = parse_part_number(cursor + strlen("partNumber="),
+                                                 length - strlen("partNumber="));
+
+      if (multipart->part_number == 0)
+        return 400;
+    }
+  }
+
+  if (action == AKWBS_MULTIPART_NONE)
+    return (has_id == AKWBS_YES) ? 400 : AKWBS_SUCCESS;
+
+  if ((action == AKWBS_MULTIPART_INITIATE) == (has_id == AKWBS_YES))
+    return 400;
+
+  /* Only parts have a body, and they are sent whole. */
+  if ((action != AKWBS_MULTIPART_PART)
+      && ((connection->is_chunked == AKWBS_YES) || (connection->file_total_offset != 0)))
+    return 400;
+
+  if (connection->upload.is_ranged == AKWBS_YES)
+    return 400;
+
+  multipart->action = action;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Initiate or abort an upload, and reply. Neither has a body.
+ *
+ * \param connection connection holding an initiate or abort request.
+ */
+void akwbs_multipart_control(struct akwbs_connection *connection)
+{
+  struct akwbs_multipart *multipart = &connection->multipart;
+  int fd = connection->client_socket;
+  char reply[128];
+  int length = 0;
+
+
+  if (akwbs_upload_open_directory(connection) == AKWBS_ERROR)
+    send(fd, AKWBS_HTTP_404, AKWBS_STRLEN(AKWBS_HTTP_404), 0);
+  else if (multipart->action == AKWBS_MULTIPART_INITIATE)
+  {
+    if (create_staging(connection->upload.directory_descriptor, multipart) == AKWBS_SUCCESS)
+    {
+      length = snprintf(reply,
+                        sizeof(reply),
+                        "%sUpload-Id: %s\r\n\r\n",
+                        AKWBS_HTTP_201_LINE,
+                        multipart->upload_id);
+      send(fd, reply, (size_t)length, 0);
+    }
+    else if ((errno == ENOSPC) || (errno == EDQUOT))
+      send(fd, AKWBS_HTTP_507, AKWBS_STRLEN(AKWBS_HTTP_507), 0);
+    else
+      send(fd, AKWBS_HTTP_500, AKWBS_STRLEN(AKWBS_HTTP_500), 0);
+  }
+  else if (remove_staging(connection->upload.directory_descriptor,
+                          multipart->upload_id) == AKWBS_SUCCESS)
+    send(fd, AKWBS_HTTP_204, AKWBS_STRLEN(AKWBS_HTTP_204), 0);
+  else if (errno == ENOENT)
+    send(fd, AKWBS_HTTP_404, AKWBS_STRLEN(AKWBS_HTTP_404), 0);
+  else
+    send(fd, AKWBS_HTTP_500, AKWBS_STRLEN(AKWBS_HTTP_500), 0);
+
+  akwbs_upload_release(connection);
+}
+
+
+/*!
+ * Prepare the upload of a multipart request, once the directory of its target is open.
+ * A part is uploaded under its number, in the staging directory; a completion opens the
+ * staging directory and checks that every part is there.
+ *
+ * \param connection connection holding a PUT request.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on error, errno is then ENOENT for an unknown upload or missing part.
+ */
+int akwbs_multipart_open(struct akwbs_connection *connection)
+{
+  struct akwbs_multipart *multipart = &connection->multipart;
+  struct akwbs_upload *upload       = &connection->upload;
+  char name[AKWBS_MULTIPART_STAGING_NAME_SIZE];
+  int staging_descriptor = AKWBS_ERROR;
+
+
+  if (multipart->action == AKWBS_MULTIPART_NONE)
+    return AKWBS_SUCCESS;
+
+  staging_name(multipart->upload_id, name);
+
+  staging_descriptor = openat(upload->directory_descriptor,
+                              name,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (staging_descriptor == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  if (multipart->action == AKWBS_MULTIPART_COMPLETE)
+  {
+    multipart->staging_descriptor = staging_descriptor;
+    return count_parts(multipart);
+  }
+
+  /* A part is an upload of its own, named after its number, in the staging directory. */
+  close(upload->directory_descriptor);
+  upload->directory_descriptor = staging_descriptor;
+
+  snprintf(name, sizeof(name), "%lu", multipart->part_number);
+
+  free(upload->target_name);
+  upload->target_name = strdup(name);
+
+  if (upload->target_name == NULL)
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Hand the assembly of a completed upload to a working thread. If the request queue is
+ * full, nothing is changed and the assembly is tried again later.
+ *
+ * \param connection connection completing an upload, its upload file opened.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR if the request could not be queued.
+ */
+int akwbs_multipart_start_assembly(struct akwbs_connection *connection)
+{
+  struct akwbs_request_io_msg msg;
+
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.sd           = connection->client_socket;
+  msg.fd           = connection->file_descriptor;
+  msg.directory_fd = connection->multipart.staging_descriptor;
+  msg.bytes        = (ssize_t)connection->multipart.number_of_parts;
+  msg.type         = AKWBS_IO_ASSEMBLE_TYPE;
+  msg.connection   = connection;
+
+  if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  connection->multipart.state   = AKWBS_MULTIPART_ASSEMBLING;
+  connection->is_waiting_result = AKWBS_YES;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Assemble the parts of an upload into its file, in order. Called by working threads.
+ *
+ * \param msg param-return request whose bytes are the number of parts. On return, its
+ *        bytes are the size of the assembled file, or AKWBS_ERROR on error.
+ */
+void akwbs_multipart_assemble(struct akwbs_request_io_msg *msg)
+{
+  unsigned long number_of_parts = (unsigned long)msg->bytes;
+  char name[AKWBS_MULTIPART_PART_NAME_SIZE];
+  struct stat stat_buf;
+  off_t offset = 0;
+  int part     = AKWBS_ERROR;
+  int ret      = AKWBS_SUCCESS;
+  unsigned long i;
+
+
+  msg->bytes = AKWBS_ERROR;
+
+  for (i = 1; (i <= number_of_parts) && (ret == AKWBS_SUCCESS); i++)
+  {
+    snprintf(name, sizeof(name), "%lu", i);
+
+    part = openat(msg->directory_fd, name, O_RDONLY | O_CLOEXEC);
+
+    if (part == AKWBS_ERROR)
+      return;
+
+    ret = fstat(part, &stat_buf);
+
+    if (ret == AKWBS_SUCCESS)
+      ret = akwbs_copy_file(part, stat_buf.st_size, msg->fd, &offset);
+
+    close(part);
+  }
+
+  if (ret == AKWBS_SUCCESS)
+    msg->bytes = (ssize_t)offset;
+}
+
+
+/*!
+ * Account a finished assembly. Called by the daemon thread, with the result sent by the
+ * working thread.
+ *
+ * \param connection connection completing the upload.
+ * \param result result of the assembly.
+ */
+void akwbs_multipart_assembled(struct akwbs_connection *connection,
+                               struct akwbs_result_io *result)
+{
+  if ((ssize_t)result->bytes_read == AKWBS_ERROR)
+    connection->multipart.state = AKWBS_MULTIPART_FAILED;
+  else
+    connection->multipart.state = AKWBS_MULTIPART_ASSEMBLED;
+
+  connection->is_waiting_result = AKWBS_NO;
+}
+
+
+/*!
+ * Release the resources of a multipart request. Once an upload is published, its parts
+ * are removed; otherwise they are kept, so a failed completion can be tried again.
+ * Must be called before the upload itself is released.
+ *
+ * \param connection connection being closed.
+ */
+void akwbs_multipart_release(struct akwbs_connection *connection)
+{
+  struct akwbs_multipart *multipart = &connection->multipart;
+
+
+  if (multipart->staging_descriptor != AKWBS_ERROR)
+    close(multipart->staging_descriptor);
+
+  multipart->staging_descriptor = AKWBS_ERROR;
+
+  if ((multipart->action == AKWBS_MULTIPART_COMPLETE)
+      && (connection->upload.is_published == AKWBS_YES)
+      && (connection->upload.directory_descriptor != AKWBS_ERROR))
+    remove_staging(connection->upload.directory_descriptor, multipart->upload_id);
+
+  multipart->action = AKWBS_MULTIPART_NONE;
+}
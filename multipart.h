@@ -0,0 +1,93 @@
+/*!
+ * \file   multipart.h
+ * \brief  Multipart uploads: parts sent in parallel, assembled by the server.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_MULTIPART_H_
+#define _AKWBS_MT_MULTIPART_H_
+
+#include "requestio.h"
+#include "resultio.h"
+
+
+#define AKWBS_MULTIPART_ID_LENGTH  16     /*!< Hexadecimal digits of an upload id.       */
+
+#define AKWBS_MULTIPART_MAX_PARTS  10000  /*!< Greatest part number.                     */
+
+#define AKWBS_MULTIPART_PREFIX     ".akwbs-mp-" /*!< Name of staging directories.        */
+
+
+struct akwbs_connection;
+
+
+/*!
+ * Multipart requests, told apart by their query string.
+ */
+enum akwbs_multipart_action
+{
+  AKWBS_MULTIPART_NONE = 0,     /*!< Not a multipart request.                           */
+
+  AKWBS_MULTIPART_INITIATE,     /*!< "?uploads": create an upload, reply its id.        */
+
+  AKWBS_MULTIPART_PART,         /*!< "?uploadId=I&partNumber=N": store part N.          */
+
+  AKWBS_MULTIPART_COMPLETE,     /*!< "?uploadId=I&complete": assemble the parts.        */
+
+  AKWBS_MULTIPART_ABORT         /*!< "?uploadId=I&abort": discard the parts.            */
+};
+
+
+/*!
+ * States of the assembly of a completed upload.
+ */
+enum akwbs_multipart_state
+{
+  AKWBS_MULTIPART_NOT_ASSEMBLED = 0, /*!< The parts have not been assembled yet.        */
+
+  AKWBS_MULTIPART_ASSEMBLING,        /*!< A working thread is assembling the parts.     */
+
+  AKWBS_MULTIPART_ASSEMBLED,         /*!< The parts are assembled in the upload file.   */
+
+  AKWBS_MULTIPART_FAILED             /*!< The assembly failed.                          */
+};
+
+
+/*!
+ * A multipart request. The parts of an upload are stored, as atomic uploads of their
+ * own, in a hidden staging directory next to the target, so they share its file system
+ * and can be assembled without being copied through user space.
+ */
+struct akwbs_multipart
+{
+  enum akwbs_multipart_action
+    action;                     /*!< What the request does.                             */
+
+  enum akwbs_multipart_state
+    state;                      /*!< State of the assembly, when completing.            */
+
+  char upload_id
+    [AKWBS_MULTIPART_ID_LENGTH + 1]; /*!< Id of the upload.                              */
+
+  unsigned long part_number;    /*!< Number of the part sent.                           */
+
+  unsigned long
+    number_of_parts;            /*!< Number of parts to assemble, when completing.      */
+
+  int staging_descriptor;       /*!< Staging directory, when completing, or -1.         */
+};
+
+
+/*
+ * Public Interface.
+ */
+int akwbs_multipart_parse_query(struct akwbs_connection *connection);
+void akwbs_multipart_control(struct akwbs_connection *connection);
+int akwbs_multipart_open(struct akwbs_connection *connection);
+int akwbs_multipart_start_assembly(struct akwbs_connection *connection);
+void akwbs_multipart_assemble(struct akwbs_request_io_msg *msg);
+void akwbs_multipart_assembled(struct akwbs_connection *connection,
+                               struct akwbs_result_io *result);
+void akwbs_multipart_release(struct akwbs_connection *connection);
+
+#endif /* END OF multipart.h */
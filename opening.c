@@ -0,0 +1,493 @@
+/*!
+ * \file   opening.c
+ * \brief  Opening and closing of the files of connections. stat, open and close may
+ *         block for long on a cold dentry cache or a network file system, and the
+ *         event loop would freeze every connection meanwhile. So a connection whose
+ *         request is processed hands the opening of its file to a working thread, and
+ *         waits in AKWBS_CONNECTION_OPENING, out of the descriptor sets, until it is
+ *         done; the event loop then only shares the file with its other readers. The
+ *         descriptors it no longer needs are closed by the working threads too, and what
+ *         an upload opened is released by them.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "opening.h"
+#include "connection.h"
+#include "daemon.h"
+#include "direct.h"
+#include "http.h"
+#include "internal.h"
+#include "mime.h"
+#include "multipart.h"
+#include "copy.h"
+#include "pool.h"
+#include "readahead.h"
+#include "upload.h"
+
+
+/*!
+ * Precompressed sidecars that may be sent instead of a file, in order of preference.
+ */
+static const struct
+{
+  enum akwbs_http_encoding encoding;   /*!< Content coding of the sidecar.              */
+  const char *coding;                  /*!< Name of the coding, as in Accept-Encoding.  */
+  const char *suffix;                  /*!< Suffix added to the file name.              */
+} sidecars[] =
+{
+  { AKWBS_HTTP_ENCODING_BR,   "br",   ".br" },
+  { AKWBS_HTTP_ENCODING_GZIP, "gzip", ".gz" }
+};
+
+
+static void make_real_file_path(char *root_path, char *file_name, char *real_path)
+{
+  char *index = root_path;
+  int i = 0;
+
+
+  while (*index != '\0')
+  {
+    real_path[i] = *index;
+    i++;
+    index++;
+  }
+
+  index = file_name;
+
+  while (*index != '\0')
+  {
+    real_path[i] = *index;
+    i++;
+    index++;
+  }
+
+  real_path[i] = '\0';
+}
+
+
+/*!
+ * Find the representation of the requested file to be sent. For a compressible media
+ * type, a precompressed sidecar is preferred when the client accepts its coding.
+ *
+ * \param connection connection requesting the file.
+ * \param real_path param-return path of the requested file, replaced by the path of the
+ *        chosen representation.
+ * \param stat_buf param-return status of the chosen representation.
+ *
+ * \return AKWBS_SUCCESS on success, AKWBS_ERROR if the file does not exist, or is not a
+ *         regular file.
+ */
+static int stat_representation(struct akwbs_connection *connection,
+                               char *real_path,
+                               struct stat *stat_buf)
+{
+  size_t length = strlen(real_path);
+  unsigned int i;
+
+
+  connection->mime_type        = akwbs_mime_lookup(connection->file_name);
+  connection->content_encoding = AKWBS_HTTP_ENCODING_IDENTITY;
+
+  if (connection->mime_type->compressible == AKWBS_YES)
+    for (i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++)
+    {
+      if ((length + strlen(sidecars[i].suffix) >= PATH_MAX)
+          || (akwbs_http_accepts_encoding(&connection->request,
+                                          sidecars[i].coding) == AKWBS_NO))
+        continue;
+
+      strcpy(real_path + length, sidecars[i].suffix);
+
+      if ((stat(real_path, stat_buf) == AKWBS_SUCCESS) && S_ISREG(stat_buf->st_mode))
+      {
+        connection->content_encoding = sidecars[i].encoding;
+        return AKWBS_SUCCESS;
+      }
+
+      real_path[length] = '\0';
+    }
+
+  if (stat(real_path, stat_buf) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  /* A directory would open, and its reads fail only once the 200 is sent. */
+  if (! S_ISREG(stat_buf->st_mode))
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Open the representation of the file requested by a GET, and decide whether it is read
+ * directly. Called by working threads.
+ *
+ * \param connection connection holding a GET request.
+ *
+ * \return AKWBS_SUCCESS on success, the connection file descriptor is then set.
+ *         AKWBS_ERROR on error.
+ *
+ * \details The status kept is the one of the file opened, even if its path was replaced
+ *          since it was found.
+ */
+static int open_for_reading(struct akwbs_connection *connection)
+{
+  struct akwbs_opening *opening = &connection->opening;
+  char real_path[PATH_MAX];
+
+
+  make_real_file_path(connection->daemon_ref->root_path,
+                      connection->file_name,
+                      real_path);
+
+  if (stat_representation(connection, real_path, &opening->stat_buf) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  connection->file_descriptor = open(real_path, O_RDONLY | O_NONBLOCK);
+
+  if (connection->file_descriptor == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  /* The path may have been replaced by a directory since its status was taken. */
+  if ((fstat(connection->file_descriptor, &opening->stat_buf) == AKWBS_ERROR)
+      || (! S_ISREG(opening->stat_buf.st_mode)))
+  {
+    close(connection->file_descriptor);
+    connection->file_descriptor = AKWBS_ERROR;
+    return AKWBS_ERROR;
+  }
+
+  akwbs_readahead_own(connection->daemon_ref, connection->file_descriptor);
+  akwbs_direct_open(connection);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Open the target of a PUT or COPY, with its directory and the source of a copy or the
+ * parts of a multipart upload. Called by working threads.
+ *
+ * \param connection connection holding a PUT or COPY request.
+ *
+ * \return AKWBS_SUCCESS on success, the connection file descriptor is then set.
+ *         AKWBS_ERROR on error, errno is then ENOSPC or EDQUOT if space is insufficient.
+ */
+static int open_for_writing(struct akwbs_connection *connection)
+{
+  if ((akwbs_upload_open_directory(connection) == AKWBS_ERROR)
+      || (akwbs_multipart_open(connection) == AKWBS_ERROR)
+      || (akwbs_copy_open(connection) == AKWBS_ERROR)
+      || (akwbs_upload_open_file(connection) == AKWBS_ERROR)
+      || (fstat(connection->file_descriptor, &connection->opening.stat_buf) == AKWBS_ERROR))
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Hand the opening of the file of a connection to a working thread, once its request is
+ * processed. The connection is left out of the descriptor sets until it is done. If the
+ * request queue is full, nothing is changed and the opening is tried again later.
+ *
+ * \param connection connection whose request is processed.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR if the request could not be queued.
+ */
+int akwbs_opening_start(struct akwbs_connection *connection)
+{
+  struct akwbs_request_io_msg msg;
+
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.sd           = connection->client_socket;
+  msg.fd           = AKWBS_ERROR;
+  msg.type         = AKWBS_IO_OPEN_TYPE;
+  msg.directory_fd = AKWBS_ERROR;
+  msg.source_fd    = AKWBS_ERROR;
+  msg.connection   = connection;
+
+  akwbs_pool_route_opening(connection);
+
+  if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  FD_CLR(connection->client_socket, &connection->daemon_ref->master_read_set);
+  FD_CLR(connection->client_socket, &connection->daemon_ref->master_write_set);
+
+  connection->is_waiting_result = AKWBS_YES;
+  connection->connection_state  = AKWBS_CONNECTION_OPENING;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Open the file of a connection, or initiate or abort its multipart upload, which
+ * replies at once. Called by working threads; the event loop leaves the connection
+ * alone meanwhile. On failure, what was opened is released.
+ *
+ * \param msg request of the opening; its bytes are set to the status.
+ */
+void akwbs_opening_open_run(struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_connection *connection = msg->connection;
+  struct akwbs_opening *opening       = &connection->opening;
+
+
+  opening->error = 0;
+
+  if ((connection->io_type == AKWBS_IO_PUT_TYPE)
+      && ((connection->multipart.action == AKWBS_MULTIPART_INITIATE)
+          || (connection->multipart.action == AKWBS_MULTIPART_ABORT)))
+  {
+    akwbs_multipart_control(connection);
+    msg->bytes = AKWBS_SUCCESS;
+    return;
+  }
+
+  if (connection->io_type == AKWBS_IO_GET_TYPE)
+    msg->bytes = open_for_reading(connection);
+  else if (connection->io_type == AKWBS_IO_PUT_TYPE)
+    msg->bytes = open_for_writing(connection);
+  else
+    msg->bytes = AKWBS_ERROR;
+
+  if (msg->bytes == AKWBS_SUCCESS)
+    return;
+
+  opening->error = errno;
+
+  if (connection->io_type == AKWBS_IO_PUT_TYPE)
+  {
+    akwbs_multipart_release(connection);
+    akwbs_copy_release(connection);
+    akwbs_upload_release(connection);
+  }
+}
+
+
+/*!
+ * Take the result of the opening of the file of a connection. The connection goes back
+ * into the descriptor sets, and goes on with its request.
+ *
+ * \param connection connection opening its file.
+ * \param result the result.
+ */
+void akwbs_opening_complete(struct akwbs_connection *connection,
+                            struct akwbs_result_io *result)
+{
+  connection->opening.status    = ((ssize_t)result->bytes_read == AKWBS_ERROR)
+                                  ? AKWBS_ERROR : AKWBS_SUCCESS;
+  connection->is_waiting_result = AKWBS_NO;
+
+  if (connection->io_type == AKWBS_IO_PUT_TYPE)
+    FD_SET(connection->client_socket, &connection->daemon_ref->master_read_set);
+  else
+    FD_SET(connection->client_socket, &connection->daemon_ref->master_write_set);
+}
+
+
+/*!
+ * Queue the closing of descriptors to a working thread.
+ *
+ * \param connection connection that used them.
+ * \param fd descriptor to close.
+ * \param other_fd another descriptor to close, or -1.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR if the request queue is full.
+ */
+static int submit_close(struct akwbs_connection *connection, int fd, int other_fd)
+{
+  struct akwbs_request_io_msg msg;
+
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.sd           = connection->client_socket;
+  msg.fd           = fd;
+  msg.type         = AKWBS_IO_CLOSE_TYPE;
+  msg.directory_fd = AKWBS_ERROR;
+  msg.source_fd    = other_fd;
+
+  return akwbs_pool_submit(connection, &msg);
+}
+
+
+/*!
+ * Hand the closing of descriptors a connection no longer needs to a working thread. If
+ * the request queue is full, the closing is kept with the connection, and queued again
+ * by its cleanup: closing a file may block, never the event loop.
+ *
+ * \param connection connection that used them.
+ * \param fd descriptor to close.
+ * \param other_fd another descriptor to close, or -1.
+ */
+void akwbs_opening_close(struct akwbs_connection *connection, int fd, int other_fd)
+{
+  struct akwbs_opening *opening = &connection->opening;
+
+
+  if (submit_close(connection, fd, other_fd) == AKWBS_SUCCESS)
+    return;
+
+  opening->closings[opening->closings_count].fd       = fd;
+  opening->closings[opening->closings_count].other_fd = other_fd;
+  opening->closings_count++;
+}
+
+
+/*!
+ * Close the descriptors of a closing request. Called by working threads.
+ *
+ * \param msg request of the closing.
+ */
+void akwbs_opening_close_run(struct akwbs_request_io_msg *msg)
+{
+  close(msg->fd);
+
+  if (msg->source_fd != AKWBS_ERROR)
+    close(msg->source_fd);
+}
+
+
+/*!
+ * Release what the upload of a closed connection opened, removing an unpublished
+ * temporary file, and the parts of a published multipart upload. A working thread does
+ * it, and the connection is kept until then; if the request queue is full, the release
+ * is queued again by the cleanup of the connection.
+ *
+ * \param connection connection whose upload ended, complete or not.
+ */
+void akwbs_opening_release(struct akwbs_connection *connection)
+{
+  struct akwbs_request_io_msg msg;
+
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.sd           = connection->client_socket;
+  msg.fd           = AKWBS_ERROR;
+  msg.type         = AKWBS_IO_RELEASE_TYPE;
+  msg.directory_fd = AKWBS_ERROR;
+  msg.source_fd    = AKWBS_ERROR;
+  msg.connection   = connection;
+
+  /* Its socket is closed, and may be reused: the result comes back to the connection. */
+  msg.address      = connection;
+
+  if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+  {
+    connection->opening.is_release_pending = AKWBS_YES;
+    return;
+  }
+
+  connection->opening.is_release_pending = AKWBS_NO;
+  connection->opening.is_releasing       = AKWBS_YES;
+}
+
+
+/*!
+ * Release what the upload of a releasing request opened. Called by working threads.
+ *
+ * \param msg request of the releasing.
+ */
+void akwbs_opening_release_run(struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_connection *connection = msg->connection;
+
+
+  akwbs_multipart_release(connection);
+  akwbs_copy_release(connection);
+  akwbs_upload_release(connection);
+}
+
+
+/*!
+ * Take the result of the releasing of an upload. The connection may now be freed.
+ *
+ * \param connection connection whose upload was released.
+ */
+void akwbs_opening_released(struct akwbs_connection *connection)
+{
+  connection->opening.is_releasing = AKWBS_NO;
+}
+
+
+/*!
+ * Queue again the closings and the release a closed connection could not queue. Called
+ * by the cleanup of connections, once nothing of the connection is in flight.
+ *
+ * \param connection the closed connection.
+ *
+ * \return AKWBS_YES if some of them are still not queued, or the release was queued
+ *         now: the connection is kept. AKWBS_NO otherwise.
+ */
+int akwbs_opening_retry(struct akwbs_connection *connection)
+{
+  struct akwbs_opening *opening = &connection->opening;
+  struct akwbs_opening_closing *closing = NULL;
+
+
+  while (opening->closings_count > 0)
+  {
+    closing = &opening->closings[opening->closings_count - 1];
+
+    if (submit_close(connection, closing->fd, closing->other_fd) == AKWBS_ERROR)
+      return AKWBS_YES;
+
+    opening->closings_count--;
+  }
+
+  if (opening->is_release_pending == AKWBS_NO)
+    return AKWBS_NO;
+
+  akwbs_opening_release(connection);
+
+  return AKWBS_YES;
+}
+
+
+/*!
+ * Do the closings and the release a connection could not queue, at once. Called when
+ * the working threads are stopped, and the connections freed.
+ *
+ * \param connection the connection.
+ */
+void akwbs_opening_finish(struct akwbs_connection *connection)
+{
+  struct akwbs_opening *opening = &connection->opening;
+  struct akwbs_request_io_msg msg;
+
+
+  for (; opening->closings_count > 0; opening->closings_count--)
+  {
+    bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+    msg.fd        = opening->closings[opening->closings_count - 1].fd;
+    msg.source_fd = opening->closings[opening->closings_count - 1].other_fd;
+
+    akwbs_opening_close_run(&msg);
+  }
+
+  if (opening->is_release_pending == AKWBS_NO)
+    return;
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  msg.connection = connection;
+
+  akwbs_opening_release_run(&msg);
+
+  opening->is_release_pending = AKWBS_NO;
+}
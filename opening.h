@@ -0,0 +1,75 @@
+/*!
+ * \file   opening.h
+ * \brief  Opening and closing of the files of connections, by the working threads.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_OPENING_H_
+#define _AKWBS_MT_OPENING_H_
+
+#include <sys/stat.h>
+
+#include "requestio.h"
+#include "resultio.h"
+
+
+struct akwbs_connection;
+
+
+#define AKWBS_OPENING_MAX_CLOSINGS 2 /*!< Closings of a connection: those of its opening,
+                                      *   and those of its file once released.
+                                      */
+
+
+/*!
+ * Descriptors to close, whose closing could not be queued yet.
+ */
+struct akwbs_opening_closing
+{
+  int fd;                       /*!< Descriptor to close.                               */
+  int other_fd;                 /*!< Another descriptor to close, or -1.                */
+};
+
+
+/*!
+ * Opening of the file of a connection.
+ */
+struct akwbs_opening
+{
+  struct stat stat_buf;         /*!< Status of the file opened, from its descriptor.    */
+
+  int status;                   /*!< AKWBS_SUCCESS once opened, AKWBS_ERROR if it could
+                                 *   not be.
+                                 */
+
+  int error;                    /*!< errno of the failure, such as ENOSPC, or 0.        */
+
+  int is_releasing;             /*!< A working thread releases what the upload opened;
+                                 *   the connection is not freed until it is done.
+                                 */
+
+  int is_release_pending;       /*!< The release could not be queued yet.               */
+
+  struct akwbs_opening_closing
+    closings[AKWBS_OPENING_MAX_CLOSINGS]; /*!< Closings not queued yet.                 */
+
+  unsigned int closings_count;  /*!< Closings not queued yet, in closings.              */
+};
+
+
+/*
+ * Public Interface.
+ */
+int akwbs_opening_start(struct akwbs_connection *connection);
+void akwbs_opening_open_run(struct akwbs_request_io_msg *msg);
+void akwbs_opening_complete(struct akwbs_connection *connection,
+                            struct akwbs_result_io *result);
+void akwbs_opening_close(struct akwbs_connection *connection, int fd, int other_fd);
+void akwbs_opening_close_run(struct akwbs_request_io_msg *msg);
+void akwbs_opening_release(struct akwbs_connection *connection);
+void akwbs_opening_release_run(struct akwbs_request_io_msg *msg);
+void akwbs_opening_released(struct akwbs_connection *connection);
+int akwbs_opening_retry(struct akwbs_connection *connection);
+void akwbs_opening_finish(struct akwbs_connection *connection);
+
+#endif /* END OF opening.h */
@@ -0,0 +1,281 @@
+/*!
+ * \file   pipeline.c
+ * \brief  Pipelined reads of downloads. With one read in flight, a download alternates
+ *         between waiting on the disk and waiting on the socket, and cannot go faster
+ *         than a read per disk latency. Here a connection keeps up to read_depth reads
+ *         in flight, each into its own region of the ring buffer, handed to different
+ *         working threads; their results are applied in file order, as they complete.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "pipeline.h"
+#include "connection.h"
+#include "daemon.h"
+#include "pool.h"
+#include "internal.h"
+#include "ringbuffer.h"
+#include "io.h"
+#include "direct.h"
+#include "readahead.h"
+
+
+/*!
+ * Read the next bytes of a download on the event loop itself, as far as they are in the
+ * page cache, into all the free room of the buffer. A request to a working thread costs
+ * far more than copying cached bytes.
+ *
+ * \param connection connection sending a file, with no read in flight.
+ *
+ * \return AKWBS_YES if the read was complete, AKWBS_NO if the rest is left to the working
+ *         threads.
+ */
+static int read_inline(struct akwbs_connection *connection)
+{
+  struct akwbs_io_pool *pool = connection->io_group->pool;
+  ssize_t bytes = 0;
+  off_t offset  = connection->file_cur_offset;
+
+
+  /* A miss would start readahead, filling the cache a direct read is meant to spare. */
+  if ((pool->is_inline_read == AKWBS_NO) || (connection->direct_descriptor != AKWBS_ERROR))
+    return AKWBS_NO;
+
+  bytes = (ssize_t)MIN(ring_buffer_count_free_bytes(&connection->buffer),
+                       (size_t)(connection->file_total_offset - offset));
+
+  if (bytes <= 0)
+    return AKWBS_NO;
+
+  if (akwbs_do_io_nowait(connection->file_descriptor,
+                         ring_buffer_write_address(&connection->buffer),
+                         &bytes,
+                         &offset,
+                         AKWBS_IO_GET_TYPE) == AKWBS_ERROR)
+  {
+    pool->is_inline_read = AKWBS_NO;
+    return AKWBS_NO;
+  }
+
+  ring_buffer_write_advance(&connection->buffer, (size_t)bytes);
+  connection->file_cur_offset = offset;
+
+  if ((ring_buffer_count_free_bytes(&connection->buffer) == 0)
+      || (connection->file_cur_offset >= connection->file_total_offset))
+    return AKWBS_YES;
+
+  return AKWBS_NO;
+}
+
+
+/*!
+ * Order of the ring buffer of the connections: room for read_depth full reads, and
+ * never less than before reads were pipelined.
+ *
+ * \param depth reads in flight per connection.
+ *
+ * \return the order, log2 of the size of the buffer.
+ */
+size_t akwbs_pipeline_buffer_order(unsigned long depth)
+{
+  size_t order = AKWBS_PIPELINE_MIN_ORDER;
+
+
+  while ((1UL << order) < depth * AKWBS_PIPELINE_READ_SIZE)
+    order++;
+
+  return order;
+}
+
+
+/*!
+ * Hand the next reads of a download to the working threads, until read_depth of them
+ * are in flight, the buffer is full, or the file is all asked for. A read that would not
+ * be full waits for more room, unless it is the only one or the last of the file. If a
+ * request queue is full, the reads are tried again later.
+ *
+ * \param connection connection sending a file, not compressed.
+ *
+ * \details With no read in flight, the cached bytes are read inline first, and only the
+ *          rest, from the first byte not cached on, is asked of the working threads.
+ */
+void akwbs_pipeline_submit(struct akwbs_connection *connection)
+{
+  struct akwbs_pipeline *pipeline = &connection->pipeline;
+  struct akwbs_pipeline_read *read = NULL;
+  struct akwbs_request_io_msg msg;
+  size_t free_bytes = 0;
+  size_t bytes    = 0;
+  size_t io_bytes = 0;
+  off_t offset = 0;
+  void *address = NULL;
+  int fd = AKWBS_ERROR;
+
+
+  if (pipeline->is_broken == AKWBS_YES)
+    return;
+
+  /* An empty buffer starts again at the alignment of the file offset, for direct reads. */
+  if ((connection->direct_descriptor != AKWBS_ERROR)
+      && (pipeline->count == 0)
+      && (ring_buffer_count_bytes(&connection->buffer) == 0))
+    ring_buffer_clear_at(&connection->buffer,
+                         (size_t)(connection->file_cur_offset % AKWBS_DIRECT_ALIGN));
+
+  if ((pipeline->count == 0) && (read_inline(connection) == AKWBS_YES))
+  {
+    akwbs_readahead_submit(connection);
+    return;
+  }
+
+  free_bytes = ring_buffer_count_free_bytes(&connection->buffer);
+
+  while ((pipeline->count < connection->daemon_ref->read_depth)
+         && (pipeline->is_discarding == AKWBS_NO)
+         && (free_bytes > pipeline->bytes))
+  {
+    offset = connection->file_cur_offset + (off_t)pipeline->bytes;
+
+    if (offset >= connection->file_total_offset)
+      break;
+
+    bytes = MIN(MIN(AKWBS_PIPELINE_READ_SIZE, free_bytes - pipeline->bytes),
+                (size_t)(connection->file_total_offset - offset));
+
+    address  = (char *)ring_buffer_write_address(&connection->buffer) + pipeline->bytes;
+    fd       = connection->file_descriptor;
+    io_bytes = bytes;
+
+    if (connection->direct_descriptor != AKWBS_ERROR)
+      fd = akwbs_direct_plan(connection,
+                             offset,
+                             address,
+                             free_bytes - pipeline->bytes,
+                             &bytes,
+                             &io_bytes);
+
+    if ((pipeline->count > 0)
+        && (bytes < AKWBS_PIPELINE_READ_SIZE)
+        && ((off_t)bytes < connection->file_total_offset - offset))
+      break;
+
+    bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+    msg.sd           = connection->client_socket;
+    msg.fd           = fd;
+    msg.type         = AKWBS_IO_GET_TYPE;
+    msg.address      = address;
+    msg.bytes        = (ssize_t)io_bytes;
+    msg.offset       = offset;
+    msg.directory_fd = AKWBS_ERROR;
+    msg.source_fd    = AKWBS_ERROR;
+
+    if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+      break;
+
+    read = &pipeline->reads[(pipeline->first + pipeline->count) % AKWBS_PIPELINE_MAX_DEPTH];
+
+    read->address    = msg.address;
+    read->bytes      = bytes;
+    read->bytes_read = 0;
+    read->is_done    = AKWBS_NO;
+    read->is_direct  = (fd == connection->direct_descriptor) ? AKWBS_YES : AKWBS_NO;
+
+    pipeline->count++;
+    pipeline->bytes += bytes;
+  }
+
+  connection->is_waiting_result = (pipeline->count > 0) ? AKWBS_YES : AKWBS_NO;
+
+  akwbs_readahead_submit(connection);
+}
+
+
+/*!
+ * Check whether a read result belongs to a connection: its address is in the region
+ * of one of the reads in flight.
+ *
+ * \param connection the connection.
+ * \param address address of the result.
+ *
+ * \return AKWBS_YES if it does, AKWBS_NO otherwise.
+ */
+int akwbs_pipeline_owns(struct akwbs_connection *connection, void *address)
+{
+  struct akwbs_pipeline *pipeline = &connection->pipeline;
+  unsigned int i;
+
+
+  for (i = 0; i < pipeline->count; i++)
+    if (pipeline->reads[(pipeline->first + i) % AKWBS_PIPELINE_MAX_DEPTH].address
+        == address)
+      return AKWBS_YES;
+
+  return AKWBS_NO;
+}
+
+
+/*!
+ * Apply the result of a read of a download. The oldest reads done are applied, in file
+ * order: their bytes become ready to be sent.
+ *
+ * \param connection the connection, owning the read.
+ * \param result the result.
+ *
+ * \details A read coming back short leaves a gap before the regions of the reads after
+ *          it. Those are dropped as they come back, and reads start again after the short
+ *          one once none is left in flight. A read bringing no byte at all, at the end of
+ *          a file truncated meanwhile or on an error, breaks the pipeline: the response
+ *          cannot be completed, and the connection is closed once no read is in flight.
+ */
+void akwbs_pipeline_complete(struct akwbs_connection *connection,
+                             struct akwbs_result_io *result)
+{
+  struct akwbs_pipeline *pipeline = &connection->pipeline;
+  struct akwbs_pipeline_read *read = NULL;
+  unsigned int i;
+
+
+  for (i = 0; i < pipeline->count; i++)
+  {
+    read = &pipeline->reads[(pipeline->first + i) % AKWBS_PIPELINE_MAX_DEPTH];
+
+    if (read->address != result->address)
+      continue;
+
+    read->is_done    = AKWBS_YES;
+    read->bytes_read = MIN(result->bytes_read, read->bytes);
+    break;
+  }
+
+  while ((pipeline->count > 0) && (pipeline->reads[pipeline->first].is_done == AKWBS_YES))
+  {
+    read = &pipeline->reads[pipeline->first];
+
+    if (pipeline->is_discarding == AKWBS_NO)
+    {
+      ring_buffer_write_advance(&connection->buffer, read->bytes_read);
+      connection->file_cur_offset += read->bytes_read;
+
+      if (read->bytes_read < read->bytes)
+        pipeline->is_discarding = AKWBS_YES;
+
+      /* The device may not take direct reads after all: the rest goes through the cache. */
+      if ((read->bytes_read < read->bytes) && (read->is_direct == AKWBS_YES))
+        connection->direct_descriptor = AKWBS_ERROR;
+      else if (read->bytes_read == 0)
+        pipeline->is_broken = AKWBS_YES;
+    }
+
+    pipeline->bytes -= read->bytes;
+    pipeline->first  = (pipeline->first + 1) % AKWBS_PIPELINE_MAX_DEPTH;
+    pipeline->count--;
+  }
+
+  if (pipeline->count == 0)
+    pipeline->is_discarding = AKWBS_NO;
+
+  connection->is_waiting_result = (pipeline->count > 0) ? AKWBS_YES : AKWBS_NO;
+}
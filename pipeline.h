@@ -0,0 +1,78 @@
+/*!
+ * \file   pipeline.h
+ * \brief  Pipelined reads of downloads: several reads of a connection in flight at once,
+ *         into consecutive regions of its ring buffer, applied in file order.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_PIPELINE_H_
+#define _AKWBS_MT_PIPELINE_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "resultio.h"
+
+
+#define AKWBS_PIPELINE_MAX_DEPTH  16    /*!< Most reads of a connection in flight.      */
+
+#define AKWBS_PIPELINE_READ_SIZE BUFSIZ /*!< Bytes of a read, as akwbs_do_io allows.    */
+
+#define AKWBS_PIPELINE_MIN_ORDER  15    /*!< Order of the smallest ring buffer.         */
+
+
+struct akwbs_connection;
+
+
+/*!
+ * A read in flight.
+ */
+struct akwbs_pipeline_read
+{
+  void *address;                /*!< Where it lands in the ring buffer.                 */
+
+  size_t bytes;                 /*!< Bytes asked for.                                   */
+
+  size_t bytes_read;            /*!< Bytes read, once done.                             */
+
+  int is_done;                  /*!< Has its result come back.                          */
+
+  int is_direct;                /*!< Is it read directly, bypassing the page cache.     */
+};
+
+
+/*!
+ * The reads in flight of a connection, oldest first. They cover the file from
+ * file_cur_offset on, and the buffer from its write offset on, without gaps.
+ */
+struct akwbs_pipeline
+{
+  struct akwbs_pipeline_read
+    reads[AKWBS_PIPELINE_MAX_DEPTH]; /*!< Ring of the reads in flight.                  */
+
+  unsigned int first;           /*!< Index of the oldest read.                          */
+
+  unsigned int count;           /*!< Number of reads in flight.                         */
+
+  size_t bytes;                 /*!< Bytes asked for by the reads in flight.            */
+
+  int is_discarding;            /*!< A read came back short: the reads after it landed
+                                 *   past a gap, and are dropped as they come back.
+                                 */
+
+  int is_broken;                /*!< A read found no byte where the response promised
+                                 *   some: the file was cut short, or the read failed.
+                                 */
+};
+
+
+/*
+ * Public Interface.
+ */
+size_t akwbs_pipeline_buffer_order(unsigned long depth);
+void akwbs_pipeline_submit(struct akwbs_connection *connection);
+int akwbs_pipeline_owns(struct akwbs_connection *connection, void *address);
+void akwbs_pipeline_complete(struct akwbs_connection *connection,
+                             struct akwbs_result_io *result);
+
+#endif /* END OF pipeline.h */
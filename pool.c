@@ -0,0 +1,1779 @@
+/*!
+ * \file   pool.c
+ * \brief  The pools of I/O working threads, one per device, so a slow disk stalls no
+ *         other. Their size is set at run time; the threads can be pinned to a set of
+ *         CPUs, and the event loop to another. On hosts with more
+ *         than one NUMA node, every node used gets its own group of threads, pinned to
+ *         its CPUs, and each connection is tied to one group, its ring buffer placed on
+ *         that node: its data never crosses the interconnect. Each
+ *         group grows and shrinks its threads between bounds, as its backlog ages and
+ *         its threads block in I/O. Every thread has its own deque of requests: the
+ *         requests of a file go to the same thread, and idle threads steal from busy
+ *         ones, so no lock is shared by all the threads. Each deque has a latency lane
+ *         and a bulk lane, and some threads serve only the first, so a small file never
+ *         waits behind large transfers.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "pool.h"
+#include "connection.h"
+#include "daemon.h"
+#include "internal.h"
+#include "ringbuffer.h"
+#include "thread_io.h"
+
+
+#define AKWBS_POOL_MAX_NODES       64   /*!< NUMA nodes looked for.                     */
+
+#define AKWBS_POOL_MPOL_DEFAULT    0    /*!< set_mempolicy(2): allocate locally.        */
+
+#define AKWBS_POOL_MPOL_PREFERRED  1    /*!< set_mempolicy(2): prefer the given node.   */
+
+
+/*!
+ * NUMA nodes the working threads may run on, shared by the pools of every device.
+ */
+struct akwbs_io_nodes
+{
+  unsigned int count;           /*!< Number of nodes.                                   */
+
+  int nodes[AKWBS_POOL_MAX_NODES]; /*!< Number of each node.                            */
+
+  cpu_set_t
+    cpus[AKWBS_POOL_MAX_NODES]; /*!< CPUs of each node the threads may run on.          */
+
+  int is_pinned;                /*!< Are the threads pinned to these CPUs.              */
+};
+
+
+/*!
+ * Parse a list of CPUs, such as "0-3,8,10-11".
+ *
+ * \param list the list. A trailing new line is accepted, as read from sysfs.
+ * \param cpus param-return set of the CPUs listed.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the list is empty or invalid.
+ */
+static int parse_cpus(const char *list, cpu_set_t *cpus)
+{
+  const char *cursor = list;
+  char *end = NULL;
+  unsigned long first = 0;
+  unsigned long last  = 0;
+
+
+  CPU_ZERO(cpus);
+
+  while (1)
+  {
+    if ((*cursor < '0') || (*cursor > '9'))
+      return AKWBS_ERROR;
+
+    first = strtoul(cursor, &end, 10);
+    last  = first;
+
+    if (*end == '-')
+    {
+      cursor = end + 1;
+
+      if ((*cursor < '0') || (*cursor > '9'))
+        return AKWBS_ERROR;
+
+      last = strtoul(cursor, &end, 10);
+    }
+
+    if ((first > last) || (last >= CPU_SETSIZE))
+      return AKWBS_ERROR;
+
+    for (; first <= last; first++)
+      CPU_SET(first, cpus);
+
+    if (*end != ',')
+      break;
+
+    cursor = end + 1;
+  }
+
+  if ((*end == '\n') && (*(end + 1) == '\0'))
+    return AKWBS_SUCCESS;
+
+  return (*end == '\0') ? AKWBS_SUCCESS : AKWBS_ERROR;
+}
+
+
+/*!
+ * Read the CPUs of a NUMA node.
+ *
+ * \param node the node.
+ * \param cpus param-return set of its CPUs.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if there is no such node, or it has no CPU.
+ */
+static int read_node_cpus(int node, cpu_set_t *cpus)
+{
+  char path[PATH_MAX];
+  char list[4096];
+  FILE *file = NULL;
+  int ret = AKWBS_ERROR;
+
+
+  snprintf(path, sizeof(path), "%s/node%d/cpulist", AKWBS_POOL_NODE_PATH, node);
+
+  file = fopen(path, "r");
+
+  if (file == NULL)
+    return AKWBS_ERROR;
+
+  if (fgets(list, sizeof(list), file) != NULL)
+    ret = parse_cpus(list, cpus);
+
+  fclose(file);
+
+  return ret;
+}
+
+
+/*!
+ * Check a list of CPUs given in the configuration.
+ *
+ * \param list the list, such as "0-3,8".
+ *
+ * \return AKWBS_SUCCESS if the list is valid.
+ *         AKWBS_ERROR if it is not.
+ */
+int akwbs_pool_check_cpus(const char *list)
+{
+  cpu_set_t cpus;
+
+
+  return parse_cpus(list, &cpus);
+}
+
+
+/*!
+ * Microseconds elapsed between two times.
+ *
+ * \param from the earlier time.
+ * \param to the later time.
+ *
+ * \return the microseconds elapsed, 0 if to is earlier.
+ */
+static unsigned long elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  long usec = (to->tv_sec - from->tv_sec) * 1000000L
+              + (to->tv_nsec - from->tv_nsec) / 1000L;
+
+
+  return (usec > 0) ? (unsigned long)usec : 0;
+}
+
+
+/*!
+ * Create a group of working threads, none started yet.
+ *
+ * \param group the group, zeroed.
+ * \param node NUMA node of the group.
+ * \param cpus CPUs of the threads of the group, or NULL not to pin them.
+ * \param workers_count most threads of the group at once.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on error.
+ */
+static int create_group(struct akwbs_io_group *group,
+                        int node,
+                        const cpu_set_t *cpus,
+                        unsigned int workers_count)
+{
+  struct akwbs_io_worker *worker = NULL;
+
+
+  group->node = node;
+
+  if (cpus != NULL)
+  {
+    group->cpus = malloc(sizeof(cpu_set_t));
+
+    if (group->cpus == NULL)
+      return AKWBS_ERROR;
+
+    memcpy(group->cpus, cpus, sizeof(cpu_set_t));
+  }
+
+  group->workers = calloc(workers_count, sizeof(struct akwbs_io_worker));
+
+  if (group->workers == NULL)
+    return AKWBS_ERROR;
+
+  for (group->workers_count = 0;
+       group->workers_count < workers_count;
+       group->workers_count++)
+  {
+    worker = &group->workers[group->workers_count];
+
+    worker->group = group;
+
+    worker->jobs[AKWBS_IO_LANE_LATENCY] = calloc(AKWBS_POOL_DEQUE_SIZE,
+                                                 sizeof(struct akwbs_io_job));
+    worker->jobs[AKWBS_IO_LANE_BULK]    = calloc(AKWBS_POOL_DEQUE_SIZE,
+                                                 sizeof(struct akwbs_io_job));
+
+    if ((worker->jobs[AKWBS_IO_LANE_LATENCY] == NULL)
+        || (worker->jobs[AKWBS_IO_LANE_BULK] == NULL)
+        || (pthread_mutex_init(&worker->mutex, NULL) != AKWBS_SUCCESS)
+        || (pthread_cond_init(&worker->cond, NULL) != AKWBS_SUCCESS))
+    {
+      group->workers_count++;
+      return AKWBS_ERROR;
+    }
+  }
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Start a working thread of a group, in a free slot.
+ *
+ * \param daemon_p daemon structure.
+ * \param group the group.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if there is no free slot, or the thread could not be started.
+ */
+static int start_worker(struct akwbs_daemon *daemon_p, struct akwbs_io_group *group)
+{
+  struct akwbs_io_worker *worker = NULL;
+  pthread_attr_t attr;
+  int ret = AKWBS_ERROR;
+  unsigned int i;
+
+
+  for (i = 0; i < group->workers_count; i++)
+    if (group->workers[i].state == AKWBS_IO_WORKER_FREE)
+    {
+      worker = &group->workers[i];
+      break;
+    }
+
+  if (worker == NULL)
+    return AKWBS_ERROR;
+
+  /*
+   * A push that saw the previous thread of the slot running may still be on its way;
+   * it finds the slot either retiring or reset, never half reset.
+   */
+  pthread_mutex_lock(&worker->mutex);
+
+  worker->daemon_ref  = daemon_p;
+  worker->is_idle     = AKWBS_NO;
+  worker->is_retiring = AKWBS_NO;
+  worker->is_reserved = AKWBS_NO;
+  worker->latency_run = 0;
+
+  memset(worker->head, 0, sizeof(worker->head));
+  memset(worker->tail, 0, sizeof(worker->tail));
+
+  pthread_mutex_unlock(&worker->mutex);
+
+  if (pthread_attr_init(&attr) != AKWBS_SUCCESS)
+    return AKWBS_ERROR;
+
+  if ((group->cpus == NULL)
+      || (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), group->cpus)
+          == AKWBS_SUCCESS))
+    ret = pthread_create(&worker->thread_id, &attr, akwbs_thread_io_routine, worker);
+
+  pthread_attr_destroy(&attr);
+
+  if (ret != AKWBS_SUCCESS)
+    return AKWBS_ERROR;
+
+  /* Only now may the event loop push to it. */
+  __atomic_store_n(&worker->state, AKWBS_IO_WORKER_RUNNING, __ATOMIC_RELEASE);
+
+  group->threads++;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Ask the last working thread of a group to exit. It takes no more requests, serves
+ * those of its deque, and exits.
+ *
+ * \param group the group.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if no thread may be retired.
+ */
+static int retire_worker(struct akwbs_io_group *group)
+{
+  struct akwbs_io_worker *worker = NULL;
+  unsigned int i;
+
+
+  for (i = group->workers_count; i > 0; i--)
+  {
+    worker = &group->workers[i - 1];
+
+    if ((worker->state != AKWBS_IO_WORKER_RUNNING) || (worker->is_retiring == AKWBS_YES))
+      continue;
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->is_retiring = AKWBS_YES;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+
+    group->threads--;
+
+    return AKWBS_SUCCESS;
+  }
+
+  return AKWBS_ERROR;
+}
+
+
+/*!
+ * Join the retired working threads of a group, freeing their slots.
+ *
+ * \param group the group.
+ */
+static void reap_workers(struct akwbs_io_group *group)
+{
+  void *res = NULL;
+  unsigned int i;
+
+
+  for (i = 0; i < group->workers_count; i++)
+    if (__atomic_load_n(&group->workers[i].state, __ATOMIC_ACQUIRE)
+        == AKWBS_IO_WORKER_EXITED)
+    {
+      pthread_join(group->workers[i].thread_id, &res);
+      group->workers[i].state = AKWBS_IO_WORKER_FREE;
+    }
+}
+
+
+/*!
+ * Keep the first threads of a group for the latency lane: its share of the threads,
+ * rounded up, but never every thread, so the bulk lane keeps at least one. Called
+ * whenever the threads of the group change.
+ *
+ * \param group the group.
+ */
+static void reserve_workers(struct akwbs_io_group *group)
+{
+  struct akwbs_io_worker *worker = NULL;
+  unsigned int reserved = 0;
+  unsigned int i;
+
+
+  group->reserved = (group->threads * group->reserve_percent + 99) / 100;
+  group->reserved = MIN(group->reserved, MAX(group->threads, 1) - 1);
+
+  for (i = 0; i < group->workers_count; i++)
+  {
+    worker = &group->workers[i];
+
+    if ((worker->state != AKWBS_IO_WORKER_RUNNING) || (worker->is_retiring == AKWBS_YES))
+      continue;
+
+    __atomic_store_n(&worker->is_reserved,
+                     (reserved < group->reserved) ? AKWBS_YES : AKWBS_NO,
+                     __ATOMIC_RELAXED);
+
+    if (reserved < group->reserved)
+      reserved++;
+  }
+}
+
+
+/*!
+ * Measure the backlog of a group: the requests in its deques, and the oldest of them.
+ *
+ * \param group the group.
+ * \param now current time.
+ */
+static void measure_backlog(struct akwbs_io_group *group, const struct timespec *now)
+{
+  struct akwbs_io_worker *worker = NULL;
+  unsigned long age = 0;
+  unsigned long seq;
+  unsigned int i;
+  int lane;
+
+
+  group->depth         = 0;
+  group->oldest_age_us = 0;
+
+  memset(group->lane_depth, 0, sizeof(group->lane_depth));
+
+  for (i = 0; i < group->workers_count; i++)
+  {
+    worker = &group->workers[i];
+
+    if (__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) != AKWBS_IO_WORKER_RUNNING)
+      continue;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    for (lane = 0; lane < AKWBS_IO_LANES; lane++)
+    {
+      group->lane_depth[lane] += worker->tail[lane] - worker->head[lane];
+
+      /* A request passed over for less remaining work stays near the head. */
+      for (seq = worker->head[lane];
+           (seq != worker->tail[lane])
+           && (seq - worker->head[lane] < AKWBS_POOL_SRW_WINDOW);
+           seq++)
+      {
+        age = elapsed_us(&worker->jobs[lane][seq % AKWBS_POOL_DEQUE_SIZE].queued_at,
+                         now);
+
+        group->oldest_age_us = MAX(group->oldest_age_us, age);
+      }
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+  }
+
+  for (lane = 0; lane < AKWBS_IO_LANES; lane++)
+    group->depth += group->lane_depth[lane];
+}
+
+
+/*!
+ * Measure a group over the last tick and grow or shrink its threads.
+ *
+ * \param daemon_p daemon structure.
+ * \param group the group.
+ * \param now current time.
+ *
+ * \details A group grows when its oldest request has waited too long while its threads
+ *          spent most of their time blocked in I/O: the device is slow, not the CPUs
+ *          busy, and more threads put more I/O in flight. This must last a few ticks,
+ *          and then the threads grow by half at once, so a cold burst is met quickly.
+ *          A group shrinks by one thread after many ticks with no backlog and little
+ *          I/O. The thresholds and durations differ both ways, so a load on the edge
+ *          does not make the pool flap.
+ */
+static void scale_group(struct akwbs_daemon *daemon_p,
+                        struct akwbs_io_group *group,
+                        const struct timespec *now)
+{
+  unsigned long io_usec = __atomic_load_n(&group->io_usec, __ATOMIC_RELAXED);
+  unsigned long blocked = 0;
+  unsigned int grow = 0;
+
+
+  measure_backlog(group, now);
+
+  blocked = (io_usec - group->last_io_usec) * 100
+            / ((unsigned long)AKWBS_POOL_TICK_US * MAX(group->threads, 1));
+
+  group->blocked_percent = (unsigned int)MIN(blocked, 100);
+  group->last_io_usec    = io_usec;
+
+  if ((group->depth > 0)
+      && (group->oldest_age_us >= AKWBS_POOL_GROW_AGE_US)
+      && (group->blocked_percent >= AKWBS_POOL_GROW_BLOCKED))
+    group->pressure_ticks++;
+  else
+    group->pressure_ticks = 0;
+
+  if ((group->depth == 0) && (group->blocked_percent < AKWBS_POOL_SHRINK_BLOCKED))
+    group->idle_ticks++;
+  else
+    group->idle_ticks = 0;
+
+  if ((group->pressure_ticks >= AKWBS_POOL_GROW_TICKS)
+      && (group->threads < group->workers_count))
+  {
+    grow = MIN(MAX(group->threads / 2, 1), group->workers_count - group->threads);
+
+    for (; grow > 0; grow--)
+      if (start_worker(daemon_p, group) == AKWBS_SUCCESS)
+        group->scale_ups++;
+
+    group->pressure_ticks = 0;
+    group->idle_ticks     = 0;
+
+    reserve_workers(group);
+  }
+  else if ((group->idle_ticks >= AKWBS_POOL_SHRINK_TICKS)
+           && (group->threads > group->min_threads))
+  {
+    if (retire_worker(group) == AKWBS_SUCCESS)
+      group->scale_downs++;
+
+    group->idle_ticks = 0;
+
+    reserve_workers(group);
+  }
+}
+
+
+/*!
+ * Write the state of the pool, in the Prometheus text format, to the metrics file. The
+ * file is replaced at once, so readers never see it half written.
+ *
+ * \param daemon_p daemon structure.
+ */
+static void write_metrics(struct akwbs_daemon *daemon_p)
+{
+  char path[PATH_MAX];
+  struct akwbs_io_pool *pool   = NULL;
+  struct akwbs_io_group *group = NULL;
+  FILE *file = NULL;
+  unsigned long steals = 0;
+  unsigned int index = 0;
+  unsigned int i;
+  unsigned int j;
+
+
+  if (snprintf(path, sizeof(path), "%s.tmp", daemon_p->metrics_file) >= (int)sizeof(path))
+    return;
+
+  file = fopen(path, "w");
+
+  if (file == NULL)
+    return;
+
+  for (pool = __atomic_load_n(&daemon_p->io_pools, __ATOMIC_ACQUIRE);
+       pool != NULL;
+       pool = __atomic_load_n(&pool->next, __ATOMIC_ACQUIRE))
+    for (i = 0; i < pool->groups_count; i++, index++)
+    {
+      group = &pool->groups[i];
+
+      for (steals = 0, j = 0; j < group->workers_count; j++)
+        steals += __atomic_load_n(&group->workers[j].steals, __ATOMIC_RELAXED);
+
+      fprintf(file,
+              "akwbs_io_threads{group=\"%u\",node=\"%d\",device=\"%u:%u\"} %u\n"
+              "akwbs_io_threads_min{group=\"%u\"} %u\n"
+              "akwbs_io_threads_max{group=\"%u\"} %u\n"
+              "akwbs_io_threads_reserved{group=\"%u\",lane=\"latency\"} %u\n"
+              "akwbs_io_queue_depth{group=\"%u\"} %lu\n"
+              "akwbs_io_lane_depth{group=\"%u\",lane=\"latency\"} %lu\n"
+              "akwbs_io_lane_depth{group=\"%u\",lane=\"bulk\"} %lu\n"
+              "akwbs_io_oldest_request_age_seconds{group=\"%u\"} %lu.%06lu\n"
+              "akwbs_io_blocked_ratio{group=\"%u\"} %u.%02u\n"
+              "akwbs_io_scale_ups_total{group=\"%u\"} %lu\n"
+              "akwbs_io_scale_downs_total{group=\"%u\"} %lu\n"
+              "akwbs_io_steals_total{group=\"%u\"} %lu\n",
+              index, group->node, major(pool->device), minor(pool->device),
+              group->threads,
+              index, group->min_threads,
+              index, group->workers_count,
+              index, group->reserved,
+              index, group->depth,
+              index, group->lane_depth[AKWBS_IO_LANE_LATENCY],
+              index, group->lane_depth[AKWBS_IO_LANE_BULK],
+              index, group->oldest_age_us / 1000000, group->oldest_age_us % 1000000,
+              index, group->blocked_percent / 100, group->blocked_percent % 100,
+              index, group->scale_ups,
+              index, group->scale_downs,
+              index, steals);
+    }
+
+  if (fclose(file) == 0)
+    rename(path, daemon_p->metrics_file);
+}
+
+
+/*!
+ * Main routine of the autoscaler thread. Every tick, retired threads are joined, each
+ * group is measured and scaled, and the metrics are written.
+ *
+ * \param arg the daemon structure.
+ */
+static void *scaler_routine(void *arg)
+{
+  struct akwbs_daemon *daemon_p = (struct akwbs_daemon *)arg;
+  struct akwbs_io_pool *pool = NULL;
+  struct timespec now;
+  unsigned int i;
+
+
+  while (1)
+  {
+    usleep(AKWBS_POOL_TICK_US);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (pool = __atomic_load_n(&daemon_p->io_pools, __ATOMIC_ACQUIRE);
+         pool != NULL;
+         pool = __atomic_load_n(&pool->next, __ATOMIC_ACQUIRE))
+      for (i = 0; i < pool->groups_count; i++)
+      {
+        reap_workers(&pool->groups[i]);
+        scale_group(daemon_p, &pool->groups[i], &now);
+      }
+
+    if (daemon_p->metrics_file != NULL)
+      write_metrics(daemon_p);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  return NULL;
+}
+
+
+/*!
+ * Find the pool of working threads of a device.
+ *
+ * \param daemon_p daemon structure.
+ * \param device the device.
+ *
+ * \return the pool, or NULL if the device has none.
+ */
+static struct akwbs_io_pool *find_pool(struct akwbs_daemon *daemon_p, dev_t device)
+{
+  struct akwbs_io_pool *pool = NULL;
+
+
+  for (pool = daemon_p->io_pools; pool != NULL; pool = pool->next)
+    if (pool->device == device)
+      return pool;
+
+  return NULL;
+}
+
+
+/*!
+ * Stop the working threads of a pool and free it.
+ *
+ * \param pool the pool, no longer reachable from the daemon.
+ */
+static void destroy_pool(struct akwbs_io_pool *pool)
+{
+  struct akwbs_io_group *group = NULL;
+  void *res = NULL;
+  unsigned int i;
+  unsigned int j;
+
+
+  for (i = 0; i < pool->groups_count; i++)
+  {
+    group = &pool->groups[i];
+
+    for (j = 0; j < group->workers_count; j++)
+    {
+      if (group->workers[j].state == AKWBS_IO_WORKER_FREE)
+        continue;
+
+      pthread_cancel(group->workers[j].thread_id);
+      pthread_join(group->workers[j].thread_id, &res);
+    }
+
+    for (j = 0; j < group->workers_count; j++)
+    {
+      pthread_mutex_destroy(&group->workers[j].mutex);
+      pthread_cond_destroy(&group->workers[j].cond);
+      free(group->workers[j].jobs[AKWBS_IO_LANE_LATENCY]);
+      free(group->workers[j].jobs[AKWBS_IO_LANE_BULK]);
+    }
+
+    free(group->workers);
+    free(group->cpus);
+  }
+
+  free(pool->groups);
+  free(pool->prefix);
+  free(pool);
+}
+
+
+/*!
+ * Create the pool of working threads of a device, start its threads, and add it to the
+ * pools of the daemon.
+ *
+ * \param daemon_p daemon structure.
+ * \param device the device.
+ * \param min_threads fewest threads of the pool, at least 1.
+ * \param max_threads most threads of the pool.
+ *
+ * \return the pool on success.
+ *         NULL on error.
+ *
+ * \details A group is created for every NUMA node the threads may run on, up to one
+ *          per thread, and the threads and the bounds of the autoscaler are dealt to
+ *          the groups in turn.
+ */
+static struct akwbs_io_pool *create_pool(struct akwbs_daemon *daemon_p,
+                                         dev_t device,
+                                         unsigned long min_threads,
+                                         unsigned long max_threads)
+{
+  struct akwbs_io_nodes *nodes = daemon_p->io_nodes;
+  struct akwbs_io_pool *pool   = NULL;
+  struct akwbs_io_pool **last  = NULL;
+  struct akwbs_io_group *group = NULL;
+  unsigned int count = (unsigned int)MIN(nodes->count, min_threads);
+  unsigned int i;
+
+
+  pool = calloc(1, sizeof(struct akwbs_io_pool));
+
+  if (pool == NULL)
+    return NULL;
+
+  pool->device          = device;
+  pool->is_inline_read  = daemon_p->inline_io;
+  pool->is_inline_write = daemon_p->inline_io;
+  pool->groups          = calloc(count, sizeof(struct akwbs_io_group));
+
+  if (pool->groups == NULL)
+    goto destroy_and_fail;
+
+  for (pool->groups_count = 0; pool->groups_count < count; pool->groups_count++)
+  {
+    i     = pool->groups_count;
+    group = &pool->groups[i];
+
+    group->pool            = pool;
+    group->min_threads     = min_threads / count + ((i < min_threads % count) ? 1 : 0);
+    group->reserve_percent = (unsigned int)daemon_p->latency_reserve;
+    group->latency_bytes   = daemon_p->latency_bytes;
+
+    if (create_group(group,
+                     nodes->nodes[i],
+                     (nodes->is_pinned == AKWBS_YES) ? &nodes->cpus[i] : NULL,
+                     max_threads / count + ((i < max_threads % count) ? 1 : 0))
+        == AKWBS_ERROR)
+    {
+      pool->groups_count++;
+      goto destroy_and_fail;
+    }
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    while (pool->groups[i].threads < pool->groups[i].min_threads)
+      if (start_worker(daemon_p, &pool->groups[i]) == AKWBS_ERROR)
+        goto destroy_and_fail;
+
+    reserve_workers(&pool->groups[i]);
+  }
+
+  /* The autoscaler walks the pools while the event loop adds one. */
+  for (last = &daemon_p->io_pools; *last != NULL; last = &(*last)->next)
+    ;
+
+  __atomic_store_n(last, pool, __ATOMIC_RELEASE);
+
+  daemon_p->io_pools_count++;
+
+  return pool;
+
+destroy_and_fail:
+  destroy_pool(pool);
+  return NULL;
+}
+
+
+/*!
+ * Parse the next entry of a list of devices, such as "/mnt/hdd:2,/mnt/ssd:16".
+ *
+ * \param cursor param-return the list, moved past the entry and its comma.
+ * \param path param-return path of the entry, of PATH_MAX bytes.
+ * \param threads param-return threads of the device holding that path, at least 1.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the entry is invalid.
+ */
+static int parse_device(const char **cursor, char *path, unsigned long *threads)
+{
+  const char *end   = strchr(*cursor, ',');
+  const char *colon = NULL;
+  char *number_end  = NULL;
+
+
+  if (end == NULL)
+    end = *cursor + strlen(*cursor);
+
+  colon = memrchr(*cursor, ':', (size_t)(end - *cursor));
+
+  if ((colon == NULL) || (colon == *cursor) || (colon - *cursor >= PATH_MAX)
+      || (colon[1] < '0') || (colon[1] > '9'))
+    return AKWBS_ERROR;
+
+  memcpy(path, *cursor, (size_t)(colon - *cursor));
+  path[colon - *cursor] = '\0';
+
+  errno    = 0;
+  *threads = strtoul(colon + 1, &number_end, 10);
+
+  if ((number_end != end) || (errno != 0) || (*threads == 0))
+    return AKWBS_ERROR;
+
+  *cursor = (*end == ',') ? end + 1 : end;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Set the request path of a pool, if the device path given for it lies under
+ * root_path: the files requested below it are opened by the threads of that pool.
+ *
+ * \param pool the pool.
+ * \param root canonical root_path.
+ * \param path path given for the device.
+ *
+ * \return AKWBS_SUCCESS on success, or if the path is not under root_path.
+ *         AKWBS_ERROR on error.
+ */
+static int set_prefix(struct akwbs_io_pool *pool, const char *root, const char *path)
+{
+  char canonical[PATH_MAX];
+  size_t length = strlen(root);
+
+
+  if (realpath(path, canonical) == NULL)
+    return AKWBS_ERROR;
+
+  if ((strncmp(canonical, root, length) != 0) || (canonical[length] != '/'))
+    return AKWBS_SUCCESS;
+
+  pool->prefix = strdup(canonical + length);
+
+  if (pool->prefix == NULL)
+    return AKWBS_ERROR;
+
+  pool->prefix_length = strlen(pool->prefix);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Check a list of devices given as an option.
+ *
+ * \param list the list.
+ *
+ * \return AKWBS_SUCCESS if it is valid.
+ *         AKWBS_ERROR otherwise.
+ */
+int akwbs_pool_check_devices(const char *list)
+{
+  char path[PATH_MAX];
+  unsigned long threads = 0;
+
+
+  if (*list == '\0')
+    return AKWBS_ERROR;
+
+  while (*list != '\0')
+    if (parse_device(&list, path, &threads) == AKWBS_ERROR)
+      return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Create the pools of working threads and start them.
+ *
+ * \param daemon_p daemon structure, with the settings of the pools.
+ * \param conf server configuration: io_cpus, device_threads, root_path.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on error. What was created is released by akwbs_pool_destroy.
+ *
+ * \details The working threads may run on the CPUs of io_cpus, or on the CPUs this
+ *          process may run on, and each pool has a group for every NUMA node having
+ *          some of them, its threads pinned to the CPUs of their node. With a single
+ *          node and no io_cpus, threads are not pinned at all. The devices holding the
+ *          paths of device_threads get that many threads, a fixed number; the device
+ *          of root_path, and any other device a file is later found on, get io_threads
+ *          and may grow up to io_threads_max. The autoscaler runs only if it may grow
+ *          some pool, or has metrics to write. The paths of device_threads under
+ *          root_path tell which pool opens a file, before its device is known.
+ */
+int akwbs_pool_create(struct akwbs_daemon *daemon_p, struct akwbs_server_conf *conf)
+{
+  char path[PATH_MAX];
+  char root[PATH_MAX];
+  struct akwbs_io_pool *pool = NULL;
+  cpu_set_t allowed;
+  struct akwbs_io_nodes *nodes = NULL;
+  struct stat stat_buf;
+  const char *cursor = conf->device_threads;
+  unsigned long threads = 0;
+  int node;
+
+
+  if ((daemon_p->io_threads == 0) || (daemon_p->latency_reserve > 100)
+      || (daemon_p->read_depth == 0) || (daemon_p->read_depth > AKWBS_PIPELINE_MAX_DEPTH))
+    return AKWBS_ERROR;
+
+  nodes = calloc(1, sizeof(struct akwbs_io_nodes));
+
+  if (nodes == NULL)
+    return AKWBS_ERROR;
+
+  daemon_p->io_nodes = nodes;
+
+  if (conf->io_cpus != NULL)
+  {
+    if (parse_cpus(conf->io_cpus, &allowed) == AKWBS_ERROR)
+      return AKWBS_ERROR;
+  }
+  else if (sched_getaffinity(0, sizeof(allowed), &allowed) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  for (node = 0; node < AKWBS_POOL_MAX_NODES; node++)
+  {
+    if (read_node_cpus(node, &nodes->cpus[nodes->count]) == AKWBS_ERROR)
+      continue;
+
+    CPU_AND(&nodes->cpus[nodes->count], &nodes->cpus[nodes->count], &allowed);
+
+    if (CPU_COUNT(&nodes->cpus[nodes->count]) == 0)
+      continue;
+
+    nodes->nodes[nodes->count++] = node;
+  }
+
+  if (nodes->count == 0)
+  {
+    nodes->cpus[0]  = allowed;
+    nodes->nodes[0] = 0;
+    nodes->count    = 1;
+  }
+
+  if ((conf->io_cpus != NULL) || (nodes->count > 1))
+    nodes->is_pinned = AKWBS_YES;
+
+  if (realpath(conf->root_path, root) == NULL)
+    return AKWBS_ERROR;
+
+  while ((cursor != NULL) && (*cursor != '\0'))
+  {
+    if ((parse_device(&cursor, path, &threads) == AKWBS_ERROR)
+        || (stat(path, &stat_buf) == AKWBS_ERROR)
+        || (find_pool(daemon_p, stat_buf.st_dev) != NULL)
+        || (daemon_p->io_pools_count == AKWBS_POOL_MAX_DEVICES))
+      return AKWBS_ERROR;
+
+    pool = create_pool(daemon_p, stat_buf.st_dev, threads, threads);
+
+    if ((pool == NULL) || (set_prefix(pool, root, path) == AKWBS_ERROR))
+      return AKWBS_ERROR;
+  }
+
+  if (stat(conf->root_path, &stat_buf) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  daemon_p->io_root_pool = find_pool(daemon_p, stat_buf.st_dev);
+
+  if ((daemon_p->io_root_pool == NULL)
+      && ((daemon_p->io_pools_count == AKWBS_POOL_MAX_DEVICES)
+          || ((daemon_p->io_root_pool = create_pool(daemon_p,
+                                                    stat_buf.st_dev,
+                                                    daemon_p->io_threads,
+                                                    daemon_p->io_threads_max)) == NULL)))
+    return AKWBS_ERROR;
+
+  if ((daemon_p->io_threads_max == daemon_p->io_threads) && (daemon_p->metrics_file == NULL))
+    return AKWBS_SUCCESS;
+
+  if (pthread_create(&daemon_p->scaler_thread, NULL, scaler_routine, daemon_p)
+      != AKWBS_SUCCESS)
+    return AKWBS_ERROR;
+
+  daemon_p->has_scaler = AKWBS_YES;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Pin the calling thread, the event loop, to the CPUs of loop_cpus, if given.
+ *
+ * \param conf server configuration.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on error.
+ */
+int akwbs_pool_pin_loop(struct akwbs_server_conf *conf)
+{
+  cpu_set_t cpus;
+
+
+  if (conf->loop_cpus == NULL)
+    return AKWBS_SUCCESS;
+
+  if (parse_cpus(conf->loop_cpus, &cpus) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != AKWBS_SUCCESS)
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Tie a new connection to a group of the working threads of root_path, and place its
+ * ring buffer on the NUMA node of that group.
+ *
+ * \param daemon_p daemon structure.
+ * \param buffer ring buffer of the connection, just created, or NULL to place none.
+ *
+ * \return the group of the connection.
+ *
+ * \details Connections are dealt to the groups in turn. The buffer is backed by a shared
+ *          file, whose pages land on the node of the thread touching them first, as the
+ *          policy of that thread prefers; here, the event loop prefers the node of the
+ *          group while it touches every page. Placing is best effort: a kernel without
+ *          NUMA support leaves the pages where they fall.
+ */
+struct akwbs_io_group *akwbs_pool_assign(struct akwbs_daemon *daemon_p,
+                                         struct ring_buffer *buffer)
+{
+  struct akwbs_io_pool *pool   = NULL;
+  struct akwbs_io_group *group = NULL;
+  unsigned long node_mask = 0;
+  size_t i;
+
+
+  pool  = daemon_p->io_root_pool;
+  group = &pool->groups[daemon_p->io_assigned++ % pool->groups_count];
+
+  if ((pool->groups_count == 1) || (buffer == NULL))
+    return group;
+
+  node_mask = 1UL << group->node;
+
+  if (syscall(SYS_set_mempolicy,
+              AKWBS_POOL_MPOL_PREFERRED,
+              &node_mask,
+              AKWBS_POOL_MAX_NODES + 1) == AKWBS_ERROR)
+    return group;
+
+  for (i = 0; i < buffer->count_bytes; i += (size_t)sysconf(_SC_PAGESIZE))
+    ((volatile char *)buffer->address)[i] = 0;
+
+  syscall(SYS_set_mempolicy, AKWBS_POOL_MPOL_DEFAULT, NULL, 0);
+
+  return group;
+}
+
+
+/*!
+ * Tie a connection whose file was just opened to the working threads of the device
+ * holding that file, on the NUMA node it was tied to. Called by the event loop only.
+ *
+ * \param connection the connection.
+ *
+ * \details The pool of a device is created the first time one of its files is opened.
+ *          Past AKWBS_POOL_MAX_DEVICES devices, or if the pool cannot be created, the
+ *          connection stays with the threads it has.
+ */
+void akwbs_pool_route(struct akwbs_connection *connection)
+{
+  struct akwbs_daemon *daemon_p = connection->daemon_ref;
+  struct akwbs_io_group *group  = connection->io_group;
+  struct akwbs_io_pool *pool    = NULL;
+  dev_t device = connection->opening.stat_buf.st_dev;
+  unsigned int index = (unsigned int)(group - group->pool->groups);
+
+
+  pool = find_pool(daemon_p, device);
+
+  if ((pool == NULL) && (daemon_p->io_pools_count < AKWBS_POOL_MAX_DEVICES))
+    pool = create_pool(daemon_p,
+                       device,
+                       daemon_p->io_threads,
+                       daemon_p->io_threads_max);
+
+  if (pool != NULL)
+    connection->io_group = &pool->groups[index % pool->groups_count];
+}
+
+
+/*!
+ * Tie a connection whose file is about to be opened to the working threads of the
+ * device of device_threads whose path holds the requested file, the longest one, on the
+ * NUMA node it was tied to: an open or stat stuck on that device holds back no other.
+ * The files of other devices are opened by the threads of root_path. Called by the
+ * event loop only.
+ *
+ * \param connection the connection, holding the requested file name.
+ */
+void akwbs_pool_route_opening(struct akwbs_connection *connection)
+{
+  struct akwbs_io_group *group = connection->io_group;
+  struct akwbs_io_pool *pool   = NULL;
+  struct akwbs_io_pool *best   = NULL;
+  const char *name = connection->file_name;
+  unsigned int index = (unsigned int)(group - group->pool->groups);
+
+
+  for (pool = connection->daemon_ref->io_pools; pool != NULL; pool = pool->next)
+    if ((pool->prefix != NULL)
+        && ((best == NULL) || (pool->prefix_length > best->prefix_length))
+        && (strncmp(name, pool->prefix, pool->prefix_length) == 0)
+        && ((name[pool->prefix_length] == '/') || (name[pool->prefix_length] == '\0')))
+      best = pool;
+
+  if (best == NULL)
+    best = connection->daemon_ref->io_root_pool;
+
+  connection->io_group = &best->groups[index % best->groups_count];
+}
+
+
+/*!
+ * Affinity key of the requests of a connection: the file read, shared by every
+ * connection reading it, or the file written, which only this connection writes. Before
+ * the file is opened, the connection itself.
+ *
+ * \param connection the connection.
+ *
+ * \return the key, already mixed.
+ */
+static unsigned long affinity_key(struct akwbs_connection *connection)
+{
+  unsigned long key = (unsigned long)connection->file_descriptor;
+
+
+  if (connection->file_descriptor == AKWBS_ERROR)
+    key = (unsigned long)connection->client_socket;
+
+  if ((connection->io_type == AKWBS_IO_GET_TYPE) && (connection->file_stat != NULL))
+    key = (unsigned long)connection->file_stat->inode_number
+          ^ ((unsigned long)connection->file_stat->device << 32);
+
+  return (key * 0x9E3779B97F4A7C15UL) >> 16;
+}
+
+
+/*!
+ * Scheduling lane of a request, and the work its connection has left.
+ *
+ * \param connection the connection.
+ * \param msg the request.
+ * \param remaining param-return bytes the connection still has to transfer.
+ *
+ * \return AKWBS_IO_LANE_LATENCY for the reads and writes of a short transfer, or the
+ *         first one of any transfer, whose client waits for its first bytes.
+ *         AKWBS_IO_LANE_BULK for the rest.
+ */
+static int choose_lane(struct akwbs_connection *connection,
+                       struct akwbs_request_io_msg *msg,
+                       off_t *remaining)
+{
+  *remaining = MAX(connection->file_total_offset - connection->file_cur_offset, 0);
+
+  /* The client waits for its file to be opened before anything else. */
+  if (msg->type == AKWBS_IO_OPEN_TYPE)
+    return AKWBS_IO_LANE_LATENCY;
+
+  if ((msg->type != AKWBS_IO_GET_TYPE) && (msg->type != AKWBS_IO_PUT_TYPE))
+    return AKWBS_IO_LANE_BULK;
+
+  if ((connection->io_submitted == 0)
+      || ((unsigned long)*remaining <= connection->io_group->latency_bytes))
+    return AKWBS_IO_LANE_LATENCY;
+
+  return AKWBS_IO_LANE_BULK;
+}
+
+
+/*!
+ * May a working thread be handed the requests of a lane.
+ *
+ * \param worker the thread.
+ * \param lane the lane.
+ *
+ * \return AKWBS_YES if it runs, and is not kept for the latency lane when lane is bulk.
+ *         AKWBS_NO otherwise.
+ */
+static int serves_lane(struct akwbs_io_worker *worker, int lane)
+{
+  if (__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) != AKWBS_IO_WORKER_RUNNING)
+    return AKWBS_NO;
+
+  if ((lane == AKWBS_IO_LANE_BULK)
+      && (__atomic_load_n(&worker->is_reserved, __ATOMIC_RELAXED) == AKWBS_YES))
+    return AKWBS_NO;
+
+  return AKWBS_YES;
+}
+
+
+/*!
+ * Push a request at the tail of a lane of the deque of a working thread, waking it if
+ * idle.
+ *
+ * \param worker the thread.
+ * \param lane the lane.
+ * \param job the request.
+ * \param was_idle param-return whether the thread was idle.
+ * \param depth param-return requests in the deque, this one included.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the lane is full, or the thread is retiring or not started.
+ */
+static int push_job(struct akwbs_io_worker *worker,
+                    int lane,
+                    const struct akwbs_io_job *job,
+                    int *was_idle,
+                    unsigned long *depth)
+{
+  pthread_mutex_lock(&worker->mutex);
+
+  if ((__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) != AKWBS_IO_WORKER_RUNNING)
+      || (worker->is_retiring == AKWBS_YES)
+      || (worker->tail[lane] - worker->head[lane] == AKWBS_POOL_DEQUE_SIZE))
+  {
+    pthread_mutex_unlock(&worker->mutex);
+    return AKWBS_ERROR;
+  }
+
+  worker->jobs[lane][worker->tail[lane] % AKWBS_POOL_DEQUE_SIZE] = *job;
+  worker->tail[lane]++;
+
+  *was_idle = worker->is_idle;
+  *depth    = worker->tail[AKWBS_IO_LANE_LATENCY] - worker->head[AKWBS_IO_LANE_LATENCY]
+              + worker->tail[AKWBS_IO_LANE_BULK] - worker->head[AKWBS_IO_LANE_BULK];
+
+  if (worker->is_idle == AKWBS_YES)
+    pthread_cond_signal(&worker->cond);
+
+  pthread_mutex_unlock(&worker->mutex);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Wake one idle working thread of a group, so it steals what a busy one holds.
+ *
+ * \param group the group.
+ * \param lane lane of the request to steal.
+ */
+static void wake_idle_worker(struct akwbs_io_group *group, int lane)
+{
+  struct akwbs_io_worker *worker = NULL;
+  unsigned int i;
+
+
+  for (i = 0; i < group->workers_count; i++)
+  {
+    worker = &group->workers[i];
+
+    if ((__atomic_load_n(&worker->is_idle, __ATOMIC_RELAXED) == AKWBS_NO)
+        || (serves_lane(worker, lane) == AKWBS_NO))
+      continue;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    if (worker->is_idle == AKWBS_YES)
+    {
+      pthread_cond_signal(&worker->cond);
+      pthread_mutex_unlock(&worker->mutex);
+      return;
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+  }
+}
+
+
+/*!
+ * Hand an I/O request of a connection to a working thread of its group. Called by the
+ * event loop only.
+ *
+ * \param connection the connection.
+ * \param msg the request.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if every deque is full; the request may be sent again later.
+ *
+ * \details The requests of a file go to the same thread, chosen by hashing the file
+ *          among the threads serving its lane, so its readahead stays warm in that
+ *          thread's sequence of reads; the reads in flight of a download are spread
+ *          over the threads following it. Bulk requests are never handed to the threads
+ *          kept for the latency lane. If the thread is busy while another is idle, the
+ *          idle one is woken to steal the request: at once for a latency request, and
+ *          for a bulk one only if it waits behind another request.
+ */
+int akwbs_pool_submit(struct akwbs_connection *connection, struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_io_group *group = connection->io_group;
+  struct akwbs_io_worker *worker = NULL;
+  struct akwbs_io_job job;
+  unsigned int running = 0;
+  unsigned int target  = 0;
+  unsigned int tries   = 0;
+  unsigned int steps;
+  unsigned int i;
+  unsigned long depth = 0;
+  unsigned long key;
+  int was_idle  = AKWBS_NO;
+  int is_pushed = AKWBS_NO;
+  int lane;
+
+
+  job.msg    = *msg;
+  job.passes = 0;
+  lane       = choose_lane(connection, msg, &job.remaining);
+
+  for (i = 0; i < group->workers_count; i++)
+    if (serves_lane(&group->workers[i], lane) == AKWBS_YES)
+      running++;
+
+  if (running == 0)
+    return AKWBS_ERROR;
+
+  key = affinity_key(connection);
+
+  /* The reads in flight of a download are striped over consecutive threads, and its
+   * advice goes to the thread after them, not to wait behind a read. */
+  if (msg->type == AKWBS_IO_GET_TYPE)
+    key += (unsigned long)(msg->offset / AKWBS_PIPELINE_READ_SIZE)
+           % connection->daemon_ref->read_depth;
+  else if (msg->type == AKWBS_IO_ADVISE_TYPE)
+    key += connection->daemon_ref->read_depth;
+
+  target = (unsigned int)(key % running);
+
+  clock_gettime(CLOCK_MONOTONIC, &job.queued_at);
+
+  /* From the target-th thread of the lane on, to the first one taking the request. Two
+   * rounds are enough, even if a thread retires meanwhile. */
+  for (i = 0, steps = 0;
+       (tries < running) && (steps < 2 * group->workers_count);
+       i = (i + 1) % group->workers_count, steps++)
+  {
+    worker = &group->workers[i];
+
+    if (serves_lane(worker, lane) == AKWBS_NO)
+      continue;
+
+    if (target > 0)
+    {
+      target--;
+      continue;
+    }
+
+    if (push_job(worker, lane, &job, &was_idle, &depth) == AKWBS_SUCCESS)
+    {
+      is_pushed = AKWBS_YES;
+      break;
+    }
+
+    tries++;
+  }
+
+  if (is_pushed == AKWBS_NO)
+    return AKWBS_ERROR;
+
+  connection->io_submitted++;
+
+  /* Pairs with the idle count raised by a thread before it last looks for work. */
+  __atomic_add_fetch(&group->pushes, 1, __ATOMIC_SEQ_CST);
+
+  if ((was_idle == AKWBS_NO)
+      && ((lane == AKWBS_IO_LANE_LATENCY) || (depth > 1))
+      && (__atomic_load_n(&group->idle_workers, __ATOMIC_SEQ_CST) > 0))
+    wake_idle_worker(group, lane);
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Must a request run after another one queued before it: both use the same file, or
+ * come from the same connection.
+ *
+ * \param earlier the request queued first.
+ * \param later the request queued next.
+ *
+ * \return AKWBS_YES if later must wait for earlier. AKWBS_NO otherwise.
+ */
+static int is_ordered_after(const struct akwbs_request_io_msg *earlier,
+                            const struct akwbs_request_io_msg *later)
+{
+  if ((earlier->fd != AKWBS_ERROR) && (earlier->fd == later->fd))
+    return AKWBS_YES;
+
+  return (earlier->sd == later->sd) ? AKWBS_YES : AKWBS_NO;
+}
+
+
+/*!
+ * Does a request end the use of a file or of an upload, so none of their I/O may be
+ * left behind it.
+ *
+ * \param msg the request.
+ *
+ * \return AKWBS_YES for closings and releasings. AKWBS_NO otherwise.
+ */
+static int is_closing(const struct akwbs_request_io_msg *msg)
+{
+  return ((msg->type == AKWBS_IO_CLOSE_TYPE) || (msg->type == AKWBS_IO_RELEASE_TYPE))
+         ? AKWBS_YES : AKWBS_NO;
+}
+
+
+/*!
+ * Does the latency lane of a deque hold a request that a request must run after.
+ * Called with the deque locked.
+ *
+ * \param worker the thread.
+ * \param later the request.
+ *
+ * \return AKWBS_YES if so. AKWBS_NO otherwise.
+ */
+static int has_latency_before(struct akwbs_io_worker *worker,
+                              const struct akwbs_request_io_msg *later)
+{
+  struct akwbs_io_job *jobs = worker->jobs[AKWBS_IO_LANE_LATENCY];
+  unsigned long seq;
+
+
+  for (seq = worker->head[AKWBS_IO_LANE_LATENCY];
+       seq != worker->tail[AKWBS_IO_LANE_LATENCY];
+       seq++)
+    if (is_ordered_after(&jobs[seq % AKWBS_POOL_DEQUE_SIZE].msg, later) == AKWBS_YES)
+      return AKWBS_YES;
+
+  return AKWBS_NO;
+}
+
+
+/*!
+ * Lane a working thread serves next, from its own deque. Called with the deque locked.
+ *
+ * \param worker the thread.
+ *
+ * \return the latency lane if it holds a request, unless AKWBS_POOL_LATENCY_BURST of
+ *         them were served in a row while bulk requests waited: the bulk lane keeps a
+ *         share of every thread it is handed to. Still, a closing at the head of the
+ *         bulk lane waits for the latency requests of its file or connection.
+ *         The bulk lane if only it holds a request.
+ *         AKWBS_IO_LANES if the deque is empty.
+ */
+static int next_lane(struct akwbs_io_worker *worker)
+{
+  int has_latency = (worker->tail[AKWBS_IO_LANE_LATENCY]
+                     != worker->head[AKWBS_IO_LANE_LATENCY]) ? AKWBS_YES : AKWBS_NO;
+  int has_bulk    = (worker->tail[AKWBS_IO_LANE_BULK]
+                     != worker->head[AKWBS_IO_LANE_BULK]) ? AKWBS_YES : AKWBS_NO;
+  struct akwbs_request_io_msg *bulk_head = NULL;
+
+
+  if (has_bulk == AKWBS_YES)
+    bulk_head = &worker->jobs[AKWBS_IO_LANE_BULK][worker->head[AKWBS_IO_LANE_BULK]
+                                                  % AKWBS_POOL_DEQUE_SIZE].msg;
+
+  if ((has_latency == AKWBS_YES)
+      && ((has_bulk == AKWBS_NO)
+          || (worker->latency_run < AKWBS_POOL_LATENCY_BURST)
+          || ((is_closing(bulk_head) == AKWBS_YES)
+              && (has_latency_before(worker, bulk_head) == AKWBS_YES))))
+  {
+    worker->latency_run = (has_bulk == AKWBS_YES) ? worker->latency_run + 1 : 0;
+    return AKWBS_IO_LANE_LATENCY;
+  }
+
+  worker->latency_run = 0;
+
+  return (has_bulk == AKWBS_YES) ? AKWBS_IO_LANE_BULK : AKWBS_IO_LANES;
+}
+
+
+/*!
+ * May a request of a lane be served before the ones queued ahead of it, from the head
+ * on. Called with the deque locked.
+ *
+ * \param worker the thread.
+ * \param lane the lane.
+ * \param seq sequence number of the request.
+ *
+ * \return AKWBS_YES if it is a read or a write, and none of the requests ahead of it
+ *         uses its file or comes from its connection. AKWBS_NO otherwise.
+ */
+static int may_pass(struct akwbs_io_worker *worker, int lane, unsigned long seq)
+{
+  struct akwbs_io_job *jobs = worker->jobs[lane];
+  struct akwbs_request_io_msg *later = &jobs[seq % AKWBS_POOL_DEQUE_SIZE].msg;
+  unsigned long ahead;
+
+
+  if ((later->type != AKWBS_IO_GET_TYPE) && (later->type != AKWBS_IO_PUT_TYPE))
+    return AKWBS_NO;
+
+  for (ahead = worker->head[lane]; ahead != seq; ahead++)
+    if (is_ordered_after(&jobs[ahead % AKWBS_POOL_DEQUE_SIZE].msg, later) == AKWBS_YES)
+      return AKWBS_NO;
+
+  return AKWBS_YES;
+}
+
+
+/*!
+ * Take a request from the head of a lane of the own deque of a working thread. Called
+ * with the deque locked, the lane holding a request.
+ *
+ * \param worker the thread.
+ * \param lane the lane.
+ * \param msg param-return the request.
+ *
+ * \details Of the first AKWBS_POOL_SRW_WINDOW requests, the read or write whose
+ *          connection has the least left to transfer is served first; the requests it
+ *          passes keep their order, each of them passed over once more. The head is
+ *          passed over at most AKWBS_POOL_SRW_PASSES times, so large transfers are
+ *          slowed, never starved. A request never passes one of its file or connection:
+ *          the requests of a file run in the order queued, its closing last.
+ */
+static void take_job(struct akwbs_io_worker *worker,
+                     int lane,
+                     struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_io_job *jobs = worker->jobs[lane];
+  unsigned long head     = worker->head[lane];
+  unsigned long shortest = head;
+  unsigned long seq;
+  struct akwbs_io_job job;
+
+
+  if (jobs[head % AKWBS_POOL_DEQUE_SIZE].passes < AKWBS_POOL_SRW_PASSES)
+    for (seq = head + 1;
+         (seq != worker->tail[lane]) && (seq - head < AKWBS_POOL_SRW_WINDOW);
+         seq++)
+      if ((jobs[seq % AKWBS_POOL_DEQUE_SIZE].remaining
+           < jobs[shortest % AKWBS_POOL_DEQUE_SIZE].remaining)
+          && (may_pass(worker, lane, seq) == AKWBS_YES))
+        shortest = seq;
+
+  job = jobs[shortest % AKWBS_POOL_DEQUE_SIZE];
+
+  for (seq = shortest; seq != head; seq--)
+  {
+    jobs[seq % AKWBS_POOL_DEQUE_SIZE] = jobs[(seq - 1) % AKWBS_POOL_DEQUE_SIZE];
+    jobs[seq % AKWBS_POOL_DEQUE_SIZE].passes++;
+  }
+
+  *msg = job.msg;
+
+  worker->head[lane]++;
+}
+
+
+/*!
+ * Steal a request from the tail of a lane of the deque of another thread of the group.
+ * A closing is left to its owner, which runs it after the requests of its file queued
+ * before it.
+ *
+ * \param thief the stealing thread.
+ * \param lane the lane.
+ * \param msg param-return the request stolen.
+ *
+ * \return AKWBS_SUCCESS if a request was stolen.
+ *         AKWBS_ERROR if that lane of every other deque is empty.
+ */
+static int steal_job(struct akwbs_io_worker *thief, int lane, struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_io_group *group   = thief->group;
+  struct akwbs_io_worker *victim = NULL;
+  unsigned int first = (unsigned int)(thief - group->workers);
+  unsigned int i;
+
+
+  for (i = 1; i < group->workers_count; i++)
+  {
+    victim = &group->workers[(first + i) % group->workers_count];
+
+    if (__atomic_load_n(&victim->state, __ATOMIC_ACQUIRE) != AKWBS_IO_WORKER_RUNNING)
+      continue;
+
+    /* A glance without the lock skips the empty deques, most of them when idle. */
+    if (__atomic_load_n(&victim->tail[lane], __ATOMIC_RELAXED)
+        == __atomic_load_n(&victim->head[lane], __ATOMIC_RELAXED))
+      continue;
+
+    pthread_mutex_lock(&victim->mutex);
+
+    if ((victim->tail[lane] != victim->head[lane])
+        && (is_closing(&victim->jobs[lane][(victim->tail[lane] - 1)
+                                           % AKWBS_POOL_DEQUE_SIZE].msg) == AKWBS_NO))
+    {
+      victim->tail[lane]--;
+      *msg = victim->jobs[lane][victim->tail[lane] % AKWBS_POOL_DEQUE_SIZE].msg;
+
+      pthread_mutex_unlock(&victim->mutex);
+
+      __atomic_add_fetch(&thief->steals, 1, __ATOMIC_RELAXED);
+
+      return AKWBS_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&victim->mutex);
+  }
+
+  return AKWBS_ERROR;
+}
+
+
+/*!
+ * Take the next request of a working thread: from its own deque, or else one stolen
+ * from another thread of its group, from the latency lane first. A thread kept for the
+ * latency lane steals no bulk request. Waits while there is none.
+ *
+ * \param worker the thread.
+ * \param msg param-return the request.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR if the thread is retiring and its deque is empty: it must exit.
+ *
+ * \details Before waiting, the thread counts itself idle and checks that nothing was
+ *          pushed since it last looked; the event loop counts its push and then checks
+ *          for idle threads. One of them sees the other, so no request waits in a busy
+ *          thread's deque while another thread sleeps.
+ */
+int akwbs_pool_take(struct akwbs_io_worker *worker, struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_io_group *group = worker->group;
+  unsigned long pushes = 0;
+  int lane;
+
+
+  while (1)
+  {
+    pthread_mutex_lock(&worker->mutex);
+
+    lane = next_lane(worker);
+
+    if (lane != AKWBS_IO_LANES)
+    {
+      take_job(worker, lane, msg);
+
+      pthread_mutex_unlock(&worker->mutex);
+      return AKWBS_SUCCESS;
+    }
+
+    if (worker->is_retiring == AKWBS_YES)
+    {
+      pthread_mutex_unlock(&worker->mutex);
+      return AKWBS_ERROR;
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+
+    pushes = __atomic_load_n(&group->pushes, __ATOMIC_SEQ_CST);
+
+    if (steal_job(worker, AKWBS_IO_LANE_LATENCY, msg) == AKWBS_SUCCESS)
+      return AKWBS_SUCCESS;
+
+    if ((__atomic_load_n(&worker->is_reserved, __ATOMIC_RELAXED) == AKWBS_NO)
+        && (steal_job(worker, AKWBS_IO_LANE_BULK, msg) == AKWBS_SUCCESS))
+      return AKWBS_SUCCESS;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    worker->is_idle = AKWBS_YES;
+    __atomic_add_fetch(&group->idle_workers, 1, __ATOMIC_SEQ_CST);
+
+    if ((worker->tail[AKWBS_IO_LANE_LATENCY] == worker->head[AKWBS_IO_LANE_LATENCY])
+        && (worker->tail[AKWBS_IO_LANE_BULK] == worker->head[AKWBS_IO_LANE_BULK])
+        && (worker->is_retiring == AKWBS_NO)
+        && (__atomic_load_n(&group->pushes, __ATOMIC_SEQ_CST) == pushes))
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+
+    worker->is_idle = AKWBS_NO;
+    __atomic_sub_fetch(&group->idle_workers, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&worker->mutex);
+  }
+}
+
+
+/*!
+ * Account the time a working thread spent blocked in I/O. Called by working threads.
+ *
+ * \param group group of the thread.
+ * \param start when the I/O started, on the monotonic clock.
+ */
+void akwbs_pool_account_io(struct akwbs_io_group *group, const struct timespec *start)
+{
+  struct timespec now;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  __atomic_add_fetch(&group->io_usec, elapsed_us(start, &now), __ATOMIC_RELAXED);
+}
+
+
+/*!
+ * Flag a working thread as retired, to be joined by the autoscaler. Called by the
+ * thread itself, right before it exits.
+ *
+ * \param worker the thread.
+ */
+void akwbs_pool_retired(struct akwbs_io_worker *worker)
+{
+  __atomic_store_n(&worker->state, AKWBS_IO_WORKER_EXITED, __ATOMIC_RELEASE);
+}
+
+
+/*!
+ * Stop the autoscaler and the working threads, and free the pools.
+ *
+ * \param daemon_p daemon structure.
+ */
+void akwbs_pool_destroy(struct akwbs_daemon *daemon_p)
+{
+  struct akwbs_io_pool *pool = NULL;
+  void *res = NULL;
+
+
+  if (daemon_p->has_scaler == AKWBS_YES)
+  {
+    pthread_cancel(daemon_p->scaler_thread);
+    pthread_join(daemon_p->scaler_thread, &res);
+    daemon_p->has_scaler = AKWBS_NO;
+  }
+
+  while (daemon_p->io_pools != NULL)
+  {
+    pool               = daemon_p->io_pools;
+    daemon_p->io_pools = pool->next;
+
+    destroy_pool(pool);
+  }
+
+  free(daemon_p->io_nodes);
+
+  daemon_p->io_nodes       = NULL;
+  daemon_p->io_root_pool   = NULL;
+  daemon_p->io_pools_count = 0;
+}
@@ -0,0 +1,243 @@
+/*!
+ * \file   pool.h
+ * \brief  The pools of I/O working threads, one per device: their size, their CPUs and
+ *         their NUMA nodes.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_POOL_H_
+#define _AKWBS_MT_POOL_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "requestio.h"
+
+
+#define AKWBS_POOL_NODE_PATH "/sys/devices/system/node" /*!< NUMA nodes of the host.    */
+
+#define AKWBS_POOL_MAX_DEVICES   16     /*!< Devices with their own working threads.    */
+
+#define AKWBS_POOL_DEQUE_SIZE   256     /*!< Requests a lane holds, a power of two.     */
+
+#define AKWBS_POOL_SRW_WINDOW     4     /*!< Requests at the head of a lane among which
+                                         *   the least remaining work is served first.
+                                         */
+
+#define AKWBS_POOL_SRW_PASSES     8     /*!< Times a request may be passed over.        */
+
+#define AKWBS_POOL_LATENCY_BURST  8     /*!< Latency requests a thread serves in a row
+                                         *   while bulk ones wait in its deque.
+                                         */
+
+#define AKWBS_POOL_TICK_US    100000    /*!< Period of the autoscaler.                  */
+
+#define AKWBS_POOL_GROW_AGE_US 20000    /*!< Age of the oldest request that is too old. */
+
+#define AKWBS_POOL_GROW_BLOCKED  50     /*!< Percent of time blocked in I/O above which
+                                         *   more threads mean more I/O in flight.
+                                         */
+
+#define AKWBS_POOL_GROW_TICKS     3     /*!< Ticks under pressure before growing.       */
+
+#define AKWBS_POOL_SHRINK_BLOCKED 25    /*!< Percent of time blocked in I/O below which
+                                         *   a group with no backlog is idle.
+                                         */
+
+#define AKWBS_POOL_SHRINK_TICKS  50     /*!< Idle ticks before retiring a thread.       */
+
+
+struct akwbs_daemon;
+struct akwbs_server_conf;
+struct akwbs_connection;
+struct ring_buffer;
+struct akwbs_io_group;
+struct akwbs_io_pool;
+struct akwbs_io_nodes;
+
+
+/*!
+ * Scheduling lanes of the requests.
+ */
+enum akwbs_io_lane
+{
+  AKWBS_IO_LANE_LATENCY = 0,    /*!< Small transfers and first chunks: a client waits.  */
+
+  AKWBS_IO_LANE_BULK,           /*!< The rest of large transfers, and background work.  */
+
+  AKWBS_IO_LANES                /*!< Number of lanes.                                   */
+};
+
+
+/*!
+ * An I/O request waiting in a deque.
+ */
+struct akwbs_io_job
+{
+  struct akwbs_request_io_msg msg; /*!< The request.                                    */
+
+  struct timespec queued_at;    /*!< When it was queued, on the monotonic clock.        */
+
+  off_t remaining;              /*!< Bytes its connection still has to transfer.        */
+
+  unsigned int passes;          /*!< Times it was passed over for less remaining work.  */
+};
+
+
+/*!
+ * States of the slot of a working thread.
+ */
+enum akwbs_io_worker_state
+{
+  AKWBS_IO_WORKER_FREE = 0,     /*!< No thread.                                         */
+
+  AKWBS_IO_WORKER_RUNNING,      /*!< The thread serves its deque.                       */
+
+  AKWBS_IO_WORKER_EXITED        /*!< The thread was retired and must be joined.         */
+};
+
+
+/*!
+ * A working thread of the pool, and its deque of requests, one ring per lane. The event
+ * loop pushes at the tails, the thread takes from the heads, and idle threads of the
+ * same group steal from the tails.
+ */
+struct akwbs_io_worker
+{
+  pthread_t thread_id;          /*!< Id of the thread.                                  */
+
+  struct akwbs_daemon
+    *daemon_ref;                /*!< Daemon served by this thread.                      */
+
+  struct akwbs_io_group *group; /*!< Group of this thread.                              */
+
+  int state;                    /*!< State of the slot, enum akwbs_io_worker_state.     */
+
+  pthread_mutex_t mutex;        /*!< Mutex variable for the deque.                      */
+
+  pthread_cond_t cond;          /*!< Condition variable the idle thread waits on.       */
+
+  struct akwbs_io_job
+    *jobs[AKWBS_IO_LANES];      /*!< Rings of AKWBS_POOL_DEQUE_SIZE requests.           */
+
+  unsigned long
+    head[AKWBS_IO_LANES];       /*!< Sequence numbers of the first requests.            */
+
+  unsigned long
+    tail[AKWBS_IO_LANES];       /*!< Sequence numbers past the last requests.           */
+
+  int is_reserved;              /*!< Is the thread kept for the latency lane.           */
+
+  unsigned int latency_run;     /*!< Latency requests served in a row over bulk ones.   */
+
+  int is_idle;                  /*!< Is the thread waiting on its condition variable.   */
+
+  int is_retiring;              /*!< Must the thread exit once its deque is empty.      */
+
+  unsigned long steals;         /*!< Requests stolen by this thread.                    */
+};
+
+
+/*!
+ * The working threads of one device on one NUMA node.
+ */
+struct akwbs_io_group
+{
+  struct akwbs_io_pool *pool;   /*!< Pool of the group.                                 */
+
+  int node;                     /*!< NUMA node of the working threads.                  */
+
+  void *cpus;                   /*!< cpu_set_t of its threads, or NULL if not pinned.   */
+
+  struct akwbs_io_worker
+    *workers;                   /*!< Slots of the working threads.                      */
+
+  unsigned int workers_count;   /*!< Number of slots, the most threads at once.         */
+
+  unsigned int idle_workers;    /*!< Threads waiting for a request.                     */
+
+  unsigned long pushes;         /*!< Requests pushed so far.                            */
+
+  unsigned long io_usec;        /*!< Microseconds the threads spent blocked in I/O.     */
+
+  unsigned int threads;         /*!< Working threads of this group.                     */
+
+  unsigned int min_threads;     /*!< Fewest threads the autoscaler leaves.              */
+
+  unsigned int reserve_percent; /*!< Share of the threads kept for the latency lane.    */
+
+  unsigned int reserved;        /*!< Threads kept for the latency lane.                 */
+
+  unsigned long latency_bytes;  /*!< Remaining bytes of a latency lane transfer.        */
+
+  unsigned int pressure_ticks;  /*!< Consecutive ticks with an aging backlog.           */
+
+  unsigned int idle_ticks;      /*!< Consecutive ticks with no backlog and little I/O.  */
+
+  unsigned long scale_ups;      /*!< Threads started by the autoscaler.                 */
+
+  unsigned long scale_downs;    /*!< Threads retired by the autoscaler.                 */
+
+  unsigned long last_io_usec;   /*!< io_usec at the previous tick.                      */
+
+  unsigned long depth;          /*!< Backlog at the last tick.                          */
+
+  unsigned long
+    lane_depth[AKWBS_IO_LANES]; /*!< Backlog of each lane at the last tick.             */
+
+  unsigned long oldest_age_us;  /*!< Age of the oldest request at the last tick.        */
+
+  unsigned int blocked_percent; /*!< Time blocked in I/O during the last tick.          */
+};
+
+
+/*!
+ * The working threads of one device, so a slow or failing disk only stalls its own
+ * requests.
+ */
+struct akwbs_io_pool
+{
+  dev_t device;                 /*!< Device whose files the threads read and write.     */
+
+  struct akwbs_io_group
+    *groups;                    /*!< Working threads, one group per NUMA node used.     */
+
+  unsigned int groups_count;    /*!< Number of groups.                                  */
+
+  int is_inline_read;           /*!< May cached data be read by the event loop itself,
+                                 *   without waiting; cleared once the device turns
+                                 *   out not to support it.
+                                 */
+
+  int is_inline_write;          /*!< Likewise, for writes to the page cache.            */
+
+  char *prefix;                 /*!< Request path of the device under root_path, as
+                                 *   given by device_threads, so its files are opened
+                                 *   by its threads; or NULL.
+                                 */
+
+  size_t prefix_length;         /*!< Length of that path.                               */
+
+  struct akwbs_io_pool *next;   /*!< Pool of the next device.                           */
+};
+
+
+/*
+ * Public Interface.
+ */
+int akwbs_pool_check_cpus(const char *list);
+int akwbs_pool_check_devices(const char *list);
+int akwbs_pool_create(struct akwbs_daemon *daemon_p, struct akwbs_server_conf *conf);
+int akwbs_pool_pin_loop(struct akwbs_server_conf *conf);
+struct akwbs_io_group *akwbs_pool_assign(struct akwbs_daemon *daemon_p,
+                                         struct ring_buffer *buffer);
+void akwbs_pool_route(struct akwbs_connection *connection);
+void akwbs_pool_route_opening(struct akwbs_connection *connection);
+int akwbs_pool_submit(struct akwbs_connection *connection, struct akwbs_request_io_msg *msg);
+int akwbs_pool_take(struct akwbs_io_worker *worker, struct akwbs_request_io_msg *msg);
+void akwbs_pool_account_io(struct akwbs_io_group *group, const struct timespec *start);
+void akwbs_pool_retired(struct akwbs_io_worker *worker);
+void akwbs_pool_destroy(struct akwbs_daemon *daemon_p);
+
+#endif /* END OF pool.h */
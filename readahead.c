@@ -0,0 +1,203 @@
+/*!
+ * \file   readahead.c
+ * \brief  Readahead of downloads. The kernel readahead of a file is shared by all its
+ *         readers, through the one descriptor, and the pipelined reads of a download
+ *         reach it out of order; neither tells it how fast each download goes. So
+ *         each download keeps its own window read ahead of its reads, holding what its
+ *         socket sends in AKWBS_READAHEAD_HORIZON_MS, up to readahead_max: a slow
+ *         client does not flood the cache, a fast one never waits on the disk. Large
+ *         files read by a single download are dropped from the cache behind it.
+ *         The kernel readahead of the files served is turned off, so it does not fight
+ *         the windows. The event loop plans the advice; the working threads give it, so
+ *         it never blocks the event loop.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#include <fcntl.h>
+#include <sys/param.h>
+
+#include <strings.h>
+
+#include "readahead.h"
+#include "connection.h"
+#include "daemon.h"
+#include "file_tree.h"
+#include "internal.h"
+#include "pool.h"
+#include "ringbuffer.h"
+
+
+#define AKWBS_READAHEAD_PAGE 4096   /*!< Pages dropped from the cache are whole.        */
+
+
+/*!
+ * Sample the send rate of a download, and bound its window from it.
+ *
+ * \param connection connection sending a file.
+ * \param sent bytes of the file sent so far, its offset.
+ * \param now current time.
+ */
+static void sample_rate(struct akwbs_connection *connection, off_t sent, struct timespec *now)
+{
+  struct akwbs_readahead *readahead = &connection->readahead;
+  unsigned long readahead_max = connection->daemon_ref->readahead_max;
+  unsigned long instant = 0;
+  long elapsed_ms = 0;
+
+
+  elapsed_ms = (now->tv_sec - readahead->mark_time.tv_sec) * 1000
+               + (now->tv_nsec - readahead->mark_time.tv_nsec) / 1000000;
+
+  if (elapsed_ms < AKWBS_READAHEAD_SAMPLE_MS)
+    return;
+
+  instant = (unsigned long)(sent - readahead->mark_offset) * 1000 / (unsigned long)elapsed_ms;
+
+  readahead->rate        = (readahead->rate == 0) ? instant : (readahead->rate + instant) / 2;
+  readahead->mark_offset = sent;
+  readahead->mark_time   = *now;
+  readahead->limit       = MAX(readahead->rate / 1000 * AKWBS_READAHEAD_HORIZON_MS,
+                               AKWBS_READAHEAD_MIN);
+  readahead->limit       = MIN(readahead->limit, readahead_max);
+  readahead->window      = MIN(readahead->window, readahead->limit);
+}
+
+
+/*!
+ * Plan the advice for a download: read ahead the next window once half of it is
+ * consumed by the reads, and, for a cold file, drop a window of sent bytes once that
+ * many are behind. The window doubles each time, up to the bound from the send rate,
+ * so a fast download is soon read ahead in large requests.
+ *
+ * \param connection connection sending a file.
+ * \param msg return-param request getting the advice.
+ *
+ * \return AKWBS_YES if there is advice to give, AKWBS_NO otherwise.
+ *
+ * \details A file is cold when it is at least drop_behind_size large and this download
+ *          is its only reader; bytes other downloads may read soon are never dropped.
+ */
+static int plan(struct akwbs_connection *connection, struct akwbs_request_io_msg *msg)
+{
+  struct akwbs_readahead *readahead = &connection->readahead;
+  struct akwbs_daemon *daemon_p     = connection->daemon_ref;
+  struct akwbs_file_stat *file_stat = connection->file_stat;
+  struct timespec now;
+  off_t sent = connection->file_cur_offset
+               - (off_t)ring_buffer_count_bytes(&connection->buffer);
+  off_t end  = connection->file_cur_offset + (off_t)connection->pipeline.bytes;
+  off_t page = 0;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  /* The first read, or the first of a range before the previous one. */
+  if ((readahead->window == 0) || (sent < readahead->mark_offset))
+  {
+    readahead->ahead_offset   = sent;
+    readahead->dropped_offset = sent - sent % AKWBS_READAHEAD_PAGE;
+    readahead->mark_offset    = sent;
+    readahead->mark_time      = now;
+    readahead->window         = MIN(AKWBS_READAHEAD_MIN, daemon_p->readahead_max);
+    readahead->limit          = daemon_p->readahead_max;
+  }
+  else
+    sample_rate(connection, sent, &now);
+
+  readahead->ahead_offset = MAX(readahead->ahead_offset, end);
+
+  if ((readahead->ahead_offset - end < (off_t)readahead->window / 2)
+      && (readahead->ahead_offset < connection->file_total_offset))
+  {
+    readahead->window = MIN(readahead->window * 2, readahead->limit);
+
+    msg->readahead_offset = readahead->ahead_offset;
+    msg->readahead_bytes  = MIN(end + (off_t)readahead->window,
+                                connection->file_total_offset)
+                            - readahead->ahead_offset;
+
+    readahead->ahead_offset += msg->readahead_bytes;
+  }
+
+  if ((daemon_p->drop_behind_size == 0)
+      || (file_stat == NULL)
+      || (file_stat->size < (off_t)daemon_p->drop_behind_size)
+      || (file_stat->number_of_references > 1))
+    return (msg->readahead_bytes > 0) ? AKWBS_YES : AKWBS_NO;
+
+  page = sent - sent % AKWBS_READAHEAD_PAGE;
+
+  if (page - readahead->dropped_offset >= (off_t)readahead->window)
+  {
+    msg->drop_offset = readahead->dropped_offset;
+    msg->drop_bytes  = page - readahead->dropped_offset;
+
+    readahead->dropped_offset = page;
+  }
+
+  return ((msg->readahead_bytes > 0) || (msg->drop_bytes > 0)) ? AKWBS_YES : AKWBS_NO;
+}
+
+
+/*!
+ * Turn off the kernel readahead of a file served, which the windows of its downloads
+ * replace. Called once the file is opened.
+ *
+ * \param daemon_p the daemon.
+ * \param fd descriptor of the file.
+ */
+void akwbs_readahead_own(struct akwbs_daemon *daemon_p, int fd)
+{
+  if (daemon_p->readahead_max > 0)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+}
+
+
+/*!
+ * Hand the advice due for a download, if any, to a working thread. Called by the event
+ * loop whenever reads of the download were handed over, or done inline.
+ *
+ * \param connection connection sending a file, not compressed.
+ *
+ * \details A download read directly is left alone. If the request queue is full, the
+ *          advice is planned again next time.
+ */
+void akwbs_readahead_submit(struct akwbs_connection *connection)
+{
+  struct akwbs_readahead readahead = connection->readahead;
+  struct akwbs_request_io_msg msg;
+
+
+  if ((connection->daemon_ref->readahead_max == 0)
+      || (connection->direct_descriptor != AKWBS_ERROR))
+    return;
+
+  bzero(&msg, sizeof(struct akwbs_request_io_msg));
+
+  if (plan(connection, &msg) == AKWBS_NO)
+    return;
+
+  msg.sd           = connection->client_socket;
+  msg.fd           = connection->file_descriptor;
+  msg.type         = AKWBS_IO_ADVISE_TYPE;
+  msg.directory_fd = AKWBS_ERROR;
+  msg.source_fd    = AKWBS_ERROR;
+
+  if (akwbs_pool_submit(connection, &msg) == AKWBS_ERROR)
+    connection->readahead = readahead;
+}
+
+
+/*!
+ * Give the advice for a download. Called by working threads.
+ *
+ * \param msg request holding the advice.
+ */
+void akwbs_readahead_apply(struct akwbs_request_io_msg *msg)
+{
+  if (msg->readahead_bytes > 0)
+    posix_fadvise(msg->fd, msg->readahead_offset, msg->readahead_bytes, POSIX_FADV_WILLNEED);
+
+  if (msg->drop_bytes > 0)
+    posix_fadvise(msg->fd, msg->drop_offset, msg->drop_bytes, POSIX_FADV_DONTNEED);
+}
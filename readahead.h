@@ -0,0 +1,59 @@
+/*!
+ * \file   readahead.h
+ * \brief  Readahead of downloads, sized from their send rate, and cache drop behind them.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_READAHEAD_H_
+#define _AKWBS_MT_READAHEAD_H_
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "requestio.h"
+
+
+#define AKWBS_READAHEAD_MIN       (512 * 1024) /*!< Smallest window, before any rate.  */
+
+#define AKWBS_READAHEAD_HORIZON_MS 500         /*!< The window holds what the socket
+                                                *   sends in this time.
+                                                */
+
+#define AKWBS_READAHEAD_SAMPLE_MS  100         /*!< Period of the send rate samples.    */
+
+
+struct akwbs_connection;
+struct akwbs_daemon;
+
+
+/*!
+ * Readahead state of a download.
+ */
+struct akwbs_readahead
+{
+  off_t ahead_offset;           /*!< Readahead was asked for up to this file offset.    */
+
+  off_t dropped_offset;         /*!< Sent bytes below it were dropped from the cache.   */
+
+  size_t window;                /*!< Bytes kept read ahead of the reads, 0 before the
+                                 *   first read.
+                                 */
+
+  size_t limit;                 /*!< Largest window, from the send rate.                */
+
+  unsigned long rate;           /*!< Smoothed send rate, in bytes per second.           */
+
+  off_t mark_offset;            /*!< Bytes of the file sent at the last sample.         */
+
+  struct timespec mark_time;    /*!< Time of the last sample.                           */
+};
+
+
+/*
+ * Public Interface.
+ */
+void akwbs_readahead_own(struct akwbs_daemon *daemon_p, int fd);
+void akwbs_readahead_submit(struct akwbs_connection *connection);
+void akwbs_readahead_apply(struct akwbs_request_io_msg *msg);
+
+#endif /* END OF readahead.h */
@@ -1,6 +1,6 @@
 /*!
  * \file requestio.h
- * \brief Public interface for sending and receiving request I/O messages.
+ * \brief I/O requests handed to the working threads.
  * \author Henrique Nascimento Gouveia <henrique.gouveia@aker.com.br>
  */
 
@@ -12,9 +12,11 @@
 #include <stdlib.h>
 
 #include "io.h"
+#include "writeback.h"
 
 
-#define AKWBS_REQUEST_IO_FIFO_PATH "/tmp/akwbs_mt" /*!< Path where the FIFO resides.    */
+struct akwbs_connection;
+
 
 /*!
  * This structure represents an I/O request message.
@@ -27,17 +29,18 @@ struct akwbs_request_io_msg
   ssize_t            bytes;       /*!< Bytes in or available in this buffer.            */
   off_t              offset;      /*!< Start performing I/O on this offset.             */
   enum akwbs_io_type type;        /*!< Type of I/O that must be performed.              */
+  off_t              synced_offset; /*!< Written bytes below it are on disk.            */
+  struct akwbs_writeback_device
+                     *writeback_device; /*!< Dirty byte account of the written file.    */
+  int                directory_fd;  /*!< Directory synced along with the file, or -1.   */
+  int                source_fd;     /*!< File copied into the file, for copies.         */
+  off_t              readahead_offset; /*!< Start of the bytes to read ahead.            */
+  off_t              readahead_bytes;  /*!< Bytes to read ahead, or 0, for advice.       */
+  off_t              drop_offset;      /*!< Start of the bytes to drop from the cache.   */
+  off_t              drop_bytes;       /*!< Bytes to drop, or 0, for advice.             */
+  struct akwbs_connection
+                     *connection;   /*!< Connection its result goes back to, or NULL.   */
 };
 
 
-/*
- * Public Interface.
- */
-int akwbs_request_io_create_queue(void);
-int akwbs_request_io_open_for_write(int *write_fd);
-int akwbs_request_io_open_for_read(int *read_fd);
-int akwbs_request_io_recv_msg(struct akwbs_request_io_msg *msg, int read_fd);
-int akwbs_request_io_send_msg(struct akwbs_request_io_msg *msg, int write_fd);
-
-
 #endif /* END OF requestio.h */
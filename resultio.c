@@ -22,6 +22,10 @@ int akwbs_result_io_init_msg(struct akwbs_result_io *msg)
 {
   msg->connection_fd = 0;
   msg->bytes_read    = 0;
+  msg->type          = AKWBS_IO_UNKNOWN_TYPE;
+  msg->address       = NULL;
+  msg->synced_offset = 0;
+  msg->connection    = NULL;
 
   return AKWBS_SUCCESS;
 }
@@ -7,6 +7,10 @@
 #ifndef _AKWBS_MT_RESULTIO_H
 #define _AKWBS_MT_RESULTIO_H
 
+#include "io.h"
+
+struct akwbs_connection;
+
 /*!
  * This structure represents a result  message of requested I/O operation.
  */
@@ -14,6 +18,12 @@ struct akwbs_result_io
 {
   int    connection_fd;         /*!< Client socket.                                     */
   size_t bytes_read;            /*!< Bytes read from the queue.                         */
+  enum akwbs_io_type type;      /*!< Type of the I/O performed.                         */
+  void   *address;              /*!< Buffer address of the I/O request.                 */
+  off_t  synced_offset;         /*!< Written bytes below it are on disk.                */
+  int    error;                 /*!< errno of a failed read or write, or 0.             */
+  struct akwbs_connection
+         *connection;           /*!< Connection of the request, or NULL.                */
 };
 
 
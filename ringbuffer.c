@@ -199,3 +199,16 @@ void ring_buffer_clear(struct ring_buffer *buffer)
   buffer->write_offset_bytes = 0;
   buffer->read_offset_bytes  = 0;
 }
+
+/*!
+ * Set both - read and write - offset bytes of an empty buffer to the given offset, so
+ * the next data written starts at some wanted alignment.
+ *
+ * \param buffer address of the structure ring_buffer.
+ * \param offset_bytes the offset, below the length of the buffer.
+ */
+void ring_buffer_clear_at(struct ring_buffer *buffer, size_t offset_bytes)
+{
+  buffer->write_offset_bytes = offset_bytes;
+  buffer->read_offset_bytes  = offset_bytes;
+}
@@ -47,6 +47,7 @@ void ring_buffer_read_advance(struct ring_buffer *buffer, size_t count_bytes);
 unsigned long ring_buffer_count_bytes(struct ring_buffer *buffer);
 unsigned long ring_buffer_count_free_bytes(struct ring_buffer *buffer);
 void ring_buffer_clear(struct ring_buffer *buffer);
+void ring_buffer_clear_at(struct ring_buffer *buffer, size_t offset_bytes);
 
 
 #endif
@@ -9,12 +9,20 @@
 #include <errno.h>
 #include <pthread.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <time.h>
 
 #include "internal.h"
 #include "daemon.h"
 #include "resultio.h"
 #include "requestio.h"
+#include "compress.h"
+#include "writeback.h"
+#include "commit.h"
+#include "multipart.h"
+#include "copy.h"
+#include "pool.h"
+#include "readahead.h"
+#include "opening.h"
 
 
 
@@ -23,19 +31,19 @@
  * Clean up handler called when a thread is cancelled.
  *
  * \param arg argument passed to this cleaner when it was called. Actually, this is a
- *        pointer to the daemon structure.
+ *        pointer to the worker structure of the thread, whose deque it may hold locked.
  */
 static void thread_cleanup_routine(void *arg)
 {
-  struct akwbs_daemon *daemon_p = NULL;
+  struct akwbs_io_worker *worker = NULL;
 
 
   if (arg == NULL)
     return;
 
-  daemon_p = (struct akwbs_daemon *)arg;
+  worker = (struct akwbs_io_worker *)arg;
 
-  pthread_mutex_unlock(&daemon_p->request_io_queue_mutex);
+  pthread_mutex_unlock(&worker->mutex);
 
 
 }
@@ -64,63 +72,86 @@ static int setup_io_thread(void)
 /*!
  * Main routine of working threads.
  *
- * \param arg argument to this routine.
+ * \param arg argument to this routine: the worker structure of the thread.
+ *
+ * \details A thread exits once retired by the autoscaler and its deque is empty.
  */
 void *akwbs_thread_io_routine(void *arg)
 {
-  struct akwbs_daemon *daemon_p = NULL;
+  struct akwbs_daemon *daemon_p   = NULL;
+  struct akwbs_io_worker *worker  = NULL;
+  struct akwbs_io_group *group    = NULL;
   struct akwbs_request_io_msg msg;
   struct akwbs_result_io result_msg;
+  struct timespec io_start;
 
 
   if (arg == NULL)
     pthread_exit(NULL);
 
-  daemon_p = (struct akwbs_daemon *)arg;
+  worker   = (struct akwbs_io_worker *)arg;
+  daemon_p = worker->daemon_ref;
+  group    = worker->group;
 
   if (setup_io_thread() == AKWBS_ERROR)
     pthread_exit(NULL);
 
-  pthread_cleanup_push(thread_cleanup_routine, daemon_p)
+  pthread_cleanup_push(thread_cleanup_routine, worker)
 
   while (1)
   {
-    ssize_t ret = 0;
-
     bzero(&msg, sizeof(struct akwbs_request_io_msg));
     bzero(&result_msg, sizeof(struct akwbs_result_io));
 
-    if (pthread_mutex_lock(&daemon_p->request_io_queue_mutex) != AKWBS_SUCCESS)
-      pthread_exit(NULL);
-
-    while ((ret = read(daemon_p->request_io_queue[AKWBS_READ_INDEX],
-                       &msg,
-                       sizeof(struct akwbs_request_io_msg))) == AKWBS_ERROR)
+    if (akwbs_pool_take(worker, &msg) == AKWBS_ERROR)
+      break;
+
+    clock_gettime(CLOCK_MONOTONIC, &io_start);
+
+    if (msg.type == AKWBS_IO_COMPRESS_TYPE)
+      akwbs_compress_run(&msg);
+    else if (msg.type == AKWBS_IO_SYNC_TYPE)
+      msg.bytes = akwbs_commit_sync(msg.connection);
+    else if (msg.type == AKWBS_IO_ASSEMBLE_TYPE)
+      akwbs_multipart_assemble(&msg);
+    else if (msg.type == AKWBS_IO_COPY_TYPE)
+      akwbs_copy_run(&msg);
+    else if (msg.type == AKWBS_IO_ADVISE_TYPE)
+      akwbs_readahead_apply(&msg);
+    else if (msg.type == AKWBS_IO_OPEN_TYPE)
+      akwbs_opening_open_run(&msg);
+    else if (msg.type == AKWBS_IO_CLOSE_TYPE)
+      akwbs_opening_close_run(&msg);
+    else if (msg.type == AKWBS_IO_RELEASE_TYPE)
+      akwbs_opening_release_run(&msg);
+    else
     {
-      if (errno == EAGAIN)
-      {
-        if (pthread_cond_wait(&daemon_p->request_io_queue_cond,
-                              &daemon_p->request_io_queue_mutex) != AKWBS_SUCCESS)
-        {
-          pthread_mutex_unlock(&daemon_p->request_io_queue_mutex);
-          pthread_exit(NULL);
-        }
-      }
-      else
-      {
-        pthread_mutex_unlock(&daemon_p->request_io_queue_mutex);
-        pthread_exit(NULL);
-      }
+      errno = 0;
+
+      if (akwbs_do_io(msg.fd, msg.address, &msg.bytes, &msg.offset, msg.type)
+          == AKWBS_ERROR)
+        result_msg.error = (errno != 0) ? errno : EIO;
+
+      if (msg.type == AKWBS_IO_PUT_TYPE)
+        akwbs_writeback_after_write(&msg,
+                                    daemon_p->writeback_window,
+                                    daemon_p->dirty_budget);
     }
 
-    pthread_mutex_unlock(&daemon_p->request_io_queue_mutex);
+    /* Compressing keeps the CPU busy, it is not time blocked in I/O. */
+    if (msg.type != AKWBS_IO_COMPRESS_TYPE)
+      akwbs_pool_account_io(group, &io_start);
 
-    akwbs_do_io(msg.fd, msg.address, &msg.bytes, &msg.offset, msg.type);
+    /* Advice and closings are done and forgotten: no connection waits for them. */
+    if ((msg.type == AKWBS_IO_ADVISE_TYPE) || (msg.type == AKWBS_IO_CLOSE_TYPE))
+      continue;
 
     result_msg.bytes_read    = msg.bytes;
     result_msg.connection_fd = msg.sd;
-
-    posix_madvise(msg.address, msg.bytes, POSIX_MADV_SEQUENTIAL);
+    result_msg.type          = msg.type;
+    result_msg.address       = msg.address;
+    result_msg.synced_offset = msg.synced_offset;
+    result_msg.connection    = msg.connection;
 
     akwbs_result_io_send_msg(&result_msg, daemon_p->result_io_queue[AKWBS_WRITE_INDEX]);
 
@@ -128,6 +159,8 @@ void *akwbs_thread_io_routine(void *arg)
 
   pthread_cleanup_pop(0);
 
+  akwbs_pool_retired(worker);
+
   pthread_exit(NULL);
 
 }
@@ -0,0 +1,357 @@
+/*!
+ * \file   upload.c
+ * \brief  Uploaded files. A PUT body never touches the file being replaced: it is written
+ *         to a temporary file in the same directory, which is renamed over the target once
+ *         the whole body has landed. A ranged PUT is written into such a copy of the
+ *         target. Open files are never modified in place, so the caches keyed by inode
+ *         and the downloads under way never see contents change underneath them.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "upload.h"
+#include "connection.h"
+#include "daemon.h"
+#include "internal.h"
+#include "io.h"
+
+
+#define AKWBS_UPLOAD_FILE_MODE (S_IRWXU | S_IRWXG | S_IRWXO) /*!< Mode of uploaded files. */
+
+
+/*!
+ * Open a hidden, uniquely named temporary file in the target directory. Used where the
+ * file system does not support O_TMPFILE.
+ *
+ * \param upload param-return upload, with its directory opened. Its temporary name is set.
+ *
+ * \return descriptor of the temporary file, or AKWBS_ERROR on error.
+ */
+static int open_named_temp_file(struct akwbs_upload *upload)
+{
+  static unsigned long counter = 0;
+  int fd = AKWBS_ERROR;
+  int attempts;
+
+
+  /* Working threads open uploads concurrently. */
+  for (attempts = 0; attempts < 8; attempts++)
+  {
+    snprintf(upload->temp_name,
+             sizeof(upload->temp_name),
+             ".akwbs-%ld-%lu.tmp",
+             (long)getpid(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+    fd = openat(upload->directory_descriptor,
+                upload->temp_name,
+                O_CREAT | O_EXCL | O_WRONLY | O_NONBLOCK | O_CLOEXEC,
+                AKWBS_UPLOAD_FILE_MODE);
+
+    if ((fd != AKWBS_ERROR) || (errno != EEXIST))
+      break;
+  }
+
+  if (fd == AKWBS_ERROR)
+    upload->temp_name[0] = '\0';
+
+  return fd;
+}
+
+
+/*!
+ * Reserve the blocks of a body of known length before it is written, so that concurrent
+ * uploads are laid out contiguously and a full disk is found before any byte is received.
+ * The size of the file is kept, so it always tells how much of the body has landed.
+ *
+ * \param connection connection whose upload has just been opened.
+ *
+ * \return AKWBS_SUCCESS on success, or where the file system cannot preallocate.
+ *         AKWBS_ERROR on error, errno is then ENOSPC or EDQUOT if space is insufficient.
+ */
+static int preallocate(struct akwbs_connection *connection)
+{
+  if ((connection->is_chunked == AKWBS_YES) || (connection->file_total_offset <= 0))
+    return AKWBS_SUCCESS;
+
+  if (fallocate(connection->file_descriptor,
+                FALLOC_FL_KEEP_SIZE,
+                connection->file_cur_offset,
+                connection->file_total_offset - connection->file_cur_offset) == AKWBS_SUCCESS)
+    return AKWBS_SUCCESS;
+
+  if ((errno == EOPNOTSUPP) || (errno == ENOSYS))
+    return AKWBS_SUCCESS;
+
+  return AKWBS_ERROR;
+}
+
+
+/*!
+ * Open an unnamed temporary file in the target directory, or a named one where the file
+ * system does not support O_TMPFILE.
+ *
+ * \param upload param-return upload, with its directory opened.
+ *
+ * \return descriptor of the temporary file, or AKWBS_ERROR on error.
+ */
+static int open_temp_file(struct akwbs_upload *upload)
+{
+  int fd = openat(upload->directory_descriptor,
+                  ".",
+                  O_TMPFILE | O_WRONLY | O_NONBLOCK | O_CLOEXEC,
+                  AKWBS_UPLOAD_FILE_MODE);
+
+
+  if ((fd == AKWBS_ERROR)
+      && ((errno == EOPNOTSUPP) || (errno == EISDIR) || (errno == EINVAL)))
+    fd = open_named_temp_file(upload);
+
+  return fd;
+}
+
+
+/*!
+ * Stage a ranged upload in a copy of the target, which it replaces like any upload once
+ * the range has landed. A query only reads the size of the target, and never creates it.
+ *
+ * \param connection connection whose upload is ranged, with its directory opened.
+ *
+ * \return AKWBS_SUCCESS on success, the size held is then set.
+ *         AKWBS_ERROR on error, errno is then ENOSPC or EDQUOT if space is insufficient.
+ *
+ * \details The bytes held are copied with copy_file_range, which shares their extents
+ *          on XFS and btrfs. Of two ranged uploads of a target at once, the one published
+ *          last wins.
+ */
+static int open_staged_copy(struct akwbs_connection *connection)
+{
+  struct akwbs_upload *upload = &connection->upload;
+  struct stat stat_buf;
+  off_t offset = 0;
+  int source   = AKWBS_ERROR;
+  int ret      = AKWBS_SUCCESS;
+
+
+  upload->held_size = 0;
+
+  source = openat(upload->directory_descriptor,
+                  upload->target_name,
+                  O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+  if ((source == AKWBS_ERROR)
+      && ((upload->is_query == AKWBS_YES) || (errno != ENOENT)))
+    return AKWBS_ERROR;
+
+  if (source != AKWBS_ERROR)
+  {
+    if (fstat(source, &stat_buf) == AKWBS_ERROR)
+      return (close(source), AKWBS_ERROR);
+
+    upload->held_size = stat_buf.st_size;
+  }
+
+  if (upload->is_query == AKWBS_YES)
+  {
+    connection->file_descriptor = source;
+    return AKWBS_SUCCESS;
+  }
+
+  connection->file_descriptor = open_temp_file(upload);
+
+  if ((connection->file_descriptor != AKWBS_ERROR) && (upload->held_size > 0))
+    ret = akwbs_copy_file(source, upload->held_size, connection->file_descriptor, &offset);
+
+  if (source != AKWBS_ERROR)
+    close(source);
+
+  if ((connection->file_descriptor == AKWBS_ERROR) || (ret == AKWBS_ERROR))
+    return AKWBS_ERROR;
+
+  return preallocate(connection);
+}
+
+
+/*!
+ * Open the directory of the target of a PUT. The name of the target is copied, as the
+ * request header holding it is overwritten by the body.
+ *
+ * \param connection connection whose request has just been processed.
+ *
+ * \return AKWBS_SUCCESS on success. AKWBS_ERROR on error.
+ */
+int akwbs_upload_open_directory(struct akwbs_connection *connection)
+{
+  struct akwbs_upload *upload = &connection->upload;
+  char directory[PATH_MAX];
+  char *slash = NULL;
+  int length  = 0;
+
+
+  upload->directory_descriptor = AKWBS_ERROR;
+  upload->target_name          = NULL;
+  upload->temp_name[0]         = '\0';
+  upload->is_published         = AKWBS_NO;
+
+  length = snprintf(directory,
+                    sizeof(directory),
+                    "%s%s",
+                    connection->daemon_ref->root_path,
+                    connection->file_name);
+
+  if ((length < 0) || ((size_t)length >= sizeof(directory)))
+    return AKWBS_ERROR;
+
+  slash = strrchr(directory, '/');
+
+  if ((slash == NULL) || (slash[1] == '\0'))
+    return AKWBS_ERROR;
+
+  upload->target_name = strdup(slash + 1);
+
+  if (upload->target_name == NULL)
+    return AKWBS_ERROR;
+
+  if (slash == directory)
+    slash++;
+
+  *slash = '\0';
+
+  upload->directory_descriptor = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (upload->directory_descriptor == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Open the file receiving the body of a PUT, once its directory is open, and reserve its
+ * space when the length of the body is known.
+ *
+ * \param connection connection whose upload directory is open.
+ *
+ * \return AKWBS_SUCCESS on success, the connection file descriptor is then set.
+ *         AKWBS_ERROR on error, errno is then ENOSPC or EDQUOT if space is insufficient.
+ */
+int akwbs_upload_open_file(struct akwbs_connection *connection)
+{
+  struct akwbs_upload *upload = &connection->upload;
+
+
+  if (upload->is_ranged == AKWBS_YES)
+    return open_staged_copy(connection);
+
+  connection->file_descriptor = open_temp_file(upload);
+
+  if (connection->file_descriptor == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  return preallocate(connection);
+}
+
+
+/*!
+ * Give the completely written upload its name, replacing the previous file atomically.
+ * An unnamed O_TMPFILE is first linked under a temporary name, as linkat cannot replace
+ * an existing file, then renamed. Once the last byte of a ranged upload is in, its copy
+ * is first cut to the announced total.
+ *
+ * \param connection connection whose upload is completely written.
+ *
+ * \return AKWBS_SUCCESS on success.
+ *         AKWBS_ERROR on error, the upload is then discarded.
+ */
+int akwbs_upload_publish(struct akwbs_connection *connection)
+{
+  struct akwbs_upload *upload = &connection->upload;
+  char proc_path[32];
+
+
+  if ((upload->is_ranged == AKWBS_YES)
+      && (upload->total_size == connection->file_total_offset)
+      && (upload->held_size > upload->total_size)
+      && (ftruncate(connection->file_descriptor, upload->total_size) == AKWBS_ERROR))
+    return AKWBS_ERROR;
+
+  if (upload->temp_name[0] == '\0')
+  {
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", connection->file_descriptor);
+    snprintf(upload->temp_name,
+             sizeof(upload->temp_name),
+             ".akwbs-%ld-fd%d.tmp",
+             (long)getpid(),
+             connection->file_descriptor);
+
+    /* A name left behind by a crashed server cannot be in use: it is replaced. */
+    if ((linkat(AT_FDCWD,
+                proc_path,
+                upload->directory_descriptor,
+                upload->temp_name,
+                AT_SYMLINK_FOLLOW) == AKWBS_ERROR)
+        && ((errno != EEXIST)
+            || (unlinkat(upload->directory_descriptor, upload->temp_name, 0) == AKWBS_ERROR)
+            || (linkat(AT_FDCWD,
+                       proc_path,
+                       upload->directory_descriptor,
+                       upload->temp_name,
+                       AT_SYMLINK_FOLLOW) == AKWBS_ERROR)))
+    {
+      upload->temp_name[0] = '\0';
+      return AKWBS_ERROR;
+    }
+  }
+
+  if (renameat(upload->directory_descriptor,
+               upload->temp_name,
+               upload->directory_descriptor,
+               upload->target_name) == AKWBS_ERROR)
+    return AKWBS_ERROR;
+
+  upload->temp_name[0] = '\0';
+  upload->is_published = AKWBS_YES;
+
+  return AKWBS_SUCCESS;
+}
+
+
+/*!
+ * Release the resources of an upload, complete or not. An unpublished temporary file is
+ * removed.
+ *
+ * \param connection connection being closed.
+ */
+void akwbs_upload_release(struct akwbs_connection *connection)
+{
+  struct akwbs_upload *upload = &connection->upload;
+
+
+  if ((upload->temp_name[0] != '\0') && (upload->directory_descriptor != AKWBS_ERROR))
+    unlinkat(upload->directory_descriptor, upload->temp_name, 0);
+
+  upload->temp_name[0] = '\0';
+
+  if (upload->directory_descriptor != AKWBS_ERROR)
+    close(upload->directory_descriptor);
+
+  upload->directory_descriptor = AKWBS_ERROR;
+
+  if (connection->file_descriptor != AKWBS_ERROR)
+    close(connection->file_descriptor);
+
+  connection->file_descriptor = AKWBS_ERROR;
+
+  free(upload->target_name);
+  upload->target_name = NULL;
+}
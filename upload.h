@@ -0,0 +1,51 @@
+/*!
+ * \file   upload.h
+ * \brief  Uploaded files: written aside, then published atomically under their name.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_UPLOAD_H_
+#define _AKWBS_MT_UPLOAD_H_
+
+#include <sys/types.h>
+
+
+#define AKWBS_UPLOAD_TEMP_NAME_SIZE 48  /*!< Room for the name of a temporary file.     */
+
+
+struct akwbs_connection;
+
+
+/*!
+ * An upload in progress. The body is written to an unnamed O_TMPFILE, or to a hidden
+ * temporary file where O_TMPFILE is not supported, in the target directory. It gets its
+ * name only once complete, so readers see either the old file or the whole new one.
+ * A ranged upload, resuming or appending, is written into a copy of the target.
+ */
+struct akwbs_upload
+{
+  int directory_descriptor;     /*!< Target directory, or -1.                           */
+
+  char *target_name;            /*!< Name of the file in its directory.                 */
+
+  char temp_name
+    [AKWBS_UPLOAD_TEMP_NAME_SIZE]; /*!< Name of the temporary file, empty if unnamed.   */
+
+  int is_published;             /*!< The file has been given its name.                  */
+
+  int is_ranged;                /*!< The body is written at an offset of a copy.        */
+  int is_query;                 /*!< The request only asks for the bytes held.          */
+  off_t total_size;             /*!< Final size of a ranged upload, or -1 if unknown.   */
+  off_t held_size;              /*!< Size of the file when a ranged upload opened it.   */
+};
+
+
+/*
+ * Public Interface.
+ */
+int akwbs_upload_open_directory(struct akwbs_connection *connection);
+int akwbs_upload_open_file(struct akwbs_connection *connection);
+int akwbs_upload_publish(struct akwbs_connection *connection);
+void akwbs_upload_release(struct akwbs_connection *connection);
+
+#endif /* END OF upload.h */
@@ -0,0 +1,180 @@
+/*!
+ * \file   writeback.c
+ * \brief  Writeback control of uploads. Once the write offset leaves a window behind,
+ *         the window is handed to the device; once the following one is left behind too,
+ *         the first is waited for and dropped from the page cache. Uploads thus keep
+ *         about two windows dirty each, and a device budget bounds all of them together.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "writeback.h"
+#include "connection.h"
+#include "daemon.h"
+#include "internal.h"
+#include "requestio.h"
+
+
+/*!
+ * Find the dirty byte account of the device holding the uploaded file of a connection.
+ * Called by the daemon thread, once the file is opened.
+ *
+ * \param connection connection uploading a file.
+ */
+void akwbs_writeback_open(struct akwbs_connection *connection)
+{
+  struct akwbs_daemon *daemon_p = connection->daemon_ref;
+  dev_t device = connection->opening.stat_buf.st_dev;
+  unsigned int i;
+
+
+  connection->writeback_device = NULL;
+  connection->synced_offset    = connection->file_cur_offset;
+
+  if (daemon_p->writeback_window == 0)
+    return;
+
+  for (i = 0; i < daemon_p->writeback_devices_count; i++)
+    if (daemon_p->writeback_devices[i].device == device)
+    {
+      connection->writeback_device = &daemon_p->writeback_devices[i];
+      return;
+    }
+
+  /* Without an account, the upload is still windowed, but not budgeted. */
+  if (daemon_p->writeback_devices_count == AKWBS_WRITEBACK_MAX_DEVICES)
+    return;
+
+  daemon_p->writeback_devices[i].device      = device;
+  daemon_p->writeback_devices[i].dirty_bytes = 0;
+  daemon_p->writeback_devices_count++;
+
+  connection->writeback_device = &daemon_p->writeback_devices[i];
+}
+
+
+/*!
+ * Remove the bytes of an upload not known on disk from the account of its device.
+ * They are left to the kernel writeback, or to the durability sync. Called by the daemon
+ * thread when the upload ends, whether complete or not.
+ *
+ * \param connection connection uploading a file.
+ */
+void akwbs_writeback_release(struct akwbs_connection *connection)
+{
+  if (connection->writeback_device == NULL)
+    return;
+
+  __atomic_sub_fetch(&connection->writeback_device->dirty_bytes,
+                     (long)(connection->file_cur_offset - connection->synced_offset),
+                     __ATOMIC_RELAXED);
+
+  connection->writeback_device = NULL;
+}
+
+
+/*!
+ * Apply the writeback policy after a write of an upload. Called by working threads; the
+ * windows are computed from the offsets alone, so no state is kept between writes.
+ *
+ * \param msg param-return request of the write just performed, with its offset moved
+ *        past the written bytes. Its synced offset is updated.
+ * \param window size of the writeback windows, in bytes.
+ * \param budget maximum dirty bytes of uploads per device, or 0 for no budget.
+ */
+void akwbs_writeback_after_write(struct akwbs_request_io_msg *msg,
+                                 unsigned long window,
+                                 unsigned long budget)
+{
+  struct akwbs_writeback_device *device = msg->writeback_device;
+  off_t end       = msg->offset;
+  off_t start     = end - msg->bytes;
+  off_t completed = 0;
+  off_t target    = 0;
+  long dirty      = 0;
+
+
+  if ((window == 0) || (msg->bytes <= 0))
+    return;
+
+  completed = end - end % (off_t)window;
+  target    = completed - (off_t)window;
+
+  if (device != NULL)
+    dirty = __atomic_add_fetch(&device->dirty_bytes, (long)msg->bytes, __ATOMIC_RELAXED);
+
+  /* Windows left behind by this write are handed to the device, without waiting. */
+  if (completed > start - start % (off_t)window)
+    sync_file_range(msg->fd,
+                    start - start % (off_t)window,
+                    completed - (start - start % (off_t)window),
+                    SYNC_FILE_RANGE_WRITE);
+
+  /* Over budget, the writer waits for everything it wrote: it is throttled. */
+  if ((budget > 0) && (dirty > (long)budget))
+    target = end;
+
+  if (target <= msg->synced_offset)
+    return;
+
+  sync_file_range(msg->fd,
+                  msg->synced_offset,
+                  target - msg->synced_offset,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                  | SYNC_FILE_RANGE_WAIT_AFTER);
+
+  posix_fadvise(msg->fd,
+                msg->synced_offset,
+                target - msg->synced_offset,
+                POSIX_FADV_DONTNEED);
+
+  if (device != NULL)
+    __atomic_sub_fetch(&device->dirty_bytes,
+                       (long)(target - msg->synced_offset),
+                       __ATOMIC_RELAXED);
+
+  msg->synced_offset = target;
+}
+
+
+/*!
+ * Check whether the writeback policy has nothing to do after a write but account it:
+ * it hands no window to the device and waits for none. Such a write may be done by the
+ * event loop.
+ *
+ * \param msg request of the write, not performed yet.
+ * \param window size of the writeback windows, in bytes.
+ * \param budget maximum dirty bytes of uploads per device, or 0 for no budget.
+ *
+ * \return AKWBS_YES if so, AKWBS_NO otherwise. With a budget, whether the writer is over
+ *         it is only known once its bytes are accounted, so the answer is always no.
+ */
+int akwbs_writeback_is_silent(struct akwbs_request_io_msg *msg,
+                              unsigned long window,
+                              unsigned long budget)
+{
+  off_t start     = msg->offset;
+  off_t end       = msg->offset + msg->bytes;
+  off_t completed = 0;
+
+
+  if (window == 0)
+    return AKWBS_YES;
+
+  if (budget > 0)
+    return AKWBS_NO;
+
+  completed = end - end % (off_t)window;
+
+  if (completed > start - start % (off_t)window)
+    return AKWBS_NO;
+
+  if (completed - (off_t)window > msg->synced_offset)
+    return AKWBS_NO;
+
+  return AKWBS_YES;
+}
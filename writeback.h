@@ -0,0 +1,44 @@
+/*!
+ * \file   writeback.h
+ * \brief  Writeback control of uploads: dirty pages are flushed and dropped in windows
+ *         behind the write offset, instead of piling up in the page cache.
+ * \author Henrique Nascimento Gouveia <h.gouveia@icloud.com>
+ */
+
+#ifndef _AKWBS_MT_WRITEBACK_H_
+#define _AKWBS_MT_WRITEBACK_H_
+
+#include <sys/types.h>
+
+
+#define AKWBS_WRITEBACK_MAX_DEVICES 16  /*!< Devices with a dirty byte account.          */
+
+
+struct akwbs_connection;
+struct akwbs_request_io_msg;
+
+
+/*!
+ * Dirty bytes of uploads on a device. Accounts are created by the daemon thread; their
+ * counter is updated atomically by working threads.
+ */
+struct akwbs_writeback_device
+{
+  dev_t device;                 /*!< Device of the account.                             */
+  long  dirty_bytes;            /*!< Bytes written by uploads, not yet known on disk.   */
+};
+
+
+/*
+ * Public Interface.
+ */
+void akwbs_writeback_open(struct akwbs_connection *connection);
+void akwbs_writeback_release(struct akwbs_connection *connection);
+void akwbs_writeback_after_write(struct akwbs_request_io_msg *msg,
+                                 unsigned long window,
+                                 unsigned long budget);
+int akwbs_writeback_is_silent(struct akwbs_request_io_msg *msg,
+                              unsigned long window,
+                              unsigned long budget);
+
+#endif /* END OF writeback.h */